@@ -5,6 +5,7 @@
 #include <iostream>
 #include <iterator>
 #include <string>
+#include <limits>
 #include "tipl/tipl.hpp"
 #include "tracking/region/Regions.h"
 #include "libs/tracking/tract_model.hpp"
@@ -92,14 +93,23 @@ void export_track_info(const std::string& file_name,
         {
             file_name_stat += ".nii.gz";
             std::cout << "export TDI to " << file_name_stat << std::endl;
-            tract_model.save_tdi(file_name_stat.c_str(),false,cmd == "tdi_end",handle->trans_to_mni);
+            tract_model.save_tdi(file_name_stat.c_str(),1.0f,cmd == "tdi_end",handle->trans_to_mni);
             continue;
         }
-        if(cmd == "tdi2" || cmd == "tdi2_end")
+        // tdi2 or tdi2_end uses 4x super-sampling, which can be changed by tdi2:8 or tdi2_end:8
+        if(cmd.find("tdi2:") == 0 || cmd.find("tdi2_end:") == 0 || cmd == "tdi2" || cmd == "tdi2_end")
         {
+            float ratio = 4.0f;
+            bool end_point = cmd.find("tdi2_end") == 0;
+            if(cmd.find(':') != std::string::npos)
+            {
+                ratio = float(std::atof(cmd.substr(cmd.find(':')+1).c_str()));
+                // e.g. tdi2:8 is saved as *.tdi2_8.nii.gz
+                file_name_stat[file_name_stat.rfind(':')] = '_';
+            }
             file_name_stat += ".nii.gz";
             std::cout << "export subvoxel TDI to " << file_name_stat << std::endl;
-            tract_model.save_tdi(file_name_stat.c_str(),true,cmd == "tdi2_end",handle->trans_to_mni);
+            tract_model.save_tdi(file_name_stat.c_str(),ratio,end_point,handle->trans_to_mni);
             continue;
         }
         if(cmd == "tdi_color" || cmd == "tdi2_color")
@@ -254,7 +264,18 @@ int ana(void)
             std::cout << file_name << " does not exist. terminating..." << std::endl;
             return 1;
         }
-        if (!tract_model.load_from_file(file_name.c_str()))
+        bool loaded = false;
+        // --tract_range=first,count loads only part of a .tkc file
+        // without count, all tracts from first to the end are loaded
+        if(po.has("tract_range"))
+        {
+            QStringList range = QString(po.get("tract_range").c_str()).split(",");
+            size_t count = range.size() > 1 ? range[1].toULongLong() : std::numeric_limits<size_t>::max();
+            loaded = tract_model.load_range_from_file(file_name.c_str(),range[0].toULongLong(),count);
+        }
+        else
+            loaded = tract_model.load_from_file(file_name.c_str());
+        if (!loaded)
         {
             std::cout << "Cannot open file " << file_name << std::endl;
             return 1;
@@ -173,6 +173,7 @@ int rec(void)
     handle->voxel.r2_weighted = po.get("r2_weighted",int(0));
     handle->voxel.csf_calibration = po.get("csf_calibration",int(0)) && method_index == 4;
     handle->voxel.thread_count = po.get("thread_count",int(std::thread::hardware_concurrency()));
+    handle->voxel.voxel_major_dwi = po.get("dwi_cache",int(0));
 
 
 
@@ -4,6 +4,7 @@
 #include <iostream>
 #include <iterator>
 #include <string>
+#include <chrono>
 #include "tipl/tipl.hpp"
 #include "tracking/region/Regions.h"
 #include "libs/tracking/tract_model.hpp"
@@ -24,13 +25,30 @@ void save_connectivity_matrix(TractModel& tract_model,
                               ConnectivityMatrix& data,
                               const std::string& source,
                               const std::string& connectivity_roi,
-                              const std::string& connectivity_value,
+                              const std::vector<std::string>& connectivity_values,
                               double t,
                               bool use_end_only)
 {
     std::cout << "count tracks by " << (use_end_only ? "ending":"passing") << std::endl;
-    std::cout << "calculate matrix using " << connectivity_value << std::endl;
-    if(!data.calculate(tract_model,connectivity_value,use_end_only,t))
+    // all matrix values except trk are calculated in one pass
+    std::vector<std::string> matrix_value_types;
+    for(unsigned int k = 0;k < connectivity_values.size();++k)
+        if(connectivity_values[k] == "trk")
+        {
+            std::cout << "calculate matrix using trk" << std::endl;
+            if(!data.calculate(tract_model,"trk",use_end_only,t))
+                std::cout << "Connectivity calculation error:" << data.error_msg << std::endl;
+        }
+        else
+            matrix_value_types.push_back(connectivity_values[k]);
+    if(matrix_value_types.empty())
+        return;
+    std::cout << "calculate matrix using";
+    for(unsigned int k = 0;k < matrix_value_types.size();++k)
+        std::cout << " " << matrix_value_types[k];
+    std::cout << std::endl;
+    std::vector<tipl::image<float,2> > matrix_values;
+    if(!data.calculate(tract_model,matrix_value_types,use_end_only,t,matrix_values))
     {
         std::cout << "Connectivity calculation error:" << data.error_msg << std::endl;
         return;
@@ -40,28 +58,31 @@ void save_connectivity_matrix(TractModel& tract_model,
         std::cout << "The ROIs have a large overlapping area (ratio="
                   << data.overlap_ratio << "). The network measure calculated may not be reliable" << std::endl;
     }
-    if(connectivity_value == "trk")
-        return;
-    std::string file_name_stat(source);
-    file_name_stat += ".";
-    file_name_stat += (QFileInfo(connectivity_roi.c_str()).exists()) ? QFileInfo(connectivity_roi.c_str()).baseName().toStdString():connectivity_roi;
-    file_name_stat += ".";
-    file_name_stat += connectivity_value;
-    file_name_stat += use_end_only ? ".end":".pass";
-    std::string network_measures(file_name_stat),connectogram(file_name_stat);
-    file_name_stat += ".connectivity.mat";
-    std::cout << "export connectivity matrix to " << file_name_stat << std::endl;
-    data.save_to_file(file_name_stat.c_str());
-    connectogram += ".connectogram.txt";
-    std::cout << "export connectogram to " << connectogram << std::endl;
-    data.save_to_connectogram(connectogram.c_str());
-
-    network_measures += ".network_measures.txt";
-    std::cout << "export network measures to " << network_measures << std::endl;
-    std::string report;
-    data.network_property(report);
-    std::ofstream out(network_measures.c_str());
-    out << report;
+    for(unsigned int k = 0;k < matrix_value_types.size();++k)
+    {
+        const std::string& connectivity_value = matrix_value_types[k];
+        data.matrix_value.swap(matrix_values[k]);
+        std::string file_name_stat(source);
+        file_name_stat += ".";
+        file_name_stat += (QFileInfo(connectivity_roi.c_str()).exists()) ? QFileInfo(connectivity_roi.c_str()).baseName().toStdString():connectivity_roi;
+        file_name_stat += ".";
+        file_name_stat += connectivity_value;
+        file_name_stat += use_end_only ? ".end":".pass";
+        std::string network_measures(file_name_stat),connectogram(file_name_stat);
+        file_name_stat += ".connectivity.mat";
+        std::cout << "export connectivity matrix to " << file_name_stat << std::endl;
+        data.save_to_file(file_name_stat.c_str());
+        connectogram += ".connectogram.txt";
+        std::cout << "export connectogram to " << connectogram << std::endl;
+        data.save_to_connectogram(connectogram.c_str());
+
+        network_measures += ".network_measures.txt";
+        std::cout << "export network measures to " << network_measures << std::endl;
+        std::string report;
+        data.network_property(report,po.get("sparse_network",int(0)));
+        std::ofstream out(network_measures.c_str());
+        out << report;
+    }
 }
 void get_roi_label(QString file_name,std::map<int,std::string>& label_map,
                           std::map<int,tipl::rgb>& label_color,bool is_freesurfer,bool mute_cmd);
@@ -183,9 +204,11 @@ void get_connectivity_matrix(std::shared_ptr<fib_data> handle,
                 data.set_regions(handle->dim,regions);
             }
         }
-        for(unsigned int j = 0;j < connectivity_type_list.size();++j)
+        std::vector<std::string> connectivity_values;
         for(unsigned int k = 0;k < connectivity_value_list.size();++k)
-            save_connectivity_matrix(tract_model,data,source,roi_file_name,connectivity_value_list[k].toStdString(),
+            connectivity_values.push_back(connectivity_value_list[k].toStdString());
+        for(unsigned int j = 0;j < connectivity_type_list.size();++j)
+            save_connectivity_matrix(tract_model,data,source,roi_file_name,connectivity_values,
                                      po.get("connectivity_threshold",0.001),
                                      connectivity_type_list[j].toLower() == QString("end"));
     }
@@ -403,7 +426,7 @@ int trk_post(std::shared_ptr<fib_data> handle,
         in >> method >> count >> detail >> name;
         std::cout << "Cluster method=" << method << std::endl;
         std::cout << "Cluster count=" << count << std::endl;
-        std::cout << "Cluster resolution (if method is 0) = " << detail << " mm" << std::endl;
+        std::cout << "Cluster resolution (if method is 0 or 3) = " << detail << " mm" << std::endl;
         std::cout << "Run clustering." << std::endl;
         tract_model.run_clustering(method,count,detail);
         std::ofstream out(name);
@@ -559,6 +582,11 @@ int trk(std::shared_ptr<fib_data> handle)
         cnt_type = po.get("connectometry_type").c_str();
     }
     TractModel tract_model(handle);
+    if(po.get("fiber_table",int(1)) == 0)
+    {
+        std::cout << "compact fiber table disabled" << std::endl;
+        tract_model.get_fib().compact_fiber_table = false;
+    }
 
     if(po.get("thread_count",int(std::thread::hardware_concurrency())) < 1)
     {
@@ -660,14 +688,63 @@ int trk(std::shared_ptr<fib_data> handle)
     }
 
 
-    std::cout << "start tracking." << std::endl;
+    std::string file_name;
+    if (po.has("output"))
+        file_name = po.get("output");
+    else
+    {
+        std::ostringstream fout;
+        fout << po.get("source") << ".trk.gz";
+        file_name = fout.str();
+    }
 
+    // write tracts directly to the output file without keeping them in memory
+    if(po.get("stream",int(0)))
+    {
+        // streamed tracts are not kept, so nothing can be done with them after tracking
+        const char* post_options[] = {"delete_repeat","trim","ref","cluster","end_point","connectivity","export"};
+        std::string ignored;
+        for(const char* option : post_options)
+            if(po.has(option))
+                ignored += std::string(" --") + option;
+        if(!ignored.empty())
+        {
+            std::cout << "--stream=1 cannot be used with" << ignored
+                      << " because the tracts are not kept after tracking." << std::endl;
+            return 1;
+        }
+        tracking_thread.sink = create_tract_sink(file_name,handle->dim,handle->vs,handle->trans_to_mni);
+        if(!tracking_thread.sink.get())
+        {
+            std::cout << "Cannot stream tracks to " << file_name
+                      << ". Only .trk.gz, .tck, .tkc, and .nii.gz (track density) are supported." << std::endl;
+            return 1;
+        }
+        if(tracking_thread.param.tip_iteration)
+            std::cout << "Topology-informed pruning is not applied to streamed output." << std::endl;
+        std::cout << "start tracking." << std::endl;
+        tracking_thread.run(tract_model.get_fib(),po.get("thread_count",int(std::thread::hardware_concurrency())),true);
+        std::cout << tract_model.report << tracking_thread.report.str() << std::endl;
+        if(!tracking_thread.sink->close())
+        {
+            std::cout << "Cannot save tracks as " << tracking_thread.sink->file_name << ". Please check write permission, directory, and disk space." << std::endl;
+            return 1;
+        }
+        std::cout << "a total of " << tracking_thread.sink->get_count() << " tracts are streamed to " << tracking_thread.sink->file_name << std::endl;
+        return 0;
+    }
+
+    std::cout << "start tracking." << std::endl;
+    auto tracking_begin = std::chrono::steady_clock::now();
     tracking_thread.run(tract_model.get_fib(),po.get("thread_count",int(std::thread::hardware_concurrency())),true);
+    float tracking_time = std::chrono::duration<float>(std::chrono::steady_clock::now()-tracking_begin).count();
     tract_model.report += tracking_thread.report.str();
     std::cout << tract_model.report << std::endl;
 
     tracking_thread.fetchTracks(&tract_model);
-    std::cout << "finished tracking." << std::endl;
+    std::cout << "finished tracking in " << tracking_time << " seconds ("
+              << tracking_thread.get_total_tract_count()/std::max<float>(tracking_time,0.001f) << " tracts/sec, "
+              << tracking_thread.get_total_seed_count()/std::max<float>(tracking_time,0.001f) << " seeds/sec)." << std::endl;
 
     for(int i = 0;i < tracking_thread.param.tip_iteration;++i)
         tract_model.trim();
@@ -678,15 +755,5 @@ int trk(std::shared_ptr<fib_data> handle)
         return 0;
     }
     std::cout << "a total of " << tract_model.get_visible_track_count() << " tracts are generated" << std::endl;
-
-    std::string file_name;
-    if (po.has("output"))
-        file_name = po.get("output");
-    else
-    {
-        std::ostringstream fout;
-        fout << po.get("source") << ".trk.gz";
-        file_name = fout.str();
-    }
     return trk_post(handle,tract_model,file_name,true/*save track*/);
 }
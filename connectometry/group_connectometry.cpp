@@ -351,7 +351,8 @@ void group_connectometry::calculate_FDR(void)
         if(timer.get())
             timer->stop();
 
-        vbc->save_tracks_files();
+        if(!vbc->save_tracks_files())
+            QMessageBox::information(this,"Error",vbc->error_msg.c_str(),0);
     }
     std::string output;
     vbc->generate_report(output);
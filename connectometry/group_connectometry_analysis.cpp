@@ -71,7 +71,7 @@ int group_connectometry_analysis::run_track(const tracking_data& fib,std::vector
         t.add_tracts(tracks);
         for(int i = 0;i < track_trimming && t.get_visible_track_count();++i)
             t.trim();
-        tracks.swap(t.get_tracts());
+        t.release_tracts(tracks);
     }
     return tracks.size();
 }
@@ -96,6 +96,7 @@ void group_connectometry_analysis::run_permutation_multithread(unsigned int id,u
     connectometry_result data;
     tracking_data fib;
     fib.read(*handle);
+    fib.compact_fiber_table = false;// fa is replaced by the SPM maps below
     std::vector<std::vector<float> > tracks;
     const int max_visible_track = 1000000;
     {
@@ -205,7 +206,7 @@ void group_connectometry_analysis::wait(void)
 }
 
 
-void group_connectometry_analysis::save_tracks_files(void)
+bool group_connectometry_analysis::save_tracks_files(void)
 {
     for(int i = 0;i < threads.size();++i)
         threads[i]->wait();
@@ -280,12 +281,27 @@ void group_connectometry_analysis::save_tracks_files(void)
         {
             std::ostringstream out1;
             out1 << output_file_name << ".t_statistics.fib.gz";
+            // the odfs are left in the database file until requested
+            if(!handle->load_deferred_matrices())
+            {
+                error_msg = handle->error_msg;
+                return false;
+            }
             gz_mat_write mat_write(out1.str().c_str());
+            if(!mat_write)
+            {
+                error_msg = "Cannot output file " + out1.str();
+                return false;
+            }
+            size_t odf_count = 0;
             for(unsigned int i = 0;i < handle->mat_reader.size();++i)
             {
                 std::string name = handle->mat_reader.name(i);
+                if(is_odf_matrix(name))
+                    ++odf_count;
                 if(name == "dimension" || name == "voxel_size" ||
-                        name == "odf_vertices" || name == "odf_faces" || name == "trans")
+                        name == "odf_vertices" || name == "odf_faces" || name == "trans" ||
+                        is_odf_matrix(name))
                     mat_write.write(handle->mat_reader[i]);
                 if(name == "fa0")
                     mat_write.write("qa_map",handle->dir.fa[0],1,handle->dim.size());
@@ -302,9 +318,27 @@ void group_connectometry_analysis::save_tracks_files(void)
                 mat_write.write(out3.str().c_str(),spm_map->pos_corr_ptr[i],1,handle->dim.size());
                 mat_write.write(out4.str().c_str(),spm_map->neg_corr_ptr[i],1,handle->dim.size());
             }
+            if(!close_mat_writer(mat_write))
+            {
+                error_msg = "Cannot output file " + out1.str();
+                return false;
+            }
+            // read back the variable names to make sure that all odf blocks were saved
+            mat_directory saved;
+            size_t saved_odf_count = 0;
+            if(saved.scan(out1.str().c_str()))
+                for(size_t i = 0;i < saved.size();++i)
+                    if(is_odf_matrix(saved.name(i)))
+                        ++saved_odf_count;
+            if(saved_odf_count != odf_count)
+            {
+                error_msg = "The odfs were not completely saved to " + out1.str();
+                return false;
+            }
         }
 
     }
+    return true;
 }
 
 void group_connectometry_analysis::run_permutation(unsigned int thread_count,unsigned int permutation_count)
@@ -68,7 +68,7 @@ public:
     std::shared_ptr<TractModel> neg_corr_track;
     std::shared_ptr<connectometry_result> spm_map;
     std::string pos_corr_tracks_result,neg_corr_tracks_result;
-    void save_tracks_files(void);
+    bool save_tracks_files(void);
 public:// Multiple regression
     std::shared_ptr<stat_model> model;
     float tracking_threshold;
@@ -575,5 +575,5 @@ bool DwiHeader::output_src(const char* di_file,std::vector<std::shared_ptr<DwiHe
     }
     report1 += report2;
     write_mat.write("report",report1.c_str(),1,(unsigned int)report1.length());
-    return true;
+    return close_mat_writer(write_mat);
 }
@@ -63,6 +63,7 @@ HEADERS += mainwindow.h \
     tracking/slice_view_scene.h \
     opengl/glwidget.h \
     libs/tracking/tracking_method.hpp \
+    libs/tracking/batch_tracking.hpp \
     libs/tracking/roi.hpp \
     libs/tracking/interpolation_process.hpp \
     libs/tracking/fib_data.hpp \
@@ -72,6 +73,8 @@ HEADERS += mainwindow.h \
     tracking/region/Regions.h \
     tracking/region/RegionModel.h \
     libs/tracking/tract_model.hpp \
+    libs/tracking/tract_arena.hpp \
+    libs/tracking/tract_chunk_file.hpp \
     tracking/tract/tracttablewidget.h \
     opengl/renderingtablewidget.h \
     qcolorcombobox.h \
@@ -143,6 +146,7 @@ SOURCES += main.cpp \
     tracking/region/Regions.cpp \
     tracking/region/RegionModel.cpp \
     libs/tracking/tract_model.cpp \
+    libs/tracking/tract_chunk_file.cpp \
     tracking/tract/tracttablewidget.cpp \
     opengl/renderingtablewidget.cpp \
     qcolorcombobox.cpp \
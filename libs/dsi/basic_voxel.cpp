@@ -1,3 +1,4 @@
+#include <limits>
 #include <boost/math/special_functions/sinc.hpp>
 #include "basic_voxel.hpp"
 #include "image_model.hpp"
@@ -13,6 +14,7 @@ void Voxel::init(void)
     voxel_data.resize(thread_count);
     for (unsigned int index = 0; index < thread_count; ++index)
     {
+        voxel_data[index].thread_id = index;
         voxel_data[index].space.resize(bvalues.size());
         voxel_data[index].odf.resize(ti.half_vertices_count);
         voxel_data[index].fa.resize(max_fiber_number);
@@ -21,6 +23,83 @@ void Voxel::init(void)
     }
     for (unsigned int index = 0; index < process_list.size(); ++index)
         process_list[index]->init(*this);
+    panel_process_count = 0;
+    while(panel_process_count < process_list.size() &&
+          process_list[panel_process_count]->has_panel(*this))
+        ++panel_process_count;
+}
+
+void Voxel::build_voxel_major_dwi(void)
+{
+    free_voxel_major_dwi();
+    size_t row_count = 0;
+    for(size_t index = 0;index < mask.size();++index)
+        if(mask[index])
+            ++row_count;
+    // a full mask (e.g. the QSDR QA map) would duplicate the whole dwi data
+    if(row_count == mask.size())
+        return;
+    const unsigned int no_row = std::numeric_limits<unsigned int>::max();
+    dwi_voxel_row.resize(mask.size());
+    row_count = 0;
+    for(unsigned int index = 0;index < mask.size();++index)
+        dwi_voxel_row[index] = mask[index] ? row_count++ : no_row;
+    size_t dwi_count = dwi_data.size();
+    dwi_voxel_major.resize(size_t(row_count)*dwi_count);
+    // transpose block by block: each block reads a short run of every dwi volume
+    const unsigned int block_size = 4096;
+    tipl::par_for((mask.size()+block_size-1)/block_size,[&](unsigned int block)
+    {
+        unsigned int from = block*block_size;
+        unsigned int to = std::min<unsigned int>(mask.size(),from+block_size);
+        for(size_t i = 0;i < dwi_count;++i)
+        {
+            const unsigned short* dwi = dwi_data[i];
+            for(unsigned int index = from;index < to;++index)
+                if(dwi_voxel_row[index] != no_row)
+                    dwi_voxel_major[size_t(dwi_voxel_row[index])*dwi_count+i] = dwi[index];
+        }
+    });
+}
+void Voxel::free_voxel_major_dwi(void)
+{
+    std::vector<unsigned short>().swap(dwi_voxel_major);
+    std::vector<unsigned int>().swap(dwi_voxel_row);
+}
+
+void panel_product(const float* A,const float* B,float* C,unsigned int n,unsigned int k,unsigned int m)
+{
+    // 4-by-4 tiles of C kept in registers, each summed in the same order as vector_product
+    for(unsigned int i = 0;i < n;i += 4)
+        for(unsigned int j = 0;j < m;j += 4)
+        {
+            unsigned int ni = std::min<unsigned int>(4,n-i);
+            unsigned int nj = std::min<unsigned int>(4,m-j);
+            const float* a0 = A+size_t(i)*k;
+            const float* a1 = A+size_t(i+std::min<unsigned int>(1,ni-1))*k;
+            const float* a2 = A+size_t(i+std::min<unsigned int>(2,ni-1))*k;
+            const float* a3 = A+size_t(i+std::min<unsigned int>(3,ni-1))*k;
+            const float* b0 = B+size_t(j)*k;
+            const float* b1 = B+size_t(j+std::min<unsigned int>(1,nj-1))*k;
+            const float* b2 = B+size_t(j+std::min<unsigned int>(2,nj-1))*k;
+            const float* b3 = B+size_t(j+std::min<unsigned int>(3,nj-1))*k;
+            float c00 = 0.0f,c01 = 0.0f,c02 = 0.0f,c03 = 0.0f,
+                  c10 = 0.0f,c11 = 0.0f,c12 = 0.0f,c13 = 0.0f,
+                  c20 = 0.0f,c21 = 0.0f,c22 = 0.0f,c23 = 0.0f,
+                  c30 = 0.0f,c31 = 0.0f,c32 = 0.0f,c33 = 0.0f;
+            for(unsigned int l = 0;l < k;++l)
+            {
+                float x0 = a0[l],x1 = a1[l],x2 = a2[l],x3 = a3[l];
+                float y0 = b0[l],y1 = b1[l],y2 = b2[l],y3 = b3[l];
+                c00 += x0*y0;c01 += x0*y1;c02 += x0*y2;c03 += x0*y3;
+                c10 += x1*y0;c11 += x1*y1;c12 += x1*y2;c13 += x1*y3;
+                c20 += x2*y0;c21 += x2*y1;c22 += x2*y2;c23 += x2*y3;
+                c30 += x3*y0;c31 += x3*y1;c32 += x3*y2;c33 += x3*y3;
+            }
+            float c[4][4] = {{c00,c01,c02,c03},{c10,c11,c12,c13},{c20,c21,c22,c23},{c30,c31,c32,c33}};
+            for(unsigned int ti = 0;ti < ni;++ti)
+                std::copy(c[ti],c[ti]+nj,C+size_t(i+ti)*m+j);
+        }
 }
 
 void Voxel::calculate_sinc_ql(std::vector<float>& sinc_ql)
@@ -133,6 +212,50 @@ void Voxel::run(void)
             ++total_voxel;
 
     size_t total = 0;
+    if(panel_process_count)
+    {
+        std::vector<unsigned int> voxel_list;
+        voxel_list.reserve(total_voxel);
+        for(unsigned int index = 0;index < mask.size();++index)
+            if (mask[index])
+                voxel_list.push_back(index);
+        size_t panel_count = (voxel_list.size()+panel_size-1)/panel_size;
+        tipl::par_for2(panel_count,
+                        [&](int panel_index,int thread_id)
+        {
+            ++total;
+            if(terminated)
+                return;
+            if(thread_id == 0)
+            {
+                if(prog_aborted())
+                {
+                    terminated = true;
+                    return;
+                }
+                check_prog(total*100/panel_count,100);
+            }
+            VoxelData& data = voxel_data[thread_id];
+            data.panel_voxel.assign(voxel_list.begin()+size_t(panel_index)*panel_size,
+                                    voxel_list.begin()+std::min<size_t>(voxel_list.size(),size_t(panel_index+1)*panel_size));
+            data.odf_panel.clear();
+            for (unsigned int index = 0; index < panel_process_count; ++index)
+                process_list[index]->run_panel(*this,data);
+            size_t space_size = data.space_panel.size()/data.panel_voxel.size();
+            size_t odf_size = data.odf_panel.size()/data.panel_voxel.size();
+            for(size_t i = 0;i < data.panel_voxel.size();++i)
+            {
+                data.init();
+                data.voxel_index = data.panel_voxel[i];
+                data.space.assign(data.space_panel.begin()+i*space_size,data.space_panel.begin()+(i+1)*space_size);
+                if(odf_size)
+                    data.odf.assign(data.odf_panel.begin()+i*odf_size,data.odf_panel.begin()+(i+1)*odf_size);
+                for (unsigned int index = panel_process_count; index < process_list.size(); ++index)
+                    process_list[index]->run(*this,data);
+            }
+        },thread_count);
+    }
+    else
     tipl::par_for2(mask.size(),
                     [&](int voxel_index,int thread_id)
     {
@@ -153,6 +276,8 @@ void Voxel::run(void)
         for (int index = 0; index < process_list.size(); ++index)
             process_list[index]->run(*this,voxel_data[thread_id]);
     },thread_count);
+    for (unsigned int index = 0; index < process_list.size(); ++index)
+        process_list[index]->reduce(*this);
     check_prog(1,1);
     }
     catch(std::exception& error)
@@ -163,7 +288,8 @@ void Voxel::run(void)
     {
         std::cout << "unknown error" << std::endl;
     }
-
+    // only the process runs read the voxel-major copy
+    free_voxel_major_dwi();
 }
 
 
@@ -20,22 +20,66 @@ public:
     virtual void run(Voxel&, VoxelData&) {}
     virtual void end(Voxel&,gz_mat_write&) {}
     virtual ~BaseProcess(void) {}
+public:// batched mode: processes all voxels in VoxelData::panel_voxel at once
+    virtual bool has_panel(Voxel&) {return false;}
+    virtual void run_panel(Voxel&, VoxelData&) {}
+public:// merges the per-thread partials of run() into Voxel, called after all voxels and before any end()
+    virtual void reduce(Voxel&) {}
 };
 
+// one partial result per worker thread (indexed by VoxelData::thread_id), each on its own cache line.
+// Partials are combined in thread order, so min/max results do not depend on the scheduling.
+template<class value_type>
+class ThreadPartial
+{
+    struct padded_value{
+        value_type value;
+        char padding[64];
+    };
+    std::vector<padded_value> partial;
+public:
+    void init(unsigned int thread_count,const value_type& value = value_type())
+    {
+        partial.clear();
+        partial.resize(thread_count);
+        for(unsigned int index = 0;index < thread_count;++index)
+            partial[index].value = value;
+    }
+    value_type& operator[](unsigned int thread_id){return partial[thread_id].value;}
+    const value_type& operator[](unsigned int thread_id) const{return partial[thread_id].value;}
+    unsigned int size(void) const{return partial.size();}
+    template<class fun_type>
+    value_type reduce(value_type result,fun_type fun) const
+    {
+        for(unsigned int index = 0;index < partial.size();++index)
+            result = fun(result,partial[index].value);
+        return result;
+    }
+};
+
+// C(n-by-m) = A(n-by-k) * transpose(B(m-by-k))
+void panel_product(const float* A,const float* B,float* C,unsigned int n,unsigned int k,unsigned int m);
+
 
 
 struct VoxelData
 {
+    unsigned int thread_id;
     unsigned int voxel_index;
     std::vector<float> space;
     std::vector<float> odf;
     std::vector<float> odf1,odf2;
+    std::vector<float> shaped_odf;// scratch copy used by odf resolving
     std::vector<float> fa;
     std::vector<float> rdi;
     std::vector<tipl::vector<3,float> > dir;
     std::vector<short> dir_index;
     float min_odf;
     tipl::matrix<3,3,float> jacobian;
+public:// batched mode: signals and odfs of the panel voxels, stored voxel by voxel
+    std::vector<unsigned int> panel_voxel;
+    std::vector<float> space_panel;
+    std::vector<float> odf_panel;
 
     void init(void)
     {
@@ -61,10 +105,24 @@ public:
     std::vector<const unsigned short*> dwi_data;
     std::vector<tipl::vector<3,float> > bvectors;
     std::vector<float> bvalues;
+public:// voxel-major copy of dwi_data for the masked voxels, built by ReadDWIData
+    // and freed at the end of run(). It is not built for a full-volume mask.
+    bool voxel_major_dwi = false;
+    std::vector<unsigned short> dwi_voxel_major;
+    std::vector<unsigned int> dwi_voxel_row;
+    void build_voxel_major_dwi(void);
+    void free_voxel_major_dwi(void);
+    const unsigned short* get_voxel_dwi(unsigned int voxel_index) const
+    {
+        return &dwi_voxel_major[size_t(dwi_voxel_row[voxel_index])*dwi_data.size()];
+    }
 
     std::string report,steps;
     std::ostringstream recon_report, step_report;
     unsigned int thread_count = 1;
+    // leading processes that handle panel_size voxels at a time
+    unsigned int panel_size = 256;
+    unsigned int panel_process_count = 0;
     void load_from_src(ImageModel& image_model);
 public:
     unsigned char method_id;
@@ -297,7 +297,8 @@ const char* ImageModel::reconstruction(void)
         default:
             return "Unknown method";
         }
-        save_fib(out.str());
+        if(!save_fib(out.str()))
+            return "Cannot save the FIB file";
         output_name = file_name + out.str();
     }
     catch (std::exception& e)
@@ -339,9 +340,9 @@ bool output_odfs(const tipl::image<unsigned char,3>& mni_mask,
     std::copy(vs,vs+3,image_model.voxel.vs.begin());
     if (prog_aborted() || !image_model.reconstruct<reprocess_odf>("Template reconstruction"))
         return false;
-    image_model.save_fib(ext);
+    bool result = image_model.save_fib(ext);
     image_model.voxel.template_odfs.swap(odfs);
-    return true;
+    return result;
 }
 
 
@@ -378,13 +378,14 @@ public:
 
 class EstimateZ0_MNI : public BaseProcess
 {
-    std::vector<float> samples;
-    std::mutex mutex;
+    ThreadPartial<std::vector<float> > samples;
+    ThreadPartial<float> max_min_odf;
 public:
     void init(Voxel& voxel)
     {
         voxel.z0 = 0.0;
-        samples.reserve(20);
+        samples.init(voxel.thread_count);
+        max_min_odf.init(voxel.thread_count,0.0f);
     }
     void run(Voxel& voxel, VoxelData& data)
     {
@@ -395,23 +396,30 @@ public:
             if((cur_pos-voxel.csf_pos1).length() <= 1.0 || (cur_pos-voxel.csf_pos2).length() <= 1.0 ||
                (cur_pos-voxel.csf_pos3).length() <= 1.0 || (cur_pos-voxel.csf_pos4).length() <= 1.0)
             {
-                std::lock_guard<std::mutex> lock(mutex);
                 if(voxel.r2_weighted) // multishell GQI2 gives negative ODF, use b0 as the scaling reference
-                    samples.push_back(data.space[0]);
+                    samples[data.thread_id].push_back(data.space[0]);
                 else
-                    samples.push_back(*std::min_element(data.odf.begin(),data.odf.end()));
+                    samples[data.thread_id].push_back(*std::min_element(data.odf.begin(),data.odf.end()));
             }
         }
         else
         // if other template is used
         {
-            voxel.z0 = std::max<float>(voxel.z0,*std::min_element(data.odf.begin(),data.odf.end()));
+            float& z0 = max_min_odf[data.thread_id];
+            z0 = std::max<float>(z0,*std::min_element(data.odf.begin(),data.odf.end()));
         }
     }
+    void reduce(Voxel& voxel)
+    {
+        voxel.z0 = max_min_odf.reduce(voxel.z0,[](float lhs,float rhs){return std::max<float>(lhs,rhs);});
+    }
     void end(Voxel& voxel,gz_mat_write&)
     {
-        if(!samples.empty())
-            voxel.z0 = tipl::median(samples.begin(),samples.end());
+        std::vector<float> all_samples;
+        for(unsigned int index = 0;index < samples.size();++index)
+            all_samples.insert(all_samples.end(),samples[index].begin(),samples[index].end());
+        if(!all_samples.empty())
+            voxel.z0 = tipl::median(all_samples.begin(),all_samples.end());
         if(voxel.z0 == 0.0)
             voxel.z0 = 1.0;
     }
@@ -59,6 +59,19 @@ public:
             tipl::mat::vector_product(&*sinc_ql.begin(),&*data.space.begin(),&*data.odf.begin(),
                                     tipl::dyndim(data.odf.size(),data.space.size()));
     }
+    // the q-space rotation of QSDR and gradient deviation is voxel-specific
+    virtual bool has_panel(Voxel& voxel) {return !voxel.qsdr && voxel.grad_dev.empty();}
+    virtual void run_panel(Voxel& voxel, VoxelData& data)
+    {
+        unsigned int n = data.panel_voxel.size();
+        unsigned int space_size = data.space_panel.size()/n;
+        unsigned int odf_size = sinc_ql.size()/space_size;
+        if(voxel.b0_index == 0 && voxel.half_sphere)
+            for(unsigned int i = 0;i < n;++i)
+                data.space_panel[i*space_size] *= 0.5;
+        data.odf_panel.resize(n*odf_size);
+        panel_product(&data.space_panel[0],&sinc_ql[0],&data.odf_panel[0],n,space_size,odf_size);
+    }
 };
 
 class dGQI_Recon : public BaseProcess{
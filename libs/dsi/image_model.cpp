@@ -1110,7 +1110,7 @@ void ImageModel::save_to_file(gz_mat_write& mat_writer)
     mat_writer.write("odf_faces",&*short_data.begin(),3,voxel.ti.faces.size());
 
 }
-void ImageModel::save_fib(const std::string& ext)
+bool ImageModel::save_fib(const std::string& ext)
 {
     std::string output_name = file_name;
     output_name += ext;
@@ -1124,6 +1124,7 @@ void ImageModel::save_fib(const std::string& ext)
     final_steps += voxel.step_report.str();
     final_steps += "[Step T2b][Run reconstruction]\n";
     mat_writer.write("steps",final_steps.c_str(),1,final_steps.length());
+    return close_mat_writer(mat_writer);
 }
 bool ImageModel::save_to_nii(const char* nifti_file_name) const
 {
@@ -1,19 +1,55 @@
 #ifndef ODF_TRANSFORMATION_PROCESS_HPP
 #define ODF_TRANSFORMATION_PROCESS_HPP
+#include <cstdio>
+#include <atomic>
+#include <future>
 #include <boost/math/special_functions/sinc.hpp>
 #include "basic_process.hpp"
 #include "basic_voxel.hpp"
 
 class ReadDWIData : public BaseProcess{
 public:
-    virtual void init(Voxel&) {}
+    virtual void init(Voxel& voxel)
+    {
+        if(voxel.voxel_major_dwi)
+            voxel.build_voxel_major_dwi();
+    }
     virtual void run(Voxel& voxel, VoxelData& data)
     {
         data.space.resize(voxel.dwi_data.size());
+        if(!voxel.dwi_voxel_major.empty())
+        {
+            const unsigned short* dwi = voxel.get_voxel_dwi(data.voxel_index);
+            std::copy(dwi,dwi+data.space.size(),data.space.begin());
+            return;
+        }
         for (unsigned int index = 0; index < data.space.size(); ++index)
             data.space[index] = voxel.dwi_data[index][data.voxel_index];
     }
     virtual void end(Voxel&,gz_mat_write&) {}
+public:
+    virtual bool has_panel(Voxel&) {return true;}
+    virtual void run_panel(Voxel& voxel, VoxelData& data)
+    {
+        unsigned int dwi_count = voxel.dwi_data.size();
+        data.space_panel.resize(data.panel_voxel.size()*dwi_count);
+        if(!voxel.dwi_voxel_major.empty())
+        {
+            for (unsigned int i = 0; i < data.panel_voxel.size(); ++i)
+            {
+                const unsigned short* dwi = voxel.get_voxel_dwi(data.panel_voxel[i]);
+                std::copy(dwi,dwi+dwi_count,data.space_panel.begin()+i*dwi_count);
+            }
+            return;
+        }
+        // one pass over each dwi volume for all panel voxels
+        for (unsigned int index = 0; index < dwi_count; ++index)
+        {
+            const unsigned short* dwi = voxel.dwi_data[index];
+            for (unsigned int i = 0,pos = index; i < data.panel_voxel.size(); ++i,pos += dwi_count)
+                data.space_panel[pos] = dwi[data.panel_voxel[i]];
+        }
+    }
 };
 
 
@@ -128,6 +164,21 @@ public:
         data.space.swap(new_data);
         tipl::mat::vector_product(trans.begin(),new_data.begin(),data.space.begin(),tipl::dyndim(new_q_count,old_q_count));
     }
+    virtual bool has_panel(Voxel&) {return true;}
+    virtual void run_panel(Voxel& voxel, VoxelData& data)
+    {
+        if(!voxel.scheme_balance)
+            return;
+        if(stored_voxel)
+        {
+            stored_voxel = 0;
+            voxel.bvalues = old_bvalues;
+            voxel.bvectors = old_bvectors;
+        }
+        std::vector<float> new_data(data.panel_voxel.size()*new_q_count);
+        panel_product(&data.space_panel[0],&trans[0],&new_data[0],data.panel_voxel.size(),old_q_count,new_q_count);
+        data.space_panel.swap(new_data);
+    }
 };
 
 struct GeneralizedFA
@@ -158,9 +209,87 @@ struct OutputODF : public BaseProcess
 protected:
     std::vector<std::vector<float> > odf_data;
     std::vector<unsigned int> odf_index_map;
+protected:// a block is moved to a temporary file in the background as soon as all its voxels are done
+    std::vector<unsigned int> block_voxel_count;
+    std::unique_ptr<std::atomic<unsigned int>[]> block_done_count;
+    std::unique_ptr<std::once_flag[]> block_allocated;
+    std::FILE* spill_file = 0;
+    bool spill_failed = false;
+    std::atomic<bool> allocation_failed{false};
+    std::vector<unsigned int> spill_order;
+    std::vector<std::future<void> > spill_jobs;
+    std::mutex spill_mutex,spill_file_mutex;
+    // returns false if the block cannot be allocated. The failure is reported by end().
+    bool allocate_block(Voxel& voxel,unsigned int block)
+    {
+        std::call_once(block_allocated[block],[&]()
+        {
+            try
+            {
+                odf_data[block].resize(size_t(block_voxel_count[block])*voxel.ti.half_vertices_count);
+            }
+            catch (...)
+            {
+                allocation_failed = true;
+            }
+        });
+        return !odf_data[block].empty();
+    }
+    void spill_block(unsigned int block)
+    {
+        std::lock_guard<std::mutex> lock(spill_mutex);
+        try
+        {
+            spill_jobs.push_back(std::async(std::launch::async,[this,block]()
+            {
+                std::lock_guard<std::mutex> lock(spill_file_mutex);
+                std::vector<float>& block_data = odf_data[block];
+                if(!spill_file || spill_failed || block_data.empty())
+                    return;
+                // a failed write leaves this and all later blocks in memory
+                if(std::fwrite(&block_data[0],sizeof(float),block_data.size(),spill_file) != block_data.size())
+                {
+                    spill_failed = true;
+                    return;
+                }
+                spill_order.push_back(block);// reserved in init()
+                std::vector<float>().swap(block_data);
+            }));
+        }
+        catch (...)
+        {
+            // no thread to write the block: it stays in memory
+        }
+    }
+    void close_spill_file(void)
+    {
+        for(unsigned int index = 0;index < spill_jobs.size();++index)
+            spill_jobs[index].wait();
+        spill_jobs.clear();
+        spill_order.clear();
+        if(spill_file)
+            std::fclose(spill_file);
+        spill_file = 0;
+    }
+    void write_block(Voxel& voxel,gz_mat_write& mat_writer,unsigned int block,std::vector<float>& block_data)
+    {
+        tipl::divide_constant(block_data,voxel.z0);
+        std::ostringstream out;
+        out << "odf" << block;
+        mat_writer.write(out.str().c_str(),&*block_data.begin(),
+                              voxel.ti.half_vertices_count,
+                              block_data.size()/(voxel.ti.half_vertices_count));
+    }
 public:
+    virtual ~OutputODF(void)
+    {
+        close_spill_file();
+    }
     virtual void init(Voxel& voxel)
     {
+        close_spill_file();
+        spill_failed = false;
+        allocation_failed = false;
         odf_data.clear();
         if (voxel.output_odf)
         {
@@ -173,45 +302,54 @@ public:
                     odf_index_map[index] = total_count;
                     ++total_count;
                 }
-            try
+            block_voxel_count.clear();
+            while (1)
             {
-                std::vector<unsigned int> size_list;
-                while (1)
-                {
 
-                    if (total_count > odf_block_size)
-                    {
-                        size_list.push_back(odf_block_size);
-                        total_count -= odf_block_size;
-                    }
-                    else
-                    {
-                        size_list.push_back(total_count);
-                        break;
-                    }
+                if (total_count > odf_block_size)
+                {
+                    block_voxel_count.push_back(odf_block_size);
+                    total_count -= odf_block_size;
                 }
-                odf_data.resize(size_list.size());
-                for (unsigned int index = 0;index < odf_data.size();++index)
-                    odf_data[index].resize(size_list[index]*(voxel.ti.half_vertices_count));
+                else
+                {
+                    block_voxel_count.push_back(total_count);
+                    break;
+                }
+            }
+            // blocks are allocated when first used
+            try
+            {
+                odf_data.resize(block_voxel_count.size());
+                block_done_count.reset(new std::atomic<unsigned int>[block_voxel_count.size()]);
+                block_allocated.reset(new std::once_flag[block_voxel_count.size()]);
+                spill_order.reserve(block_voxel_count.size());
+                spill_jobs.reserve(block_voxel_count.size());
             }
             catch (...)
             {
                 odf_data.clear();
                 throw std::runtime_error("Memory not enough for creating an ODF containing fib file.");
             }
+            for (unsigned int index = 0;index < block_voxel_count.size();++index)
+                block_done_count[index] = 0;
+            spill_file = std::tmpfile();
         }
 
     }
     virtual void run(Voxel& voxel,VoxelData& data)
     {
-
-        if (voxel.output_odf && data.fa[0] + 1.0 != 1.0)
-        {
-            unsigned int odf_index = odf_index_map[data.voxel_index];
+        if (!voxel.output_odf)
+            return;
+        unsigned int odf_index = odf_index_map[data.voxel_index];
+        unsigned int block = odf_index/odf_block_size;
+        if (!allocate_block(voxel,block))
+            return;
+        if (data.fa[0] + 1.0 != 1.0)
             std::copy(data.odf.begin(),data.odf.end(),
-                      odf_data[odf_index/odf_block_size].begin() + (odf_index%odf_block_size)*(voxel.ti.half_vertices_count));
-        }
-
+                      odf_data[block].begin() + (odf_index%odf_block_size)*(voxel.ti.half_vertices_count));
+        if (++block_done_count[block] == block_voxel_count[block])
+            spill_block(block);
     }
     virtual void end(Voxel& voxel,gz_mat_write& mat_writer)
     {
@@ -220,16 +358,33 @@ public:
             return;
         {
             set_title("Output ODFs");
-            for (unsigned int index = 0;index < odf_data.size();++index)
+            if (allocation_failed)
             {
-                tipl::divide_constant(odf_data[index],voxel.z0);
-                std::ostringstream out;
-                out << "odf" << index;
-                mat_writer.write(out.str().c_str(),&*odf_data[index].begin(),
-                                      voxel.ti.half_vertices_count,
-                                      odf_data[index].size()/(voxel.ti.half_vertices_count));
+                odf_data.clear();
+                close_spill_file();
+                throw std::runtime_error("Memory not enough for creating an ODF containing fib file.");
             }
+            for (unsigned int index = 0;index < spill_jobs.size();++index)
+                spill_jobs[index].wait();
+            // spilled blocks are read back in the order they were written
+            if (spill_file && !spill_order.empty())
+            {
+                std::rewind(spill_file);
+                std::vector<float> block_data;
+                for (unsigned int index = 0;index < spill_order.size();++index)
+                {
+                    unsigned int block = spill_order[index];
+                    block_data.resize(size_t(block_voxel_count[block])*voxel.ti.half_vertices_count);
+                    if (std::fread(&block_data[0],sizeof(float),block_data.size(),spill_file) != block_data.size())
+                        throw std::runtime_error("Cannot read the temporary ODF file.");
+                    write_block(voxel,mat_writer,block,block_data);
+                }
+            }
+            for (unsigned int index = 0;index < odf_data.size();++index)
+                if (!odf_data[index].empty())
+                    write_block(voxel,mat_writer,index,odf_data[index]);
             odf_data.clear();
+            close_spill_file();
         }
 
     }
@@ -344,6 +499,7 @@ protected:
 
 protected:
     float z0;
+    ThreadPartial<float> max_min_odf;
 public:
     virtual void init(Voxel& voxel)
     {
@@ -383,6 +539,7 @@ public:
         }
 
         voxel.z0 = 0.0;
+        max_min_odf.init(voxel.thread_count,0.0f);
     }
     virtual void run(Voxel& voxel, VoxelData& data)
     {
@@ -393,8 +550,8 @@ public:
         if(voxel.output_rdi)
             for (unsigned int index = 0;index < data.rdi.size();++index)
                 rdi[index][data.voxel_index] = data.rdi[index];
-        if(data.min_odf > voxel.z0)
-            voxel.z0 = data.min_odf;
+        if(data.min_odf > max_min_odf[data.thread_id])
+            max_min_odf[data.thread_id] = data.min_odf;
         if(voxel.compare_voxel) // DDI
         {
             for (unsigned int index = 0;index < voxel.max_fiber_number;++index)
@@ -412,6 +569,10 @@ public:
             tipl::minus(data.odf,data.odf1);
         }
     }
+    virtual void reduce(Voxel& voxel)
+    {
+        voxel.z0 = max_min_odf.reduce(voxel.z0,[](float lhs,float rhs){return rhs > lhs ? rhs : lhs;});
+    }
     virtual void end(Voxel& voxel,gz_mat_write& mat_writer)
     {
         set_title("output data");
@@ -602,14 +763,49 @@ struct ODFShaping
         }
     }
 };
+// keeps the largest distinct peak values in descending order, holding the same
+// entries as the first "capacity" items of a std::map<float,unsigned short,std::greater<float> >
+struct PeakTable
+{
+    float* value;
+    short* index;
+    unsigned int count;
+    unsigned int capacity;
+    PeakTable(float* value_,short* index_,unsigned int capacity_):
+        value(value_),index(index_),count(0),capacity(capacity_){}
+    void add(float v,unsigned short i)
+    {
+        unsigned int pos = 0;
+        while(pos < count && value[pos] > v)
+            ++pos;
+        if(pos < count && value[pos] == v)
+        {
+            index[pos] = short(i);
+            return;
+        }
+        if(pos >= capacity)
+            return;
+        if(count < capacity)
+            ++count;
+        for(unsigned int j = count-1;j > pos;--j)
+        {
+            value[j] = value[j-1];
+            index[j] = index[j-1];
+        }
+        value[pos] = v;
+        index[pos] = short(i);
+    }
+};
 struct SearchLocalMaximum
 {
-    std::vector<std::vector<unsigned short> > neighbor;
+    // neighbors of vertex i are neighbor_index[neighbor_offset[i]..neighbor_offset[i+1])
+    std::vector<unsigned int> neighbor_offset;
+    std::vector<unsigned short> neighbor_index;
     void init(Voxel& voxel)
     {
         unsigned int half_odf_size = voxel.ti.half_vertices_count;
         unsigned int faces_count = voxel.ti.faces.size();
-        neighbor.resize(voxel.ti.half_vertices_count);
+        std::vector<std::vector<unsigned short> > neighbor(half_odf_size);
         for (unsigned int index = 0;index < faces_count;++index)
         {
             short i1 = voxel.ti.faces[index][0];
@@ -628,25 +824,30 @@ struct SearchLocalMaximum
             neighbor[i3].push_back(i1);
             neighbor[i3].push_back(i2);
         }
+        neighbor_offset.resize(half_odf_size+1);
+        neighbor_index.clear();
+        for (unsigned int index = 0;index < half_odf_size;++index)
+        {
+            std::sort(neighbor[index].begin(),neighbor[index].end());
+            neighbor[index].erase(std::unique(neighbor[index].begin(),neighbor[index].end()),neighbor[index].end());
+            neighbor_offset[index] = neighbor_index.size();
+            neighbor_index.insert(neighbor_index.end(),neighbor[index].begin(),neighbor[index].end());
+        }
+        neighbor_offset[half_odf_size] = neighbor_index.size();
     }
-    void search(const std::vector<float>& old_odf,std::map<float,unsigned short,std::greater<float> >& max_table)
+    void search(const std::vector<float>& odf,PeakTable& max_table) const
     {
-        max_table.clear();
-        for (unsigned int index = 0;index < neighbor.size();++index)
+        const float* odf_ptr = &odf[0];
+        const unsigned short* nei = &neighbor_index[0];
+        for (unsigned int index = 0,size = neighbor_offset.size()-1;index < size;++index)
         {
-            float value = old_odf[index];
-            bool is_max = true;
-            std::vector<unsigned short>& nei = neighbor[index];
-            for (unsigned int j = 0;j < nei.size();++j)
-            {
-                if (value < old_odf[nei[j]])
-                {
-                    is_max = false;
-                    break;
-                }
-            }
-            if (is_max)
-                max_table[value] = (unsigned short)index;
+            float value = odf_ptr[index];
+            // no early exit: the comparisons are independent and can be vectorized
+            unsigned int greater_count = 0;
+            for (unsigned int j = neighbor_offset[index];j < neighbor_offset[index+1];++j)
+                greater_count += (value < odf_ptr[nei[j]]);
+            if (!greater_count)
+                max_table.add(value,(unsigned short)index);
         }
     }
 };
@@ -668,28 +869,25 @@ public:
     virtual void run(Voxel& voxel,VoxelData& data)
     {
         data.min_odf = *std::min_element(data.odf.begin(),data.odf.end());
-        std::map<float,unsigned short,std::greater<float> > max_table;
+        // peaks are collected in fa and dir_index, which hold max_fiber_number entries
+        PeakTable max_table(&data.fa[0],&data.dir_index[0],voxel.max_fiber_number);
         lm.search(data.odf,max_table);
         if(voxel.odf_resolving)
         {
-            std::vector<float> odf(data.odf);
+            std::vector<float>& odf = data.shaped_odf;
+            odf = data.odf;
             for (unsigned int index = 0;index < 3;++index)
             {
                 unsigned int max_dir = std::max_element(odf.begin(),odf.end())-odf.begin();
                 if(odf[max_dir] == 0.0f)
                     break;
                 if(index)
-                    max_table[data.odf[max_dir]] = (unsigned short)max_dir;
+                    max_table.add(data.odf[max_dir],(unsigned short)max_dir);
                 shaping.shape(odf,max_dir);
             }
         }
-        auto iter = max_table.begin();
-        auto end = max_table.end();
-        for (unsigned int index = 0;iter != end && index < voxel.max_fiber_number;++index,++iter)
-        {
-            data.dir_index[index] = iter->second;
-            data.fa[index] = iter->first - data.min_odf;
-        }
+        for (unsigned int index = 0;index < max_table.count;++index)
+            data.fa[index] -= data.min_odf;
     }
 };
 
@@ -138,6 +138,22 @@ public:
             if (data.odf[index] < 0.0)
                 data.odf[index] = 0.0;
     }
+    virtual bool has_panel(Voxel&) {return true;}
+    virtual void run_panel(Voxel&, VoxelData& data)
+    {
+        unsigned int n = data.panel_voxel.size();
+        unsigned int space_size = data.space_panel.size()/n;
+        std::vector<float> Ht_s(n*half_odf_size),x(n*half_odf_size);
+        panel_product(&data.space_panel[0],&Ht[0],&Ht_s[0],n,space_size,half_odf_size);
+        for (unsigned int i = 0; i < n; ++i)
+            tipl::mat::lu_solve(iHtH.begin(),iHtH_pivot.begin(),Ht_s.begin()+i*half_odf_size,x.begin()+i*half_odf_size,
+                                tipl::dyndim(half_odf_size,half_odf_size));
+        data.odf_panel.resize(n*half_odf_size);
+        panel_product(&x[0],&sG[0],&data.odf_panel[0],n,half_odf_size,half_odf_size);
+        for (unsigned int index = 0; index < data.odf_panel.size(); ++index)
+            if (data.odf_panel[index] < 0.0)
+                data.odf_panel[index] = 0.0;
+    }
 
 };
 
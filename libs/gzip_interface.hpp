@@ -5,9 +5,25 @@
 #else
 #include "zlib.h"
 #endif
+#include <thread>
+#include <future>
+#include <atomic>
+#include <cstring>
 #include "tipl/tipl.hpp"
 #include "prog_interface_static_link.h"
 extern bool prog_aborted_;
+// gzip members written by gz_ostream carry an extra field "DS" that stores the compressed
+// and uncompressed size of the member, so that a reader can locate all members from their
+// headers and inflate them in parallel.
+const unsigned int gz_member_header_size = 24;
+inline void gz_member_header(unsigned char* header,unsigned int member_size,unsigned int raw_size)
+{
+    const unsigned char fixed[16] = {0x1f,0x8b,8,4/*FEXTRA*/,0,0,0,0,0,255,12,0,'D','S',8,0};
+    std::copy(fixed,fixed+16,header);
+    std::memcpy(header+16,&member_size,4);
+    std::memcpy(header+20,&raw_size,4);
+}
+
 class gz_istream{
     size_t size_;
     std::ifstream in;
@@ -22,6 +38,131 @@ class gz_istream{
             return true;
         return false;
     }
+private:// parallel inflate of the members written by gz_ostream
+    struct member_info{
+        size_t offset,raw_offset;
+        unsigned int size,raw_size;
+    };
+    std::vector<member_info> members;
+    size_t next_member = 0;
+    size_t pos = 0;
+    std::vector<unsigned char> buffer;
+    size_t buffer_pos = 0;
+    bool past_end = false;
+    bool read_member_index(size_t file_size)
+    {
+        members.clear();
+        size_t raw_offset = 0;
+        for(size_t offset = 0;offset < file_size;)
+        {
+            unsigned char header[gz_member_header_size],expected[gz_member_header_size];
+            member_info info;
+            in.seekg(offset,std::ios::beg);
+            if(!in.read((char*)header,gz_member_header_size))
+                return false;
+            std::memcpy(&info.size,header+16,4);
+            std::memcpy(&info.raw_size,header+20,4);
+            gz_member_header(expected,info.size,info.raw_size);
+            if(!std::equal(header,header+gz_member_header_size,expected) ||
+               info.size < gz_member_header_size+8 || offset+info.size > file_size)
+                return false;
+            info.offset = offset;
+            info.raw_offset = raw_offset;
+            members.push_back(info);
+            offset += info.size;
+            raw_offset += info.raw_size;
+        }
+        size_ = raw_offset;
+        return !members.empty();
+    }
+    // inflates members [from,to) into dest with one thread per member
+    bool inflate_members(size_t from,size_t to,unsigned char* dest)
+    {
+        size_t file_from = members[from].offset;
+        std::vector<unsigned char> data(members[to-1].offset+members[to-1].size-file_from);
+        in.seekg(file_from,std::ios::beg);
+        if(!in.read((char*)&data[0],data.size()))
+            return false;
+        std::vector<char> result(to-from);
+        tipl::par_for(to-from,[&](unsigned int i)
+        {
+            const member_info& info = members[from+i];
+            if(!info.raw_size)
+            {
+                result[i] = 1;
+                return;
+            }
+            unsigned char* out = dest+info.raw_offset-members[from].raw_offset;
+            const unsigned char* member = &data[0]+info.offset-file_from;
+            z_stream strm = {};
+            if(inflateInit2(&strm,-15) != Z_OK)
+                return;
+            strm.next_in = (Bytef*)member+gz_member_header_size;
+            strm.avail_in = info.size-gz_member_header_size-8;
+            strm.next_out = out;
+            strm.avail_out = info.raw_size;
+            bool ended = (inflate(&strm,Z_FINISH) == Z_STREAM_END && strm.total_out == info.raw_size);
+            inflateEnd(&strm);
+            unsigned int crc = 0;
+            std::memcpy(&crc,member+info.size-8,4);
+            result[i] = ended && (crc == crc32(crc32(0L,Z_NULL,0),out,info.raw_size));
+        });
+        return std::find(result.begin(),result.end(),0) == result.end();
+    }
+    bool fill_buffer(size_t count = std::max<unsigned int>(1,std::thread::hardware_concurrency()))
+    {
+        size_t to = std::min<size_t>(members.size(),next_member+count);
+        if(next_member >= to)
+            return false;
+        buffer.resize(members[to-1].raw_offset+members[to-1].raw_size-members[next_member].raw_offset);
+        buffer_pos = 0;
+        if(!inflate_members(next_member,to,buffer.data()))
+        {
+            buffer.clear();
+            return false;
+        }
+        next_member = to;
+        return true;
+    }
+    size_t read_members(unsigned char* dest,size_t buf_size)
+    {
+        size_t total = 0;
+        while(buf_size)
+        {
+            if(buffer_pos < buffer.size())
+            {
+                size_t length = std::min<size_t>(buf_size,buffer.size()-buffer_pos);
+                std::copy(&buffer[0]+buffer_pos,&buffer[0]+buffer_pos+length,dest);
+                buffer_pos += length;
+                dest += length;
+                buf_size -= length;
+                total += length;
+                continue;
+            }
+            // members covered entirely by the request are inflated straight into it
+            size_t to = next_member,length = 0;
+            while(to < members.size() && to-next_member < 64 && length+members[to].raw_size <= buf_size)
+                length += members[to++].raw_size;
+            if(to > next_member)
+            {
+                if(!inflate_members(next_member,to,dest))
+                    break;
+                buffer.clear();
+                buffer_pos = 0;
+                next_member = to;
+                dest += length;
+                buf_size -= length;
+                total += length;
+                continue;
+            }
+            if(!fill_buffer())
+                break;
+        }
+        if(buf_size)
+            past_end = true;
+        pos += total;
+        return total;
+    }
 public:
     gz_istream(void):size_(0),handle(0){}
     ~gz_istream(void)
@@ -33,6 +174,10 @@ public:
     bool open(const char_type* file_name)
     {
         prog_aborted_ = false;
+        members.clear();
+        buffer.clear();
+        next_member = pos = buffer_pos = 0;
+        past_end = false;
         in.open(file_name,std::ios::binary);
         unsigned int gz_size = 0;
         if(in)
@@ -44,6 +189,9 @@ public:
         }
         if(is_gz(file_name))
         {
+            if(in && read_member_index(size_))
+                return true;
+            members.clear();
             in.close();
             if(size_ > gz_size) // size > 4G
                 size_ = size_*2;
@@ -62,6 +210,13 @@ public:
             check_prog(99,100);
         if(prog_aborted())
             return false;
+        if(!members.empty())
+        {
+            if(read_members((unsigned char*)buf,buf_size) == buf_size)
+                return true;
+            close();
+            return false;
+        }
         if(handle)
         {
 
@@ -91,16 +246,63 @@ public:
             }
         return false;
     }
-    void seek(long pos)
+    // reads up to buf_size bytes and returns the number of bytes read
+    size_t read_some(void* buf,size_t buf_size)
+    {
+        if(!members.empty())
+            return read_members((unsigned char*)buf,buf_size);
+        if(handle)
+        {
+            int result = gzread(handle,buf,(unsigned int)std::min<size_t>(buf_size,524288000));
+            return result > 0 ? size_t(result) : 0;
+        }
+        if(in)
+        {
+            in.read((char*)buf,buf_size);
+            return size_t(in.gcount());
+        }
+        return 0;
+    }
+    void seek(long pos_)
     {
+        if(!members.empty())
+        {
+            size_t new_pos = std::min<size_t>(pos_,size_);
+            // short seeks within the inflated buffer, e.g. when scanning matrix headers
+            if(!buffer.empty() && new_pos >= pos-buffer_pos && new_pos-(pos-buffer_pos) < buffer.size())
+            {
+                buffer_pos = new_pos-(pos-buffer_pos);
+                pos = new_pos;
+                past_end = false;
+                return;
+            }
+            next_member = std::upper_bound(members.begin(),members.end(),new_pos,
+                    [](size_t p,const member_info& info){return p < info.raw_offset;})-members.begin()-1;
+            buffer.clear();
+            buffer_pos = 0;
+            if(new_pos > members[next_member].raw_offset)
+            {
+                size_t skip = new_pos-members[next_member].raw_offset;
+                // random access: inflate only the member holding new_pos
+                if(!fill_buffer(1))
+                {
+                    close();
+                    return;
+                }
+                buffer_pos = skip;
+            }
+            pos = new_pos;
+            past_end = false;
+            return;
+        }
         if(handle)
         {
-            if(gzseek(handle,pos,SEEK_SET) == -1)
+            if(gzseek(handle,pos_,SEEK_SET) == -1)
                 close();
         }
         else
             if(in)
-                in.seekg(pos,std::ios::beg);
+                in.seekg(pos_,std::ios::beg);
     }
     void close(void)
     {
@@ -111,24 +313,50 @@ public:
         }
         if(in)
             in.close();
+        members.clear();
+        buffer.clear();
         check_prog(0,0);
     }
     size_t cur(void)
     {
+        if(!members.empty())
+            return pos;
         return handle ? (size_t)gztell(handle):(size_t)in.tellg();
     }
     size_t size(void)
     {
         return size_;
     }
-    bool good(void) const {return handle ? !gzeof(handle):in.good();}
+    // true for files written by gz_ostream, whose members can be located without inflating
+    bool random_access(void) const
+    {
+        return !members.empty();
+    }
+    bool good(void) const
+    {
+        if(!members.empty())
+            return !past_end;
+        return handle ? !gzeof(handle):in.good();
+    }
     operator bool() const	{return good();}
     bool operator!() const	{return !good();}
 };
 
 class gz_ostream{
     std::ofstream out;
-    gzFile handle;
+    bool gz = false;
+    bool opened = false;
+    bool has_member = false;
+    // data are deflated in blocks that become independent gzip members (as pigz does)
+    // so that the blocks can be compressed in parallel, and later inflated in parallel
+    // by gz_istream. The concatenated members are still a valid gzip file.
+    std::vector<std::vector<unsigned char> > blocks;
+    static const size_t block_size = 4194304;// 4mb
+    // a full batch of blocks is compressed and written by a background thread
+    // while the caller fills the next batch. Only that thread touches "out" meanwhile.
+    std::vector<std::vector<unsigned char> > writing_blocks;
+    std::future<void> writing;
+    std::atomic<bool> write_failed{false};
     bool is_gz(const char* file_name)
     {
         std::string filename = file_name;
@@ -139,8 +367,51 @@ class gz_ostream{
             return true;
         return false;
     }
+    void write_blocks(std::vector<std::vector<unsigned char> >& batch)
+    {
+        std::vector<std::vector<unsigned char> > member(batch.size());
+        std::vector<char> result(batch.size());
+        tipl::par_for(batch.size(),[&](unsigned int i)
+        {
+            z_stream strm = {};
+            if(deflateInit2(&strm,Z_DEFAULT_COMPRESSION,Z_DEFLATED,-15,8,Z_DEFAULT_STRATEGY) != Z_OK)
+                return;
+            unsigned int raw_size = batch[i].size();
+            member[i].resize(gz_member_header_size+deflateBound(&strm,raw_size)+8);
+            strm.next_in = batch[i].empty() ? Z_NULL : &batch[i][0];
+            strm.avail_in = raw_size;
+            strm.next_out = &member[i][0]+gz_member_header_size;
+            strm.avail_out = member[i].size()-gz_member_header_size-8;
+            result[i] = (deflate(&strm,Z_FINISH) == Z_STREAM_END);
+            unsigned int member_size = gz_member_header_size+strm.total_out+8;
+            deflateEnd(&strm);
+            member[i].resize(member_size);
+            gz_member_header(&member[i][0],member_size,raw_size);
+            unsigned int crc = crc32(crc32(0L,Z_NULL,0),batch[i].empty() ? Z_NULL : &batch[i][0],raw_size);
+            std::memcpy(&member[i][member_size-8],&crc,4);
+            std::memcpy(&member[i][member_size-4],&raw_size,4);
+        });
+        batch.clear();
+        for(size_t i = 0;i < member.size();++i)
+        {
+            if(!result[i])
+            {
+                out.setstate(std::ios::failbit);
+                break;
+            }
+            out.write((const char*)&member[i][0],member[i].size());
+            has_member = true;
+        }
+        if(!out.good())
+            write_failed = true;
+    }
+    void wait_writing(void)
+    {
+        if(writing.valid())
+            writing.get();
+    }
 public:
-    gz_ostream(void):handle(0){}
+    gz_ostream(void){}
     ~gz_ostream(void)
     {
         close();
@@ -149,47 +420,69 @@ public:
     template<class char_type>
     bool open(const char_type* file_name)
     {
-        if(is_gz(file_name))
-        {
-            handle = gzopen(file_name, "wb");
-            return handle;
-        }
+        close();
+        gz = is_gz(file_name);
+        has_member = false;
+        write_failed = false;
+        blocks.clear();
+        out.clear();
         out.open(file_name,std::ios::binary);
-        return out.good();
+        opened = out.good();
+        return opened;
     }
     void write(const void* buf,size_t size)
     {
-        if(handle)
+        if(!gz)
         {
-            const size_t block_size = 524288000;// 500mb
-            while(size > block_size)
+            if(out)
+                out.write((const char*)buf,size);
+            return;
+        }
+        if(!opened || write_failed)
+            return;
+        const unsigned char* ptr = (const unsigned char*)buf;
+        while(size)
+        {
+            if(blocks.empty() || blocks.back().size() == block_size)
             {
-                if(gzwrite(handle,buf,block_size) <= 0)
+                // one block per thread is compressed at a time
+                if(blocks.size() >= std::max<size_t>(1,std::thread::hardware_concurrency()))
                 {
-                    close();
-                    throw std::runtime_error("Cannot output gz file");
+                    wait_writing();
+                    if(write_failed)
+                        return;
+                    writing_blocks.swap(blocks);
+                    blocks.clear();
+                    writing = std::async(std::launch::async,[this](){write_blocks(writing_blocks);});
                 }
-                size -= block_size;
-                buf = (const char*)buf + block_size;
+                blocks.push_back(std::vector<unsigned char>());
+                blocks.back().reserve(block_size);
             }
-            if(gzwrite(handle,buf,(unsigned int)size) <= 0)
-                close();
+            size_t length = std::min<size_t>(size,block_size-blocks.back().size());
+            blocks.back().insert(blocks.back().end(),ptr,ptr+length);
+            ptr += length;
+            size -= length;
         }
-        else
-            if(out)
-                out.write((const char*)buf,size);
     }
-    void close(void)
+    // writes the remaining blocks and returns false if any data could not be written
+    bool close(void)
     {
-        if(handle)
+        wait_writing();
+        if(!out.is_open())
+            return good();
+        if(gz && !write_failed && (!blocks.empty() || !has_member))
         {
-            gzclose(handle);
-            handle = 0;
+            if(blocks.empty())
+                blocks.push_back(std::vector<unsigned char>());
+            write_blocks(blocks);
         }
-        if(out)
-            out.close();
+        blocks.clear();
+        out.close();
+        if(!out.good())
+            write_failed = true;
+        return good();
     }
-    bool good(void) const {return handle ? !gzeof(handle):out.good();}
+    bool good(void) const {return gz ? opened && !write_failed : out.good();}
     operator bool() const	{return good();}
     bool operator!() const	{return !good();}
 
@@ -200,4 +493,23 @@ typedef tipl::io::nifti_base<gz_istream,gz_ostream> gz_nifti;
 typedef tipl::io::mat_write_base<gz_ostream> gz_mat_write;
 typedef tipl::io::mat_read_base<gz_istream> gz_mat_read;
 
+// closes the file of a gz_mat_write and returns false if it was not completely written.
+// The last compressed blocks are written at close, so the writer has to be closed before
+// its state is checked. A writer without close() is closed by its destructor instead.
+template<class writer_type>
+auto close_mat_writer(writer_type& writer,int) -> decltype(writer.close(),bool())
+{
+    writer.close();
+    return !(!writer);
+}
+template<class writer_type>
+bool close_mat_writer(writer_type& writer,long)
+{
+    return !(!writer);
+}
+inline bool close_mat_writer(gz_mat_write& writer)
+{
+    return close_mat_writer(writer,0);
+}
+
 #endif // GZIP_INTERFACE_HPP
@@ -543,6 +543,11 @@ void connectometry_db::save_subject_vector(const char* output_name,
             matfile.write("mni_location",&mni_location[0],3,voxel_location.size());
             matfile.write("fiber_direction",&fiber_direction[0],3,voxel_location.size());
         }
+        if(!close_mat_writer(matfile))
+        {
+            handle->error_msg = "Cannot output file";
+            return;
+        }
     }
     check_prog(0,0);
 }
@@ -555,6 +560,7 @@ bool connectometry_db::save_subject_data(const char* output_name)
         handle->error_msg = "Cannot output file";
         return false;
     }
+    handle->load_deferred_matrices();
     for(unsigned int index = 0;index < handle->mat_reader.size();++index)
         if(handle->mat_reader[index].get_name() != "report" &&
            handle->mat_reader[index].get_name().find("subject") != 0)
@@ -583,6 +589,11 @@ bool connectometry_db::save_subject_data(const char* output_name)
         matfile.write("subject_report",&*subject_report.c_str(),1,(unsigned int)subject_report.length());
         matfile.write("report",&*report.c_str(),1,(unsigned int)report.length());
     }
+    if(!close_mat_writer(matfile))
+    {
+        handle->error_msg = "Cannot output file";
+        return false;
+    }
     modified = false;
     return true;
 }
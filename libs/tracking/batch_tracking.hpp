@@ -0,0 +1,401 @@
+#ifndef BATCH_TRACKING_HPP
+#define BATCH_TRACKING_HPP
+#include <vector>
+#include <memory>
+#include "tipl/tipl.hpp"
+#include "roi.hpp"
+#include "fib_data.hpp"
+#include "tracking_method.hpp"
+
+// The AVX2 kernel is compiled for its own function only and selected at run time,
+// so the rest of the program does not require an AVX2 processor.
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define BATCH_TRACKING_AVX2
+#define BATCH_TRACKING_AVX2_TARGET __attribute__((target("avx2")))
+inline bool cpu_has_avx2(void)
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+}
+#elif defined(_MSC_VER) && defined(_M_X64)
+#include <intrin.h>
+#include <immintrin.h>
+#define BATCH_TRACKING_AVX2
+#define BATCH_TRACKING_AVX2_TARGET
+inline bool cpu_has_avx2(void)
+{
+    int info[4];
+    __cpuid(info,0);
+    if(info[0] < 7)
+        return false;
+    __cpuid(info,1);
+    // AVX and OSXSAVE, and the OS saves the YMM registers
+    if((info[2] & (1 << 28)) == 0 || (info[2] & (1 << 27)) == 0 || (_xgetbv(0) & 6) != 6)
+        return false;
+    __cpuidex(info,7,0);
+    return (info[1] & (1 << 5)) != 0;
+}
+#endif
+
+// Advances batch_size streamlines (Euler, trilinear interpolation) in lockstep.
+// The walker states are kept as structure-of-arrays so that the direction lookup
+// of all lanes is evaluated together. A finished lane is retired and can be
+// refilled with a new seed by add(). The acceptance rules are shared with
+// TrackingMethod::start_tracking (add_forward_point, add_backward_point and accept_streamline).
+class BatchTrackingMethod{
+public:
+    static const unsigned int batch_size = 8;
+    enum {lane_free = 0,lane_forward = 1,lane_backward = 2};
+private:
+    const tracking_data& trk;
+    std::shared_ptr<RoiMgr> roi_mgr;
+private:// per-lane parameters
+    float fa_threshold[batch_size];
+    float dt_threshold[batch_size];
+    float tracking_angle[batch_size];
+    float tracking_smoothing[batch_size];
+    float step_size_in_voxel[3][batch_size];
+    int max_steps3[batch_size];
+    int min_steps3[batch_size];
+private:// per-lane walker states
+    float px[batch_size],py[batch_size],pz[batch_size];
+    float dx[batch_size],dy[batch_size],dz[batch_size];
+    float nx[batch_size],ny[batch_size],nz[batch_size];
+    unsigned char state[batch_size];
+    unsigned char terminated[batch_size];
+    tipl::vector<3,float> seed_pos[batch_size],begin_dir[batch_size],end_point1[batch_size];
+    std::vector<float> track_buffer[batch_size];
+    unsigned int buffer_front_pos[batch_size];
+    unsigned int buffer_back_pos[batch_size];
+    std::vector<float> reverse_buffer;
+    unsigned int active_count = 0;
+    bool use_avx2 = false;
+private:
+    tipl::vector<3,float> get_position(unsigned int lane) const
+    {
+        return tipl::vector<3,float>(px[lane],py[lane],pz[lane]);
+    }
+    void retire(unsigned int lane)
+    {
+        state[lane] = lane_free;
+        --active_count;
+    }
+    void begin_backward(unsigned int lane)
+    {
+        end_point1[lane] = get_position(lane);
+        terminated[lane] = 0;
+        px[lane] = seed_pos[lane][0];
+        py[lane] = seed_pos[lane][1];
+        pz[lane] = seed_pos[lane][2];
+        dx[lane] = -begin_dir[lane][0];
+        dy[lane] = -begin_dir[lane][1];
+        dz[lane] = -begin_dir[lane][2];
+        state[lane] = lane_backward;
+    }
+    template<class fun_type>
+    void finish(unsigned int lane,fun_type&& on_finish)
+    {
+        unsigned int buffer_size = buffer_back_pos[lane]-buffer_front_pos[lane];
+        const float* result = get_oriented_streamline(track_buffer[lane],reverse_buffer,
+                                                      buffer_front_pos[lane],buffer_back_pos[lane]);
+        if(accept_streamline(*roi_mgr,result,buffer_size,min_steps3[lane],get_position(lane),end_point1[lane]))
+            on_finish(result,buffer_size/3,fa_threshold[lane]);
+        retire(lane);
+    }
+private:
+    // select the fiber closest to the lane direction at one trilinear corner of each lane
+    void select_fib(const int* index,const unsigned char* active,
+                    float* sx,float* sy,float* sz,unsigned char* found) const
+    {
+#ifdef BATCH_TRACKING_AVX2
+        if(use_avx2)
+        {
+            select_fib_avx2(index,active,sx,sy,sz,found);
+            return;
+        }
+#endif
+        for(unsigned int lane = 0;lane < batch_size;++lane)
+        {
+            found[lane] = 0;
+            if(!active[lane])
+                continue;
+            tipl::vector<3,float> main_dir;
+            if(!trk.get_dir(index[lane],tipl::vector<3,float>(dx[lane],dy[lane],dz[lane]),main_dir,
+                            fa_threshold[lane],tracking_angle[lane],dt_threshold[lane]))
+                continue;
+            sx[lane] = main_dir[0];
+            sy[lane] = main_dir[1];
+            sz[lane] = main_dir[2];
+            found[lane] = 1;
+        }
+    }
+#ifdef BATCH_TRACKING_AVX2
+    BATCH_TRACKING_AVX2_TARGET
+    void select_fib_avx2(const int* index,const unsigned char* active,
+                         float* sx,float* sy,float* sz,unsigned char* found) const
+    {
+        const __m256 sign = _mm256_set1_ps(-0.0f);
+        __m256i idx = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(index));
+        __m256i idx3 = _mm256_add_epi32(idx,_mm256_add_epi32(idx,idx));
+        __m256 mask = _mm256_castsi256_ps(_mm256_cmpgt_epi32(
+                      _mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(active))),_mm256_setzero_si256()));
+        __m256 ref_x = _mm256_loadu_ps(dx),ref_y = _mm256_loadu_ps(dy),ref_z = _mm256_loadu_ps(dz);
+        __m256 threshold = _mm256_loadu_ps(fa_threshold);
+        __m256 dt = _mm256_loadu_ps(dt_threshold);
+        __m256 angle = _mm256_loadu_ps(tracking_angle);
+        __m256 max_value = angle;
+        __m256 bx = _mm256_setzero_ps(),by = _mm256_setzero_ps(),bz = _mm256_setzero_ps();
+        float gx_buf[batch_size],gy_buf[batch_size],gz_buf[batch_size];
+        // the compact fiber table (8-byte records of fa and findex) is used as get_nearest_dir_fib does,
+        // i.e. when it is built and no lane has a negative threshold
+        bool use_table = !trk.fiber_table.empty() &&
+                !_mm256_movemask_ps(_mm256_and_ps(mask,_mm256_cmp_ps(threshold,_mm256_setzero_ps(),_CMP_LT_OQ)));
+        const float* table_fa = nullptr;
+        const int* table_findex = nullptr;
+        const float* odf = nullptr;
+        __m256i record2 = _mm256_setzero_si256();
+        if(use_table)
+        {
+            table_fa = reinterpret_cast<const float*>(trk.fiber_table.data());
+            table_findex = reinterpret_cast<const int*>(trk.fiber_table.data())+1;
+            odf = trk.odf_table[0].begin();
+            __m256i record = _mm256_mask_i32gather_epi32(_mm256_set1_epi32(-1),
+                                reinterpret_cast<const int*>(trk.fiber_table_index.data()),idx,_mm256_castps_si256(mask),4);
+            // voxels without fibers are not found
+            mask = _mm256_andnot_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(record,_mm256_set1_epi32(-1))),mask);
+            record2 = _mm256_slli_epi32(record,1);
+        }
+        for (unsigned char fib = 0;fib < trk.fib_num;++fib)
+        {
+            __m256i record_fib = _mm256_add_epi32(record2,_mm256_set1_epi32(fib*2));
+            __m256 fa = use_table ? _mm256_mask_i32gather_ps(_mm256_setzero_ps(),table_fa,record_fib,mask,4):
+                                    _mm256_mask_i32gather_ps(_mm256_setzero_ps(),trk.fa[fib],idx,mask,4);
+            __m256 valid = _mm256_and_ps(mask,_mm256_cmp_ps(fa,threshold,_CMP_NLE_UQ));
+            if(!trk.dt_fa.empty())
+            {
+                __m256 dt_fa = _mm256_mask_i32gather_ps(_mm256_setzero_ps(),trk.dt_fa[fib],idx,mask,4);
+                valid = _mm256_and_ps(valid,_mm256_cmp_ps(dt_fa,dt,_CMP_NLE_UQ));
+            }
+            if(_mm256_testz_ps(valid,valid))
+                continue;
+            __m256 gx,gy,gz;
+            if(!trk.dir.empty())
+            {
+                gx = _mm256_mask_i32gather_ps(_mm256_setzero_ps(),trk.dir[fib],idx3,valid,4);
+                gy = _mm256_mask_i32gather_ps(_mm256_setzero_ps(),trk.dir[fib]+1,idx3,valid,4);
+                gz = _mm256_mask_i32gather_ps(_mm256_setzero_ps(),trk.dir[fib]+2,idx3,valid,4);
+            }
+            else if(use_table)
+            {
+                __m256i findex = _mm256_and_si256(_mm256_mask_i32gather_epi32(_mm256_setzero_si256(),
+                                    table_findex,record_fib,_mm256_castps_si256(valid),4),_mm256_set1_epi32(0xFFFF));
+                __m256i findex3 = _mm256_add_epi32(findex,_mm256_add_epi32(findex,findex));
+                gx = _mm256_mask_i32gather_ps(_mm256_setzero_ps(),odf,findex3,valid,4);
+                gy = _mm256_mask_i32gather_ps(_mm256_setzero_ps(),odf+1,findex3,valid,4);
+                gz = _mm256_mask_i32gather_ps(_mm256_setzero_ps(),odf+2,findex3,valid,4);
+            }
+            else
+            {
+                for(unsigned int lane = 0;lane < batch_size;++lane)
+                {
+                    const tipl::vector<3,float>& d = active[lane] ?
+                                trk.odf_table[trk.findex[fib][index[lane]]] : trk.odf_table[0];
+                    gx_buf[lane] = d[0];
+                    gy_buf[lane] = d[1];
+                    gz_buf[lane] = d[2];
+                }
+                gx = _mm256_loadu_ps(gx_buf);
+                gy = _mm256_loadu_ps(gy_buf);
+                gz = _mm256_loadu_ps(gz_buf);
+            }
+            __m256 value = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(ref_x,gx),_mm256_mul_ps(ref_y,gy)),_mm256_mul_ps(ref_z,gz));
+            __m256 neg_value = _mm256_xor_ps(value,sign);
+            __m256 m1 = _mm256_and_ps(valid,_mm256_cmp_ps(neg_value,max_value,_CMP_GT_OQ));
+            __m256 m2 = _mm256_andnot_ps(m1,_mm256_and_ps(valid,_mm256_cmp_ps(value,max_value,_CMP_GT_OQ)));
+            max_value = _mm256_blendv_ps(_mm256_blendv_ps(max_value,neg_value,m1),value,m2);
+            bx = _mm256_blendv_ps(_mm256_blendv_ps(bx,_mm256_xor_ps(gx,sign),m1),gx,m2);
+            by = _mm256_blendv_ps(_mm256_blendv_ps(by,_mm256_xor_ps(gy,sign),m1),gy,m2);
+            bz = _mm256_blendv_ps(_mm256_blendv_ps(bz,_mm256_xor_ps(gz,sign),m1),gz,m2);
+        }
+        int found_mask = _mm256_movemask_ps(_mm256_and_ps(mask,_mm256_cmp_ps(max_value,angle,_CMP_NEQ_UQ)));
+        _mm256_storeu_ps(sx,bx);
+        _mm256_storeu_ps(sy,by);
+        _mm256_storeu_ps(sz,bz);
+        for(unsigned int lane = 0;lane < batch_size;++lane)
+            found[lane] = (found_mask >> lane) & 1;
+    }
+#endif
+    // the batched counterpart of trilinear_interpolation::evaluate
+    void estimate_next_dir(const unsigned char* need_estimate)
+    {
+        int corner[8][batch_size];
+        float ratio[8][batch_size];
+        unsigned char active[batch_size];
+        for(unsigned int lane = 0;lane < batch_size;++lane)
+        {
+            active[lane] = 0;
+            for(unsigned int i = 0;i < 8;++i)
+            {
+                corner[i][lane] = 0;
+                ratio[i][lane] = 0.0f;
+            }
+            if(!need_estimate[lane])
+                continue;
+            tipl::interpolation<tipl::linear_weighting,3> tri_interpo;
+            if (!tri_interpo.get_location(trk.dim,get_position(lane)))
+            {
+                terminated[lane] = 1;
+                continue;
+            }
+            for(unsigned int i = 0;i < 8;++i)
+            {
+                corner[i][lane] = int(tri_interpo.dindex[i]);
+                ratio[i][lane] = tri_interpo.ratio[i];
+            }
+            active[lane] = 1;
+        }
+        float new_dir[3][batch_size] = {};
+        float total_weighting[batch_size] = {};
+        float sx[batch_size],sy[batch_size],sz[batch_size];
+        unsigned char found[batch_size];
+        for(unsigned int i = 0;i < 8;++i)
+        {
+            select_fib(corner[i],active,sx,sy,sz,found);
+            for(unsigned int lane = 0;lane < batch_size;++lane)
+                if(found[lane])
+                {
+                    float w = ratio[i][lane];
+                    new_dir[0][lane] += sx[lane]*w;
+                    new_dir[1][lane] += sy[lane]*w;
+                    new_dir[2][lane] += sz[lane]*w;
+                    total_weighting[lane] += w;
+                }
+        }
+        for(unsigned int lane = 0;lane < batch_size;++lane)
+        {
+            if(!active[lane])
+                continue;
+            if(total_weighting[lane] < 0.5f)
+            {
+                terminated[lane] = 1;
+                continue;
+            }
+            tipl::vector<3,float> dir(new_dir[0][lane],new_dir[1][lane],new_dir[2][lane]);
+            dir.normalize();
+            nx[lane] = dir[0];
+            ny[lane] = dir[1];
+            nz[lane] = dir[2];
+        }
+    }
+    // SmoothDir and MoveTrack of a lane
+    void move(unsigned int lane)
+    {
+        tipl::vector<3,float> dir(dx[lane],dy[lane],dz[lane]),next_dir(nx[lane],ny[lane],nz[lane]);
+        if(tracking_smoothing[lane] != 0.0f)
+        {
+            next_dir += (dir-next_dir)*tracking_smoothing[lane];
+            next_dir.normalize();
+        }
+        if(terminated[lane])
+            return;
+        px[lane] += next_dir[0]*step_size_in_voxel[0][lane];
+        py[lane] += next_dir[1]*step_size_in_voxel[1][lane];
+        pz[lane] += next_dir[2]*step_size_in_voxel[2][lane];
+        dx[lane] = next_dir[0];
+        dy[lane] = next_dir[1];
+        dz[lane] = next_dir[2];
+    }
+public:
+    BatchTrackingMethod(const tracking_data& trk_,std::shared_ptr<RoiMgr> roi_mgr_):
+        trk(trk_),roi_mgr(roi_mgr_)
+    {
+#ifdef BATCH_TRACKING_AVX2
+        static const bool has_avx2 = cpu_has_avx2();
+        use_avx2 = has_avx2;
+#endif
+        std::fill(state,state+batch_size,(unsigned char)lane_free);
+    }
+    bool full(void) const{return active_count == batch_size;}
+    bool empty(void) const{return active_count == 0;}
+    // take the initialized seed and tracking parameters of a TrackingMethod
+    template<class method_type>
+    void add(const method_type& method)
+    {
+        unsigned int lane = std::find(state,state+batch_size,(unsigned char)lane_free)-state;
+        if(lane == batch_size)
+            return;
+        fa_threshold[lane] = method.current_fa_threshold;
+        dt_threshold[lane] = method.current_dt_threshold;
+        tracking_angle[lane] = method.current_tracking_angle;
+        tracking_smoothing[lane] = method.current_tracking_smoothing;
+        for(unsigned int i = 0;i < 3;++i)
+            step_size_in_voxel[i][lane] = method.current_step_size_in_voxel[i];
+        max_steps3[lane] = method.current_max_steps3;
+        min_steps3[lane] = method.current_min_steps3;
+        px[lane] = method.position[0];
+        py[lane] = method.position[1];
+        pz[lane] = method.position[2];
+        dx[lane] = method.dir[0];
+        dy[lane] = method.dir[1];
+        dz[lane] = method.dir[2];
+        seed_pos[lane] = method.position;
+        begin_dir[lane] = method.dir;
+        track_buffer[lane].resize(max_steps3[lane] << 1);
+        buffer_front_pos[lane] = max_steps3[lane];
+        buffer_back_pos[lane] = max_steps3[lane];
+        terminated[lane] = 0;
+        state[lane] = lane_forward;
+        ++active_count;
+    }
+    // advance all lanes by one step. on_finish(result,point_count,fa_threshold) is called
+    // for every accepted streamline, and its lane becomes available for a new seed.
+    template<class fun_type>
+    void step(fun_type&& on_finish)
+    {
+        unsigned char need_estimate[batch_size];
+        for(unsigned int lane = 0;lane < batch_size;++lane)
+        {
+            need_estimate[lane] = 0;
+            if(state[lane] == lane_forward)
+            {
+                streamline_step result = add_forward_point(*roi_mgr,get_position(lane),track_buffer[lane],
+                                                           buffer_front_pos[lane],buffer_back_pos[lane],max_steps3[lane]);
+                if(result == streamline_rejected)
+                {
+                    retire(lane);
+                    continue;
+                }
+                if(result == streamline_ended)
+                {
+                    begin_backward(lane);
+                    continue;
+                }
+            }
+            if(state[lane] != lane_free)
+                need_estimate[lane] = 1;
+        }
+        estimate_next_dir(need_estimate);
+        for(unsigned int lane = 0;lane < batch_size;++lane)
+        {
+            if(!need_estimate[lane])
+                continue;
+            move(lane);
+            if(state[lane] == lane_forward)
+            {
+                if(terminated[lane])
+                    begin_backward(lane);
+                continue;
+            }
+            streamline_step result = add_backward_point(*roi_mgr,get_position(lane),terminated[lane],track_buffer[lane],
+                                                        buffer_front_pos[lane],buffer_back_pos[lane],max_steps3[lane]);
+            if(result == streamline_rejected)
+                retire(lane);
+            else
+                if(result == streamline_ended)
+                    finish(lane,on_finish);
+        }
+    }
+};
+
+#endif//BATCH_TRACKING_HPP
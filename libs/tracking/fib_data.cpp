@@ -1,5 +1,6 @@
 #include <QCoreApplication>
 #include <QFileInfo>
+#include <QFile>
 #include "fib_data.hpp"
 #include "tessellated_icosahedron.hpp"
 extern std::vector<std::string> fa_template_list;
@@ -329,26 +330,21 @@ const float* fiber_directions::get_dir(unsigned int index,unsigned int order) co
 }
 
 
-bool tracking_data::get_nearest_dir_fib(unsigned int space_index,
-                     const tipl::vector<3,float>& ref_dir, // reference direction, should be unit vector
-                     unsigned char& fib_order_,
-                     unsigned char& reverse_,
-                     float threshold,
-                     float cull_cos_angle,
-                     float dt_threshold) const
+// the fiber layout (fiber table, dir, findex, dt_fa) is resolved once per call
+// so that the loop over fibers does not branch on it
+template<class skip_type,class cos_type>
+inline bool select_nearest_fib(unsigned char fib_num,float cull_cos_angle,
+                               skip_type&& skip,cos_type&& cos_angle,
+                               unsigned char& fib_order_,unsigned char& reverse_)
 {
-    if(space_index >= dim.size())
-        return false;
     float max_value = cull_cos_angle;
     unsigned char fib_order;
     unsigned char reverse;
     for (unsigned char index = 0;index < fib_num;++index)
     {
-        if (fa[index][space_index] <= threshold)
-            continue;
-        if (!dt_fa.empty() && dt_fa[index][space_index] <= dt_threshold) // for differential tractography
+        if (skip(index))
             continue;
-        float value = cos_angle(ref_dir,space_index,index);
+        float value = cos_angle(index);
         if (-value > max_value)
         {
             max_value = -value;
@@ -369,6 +365,101 @@ bool tracking_data::get_nearest_dir_fib(unsigned int space_index,
     reverse_ = reverse;
     return true;
 }
+
+bool tracking_data::get_nearest_dir_fib(unsigned int space_index,
+                     const tipl::vector<3,float>& ref_dir, // reference direction, should be unit vector
+                     unsigned char& fib_order_,
+                     unsigned char& reverse_,
+                     float threshold,
+                     float cull_cos_angle,
+                     float dt_threshold) const
+{
+    if(space_index >= dim.size())
+        return false;
+    if(!fiber_table.empty() && threshold >= 0.0f)
+    {
+        unsigned int pos = fiber_table_index[space_index];
+        if(pos == no_fiber)
+            return false;
+        const fiber_record* record = &fiber_table[pos];
+        return select_nearest_fib(fib_num,cull_cos_angle,
+                [&](unsigned char index){return record[index].fa <= threshold;},
+                [&](unsigned char index){return ref_dir*odf_table[record[index].findex];},
+                fib_order_,reverse_);
+    }
+    auto skip = [&](unsigned char index){return fa[index][space_index] <= threshold;};
+    // for differential tractography
+    auto dt_skip = [&](unsigned char index){return fa[index][space_index] <= threshold ||
+                                                   dt_fa[index][space_index] <= dt_threshold;};
+    auto dir_cos = [&](unsigned char index)
+    {
+        const float* dir_at = dir[index] + space_index + (space_index << 1);
+        return ref_dir[0]*dir_at[0] + ref_dir[1]*dir_at[1] + ref_dir[2]*dir_at[2];
+    };
+    auto findex_cos = [&](unsigned char index){return ref_dir*odf_table[findex[index][space_index]];};
+    if(dt_fa.empty())
+        return dir.empty() ? select_nearest_fib(fib_num,cull_cos_angle,skip,findex_cos,fib_order_,reverse_):
+                             select_nearest_fib(fib_num,cull_cos_angle,skip,dir_cos,fib_order_,reverse_);
+    return dir.empty() ? select_nearest_fib(fib_num,cull_cos_angle,dt_skip,findex_cos,fib_order_,reverse_):
+                         select_nearest_fib(fib_num,cull_cos_angle,dt_skip,dir_cos,fib_order_,reverse_);
+}
+void tracking_data::prepare_fiber_table(void) const
+{
+    std::lock_guard<std::mutex> lock(fiber_table_mutex);
+    if(fiber_table_users++ == 0 && compact_fiber_table)
+        build_fiber_table();
+}
+void tracking_data::release_fiber_table(void) const
+{
+    std::lock_guard<std::mutex> lock(fiber_table_mutex);
+    if(!fiber_table_users || --fiber_table_users)
+        return;
+    std::vector<fiber_record>().swap(fiber_table);
+    std::vector<unsigned int>().swap(fiber_table_index);
+}
+void tracking_data::build_fiber_table(void) const
+{
+    fiber_table.clear();
+    fiber_table_index.clear();
+    if(!dir.empty() || !dt_fa.empty() || findex.size() < fib_num || !fib_num)
+        return;
+    // order non-empty voxels by their Morton code so that trilinear neighbors share cache lines
+    auto spread = [](uint64_t v)
+    {
+        v &= 0x1FFFFF;
+        v = (v | v << 32) & 0x1F00000000FFFF;
+        v = (v | v << 16) & 0x1F0000FF0000FF;
+        v = (v | v << 8) & 0x100F00F00F00F00F;
+        v = (v | v << 4) & 0x10C30C30C30C30C3;
+        v = (v | v << 2) & 0x1249249249249249;
+        return v;
+    };
+    std::vector<std::pair<uint64_t,unsigned int> > voxels;
+    for(tipl::pixel_index<3> index(dim);index < dim.size();++index)
+    {
+        bool has_fiber = false;
+        for (unsigned char i = 0;i < fib_num && !has_fiber;++i)
+            has_fiber = (fa[i][index.index()] != 0.0f);
+        if(has_fiber)
+            voxels.push_back(std::make_pair(spread(index.x()) | (spread(index.y()) << 1) | (spread(index.z()) << 2),
+                                            index.index()));
+    }
+    std::sort(voxels.begin(),voxels.end());
+    fiber_table.resize(voxels.size()*fib_num);
+    fiber_table_index.resize(dim.size(),no_fiber);
+    tipl::par_for(voxels.size(),[&](unsigned int i)
+    {
+        unsigned int voxel = voxels[i].second;
+        unsigned int pos = i*fib_num;
+        fiber_table_index[voxel] = pos;
+        for (unsigned char j = 0;j < fib_num;++j,++pos)
+        {
+            fiber_table[pos].fa = fa[j][voxel];
+            fiber_table[pos].findex = (unsigned short)findex[j][voxel];
+            fiber_table[pos].reserved = 0;
+        }
+    });
+}
 void tracking_data::read(const fib_data& fib)
 {
     dim = fib.dim;
@@ -383,6 +474,11 @@ void tracking_data::read(const fib_data& fib)
     threshold_name = fib.dir.index_name[fib.dir.cur_index];
     if(!dt_fa.empty())
         dt_threshold_name = fib.dir.dt_index_name[fib.dir.dt_cur_index];
+    std::lock_guard<std::mutex> lock(fiber_table_mutex);
+    std::vector<fiber_record>().swap(fiber_table);
+    std::vector<unsigned int>().swap(fiber_table_index);
+    if(fiber_table_users && compact_fiber_table)
+        build_fiber_table();
 }
 bool tracking_data::get_dir(unsigned int space_index,
                      const tipl::vector<3,float>& dir, // reference direction, should be unit vector
@@ -409,6 +505,8 @@ const float* tracking_data::get_dir(unsigned int space_index,unsigned char fib_o
 {
     if(!dir.empty())
         return dir[fib_order] + space_index + (space_index << 1);
+    if(!fiber_table.empty() && fiber_table_index[space_index] != no_fiber)
+        return &*(odf_table[fiber_table[fiber_table_index[space_index]+fib_order].findex].begin());
     return &*(odf_table[findex[fib_order][space_index]].begin());
 }
 
@@ -455,6 +553,170 @@ bool tracking_data::is_white_matter(const tipl::vector<3,float>& pos,float t) co
 }
 
 
+bool mat_directory::scan(const char* file_name_)
+{
+    close();
+    file_name = file_name_;
+    if(!QFileInfo(file_name_).fileName().endsWith(".gz"))
+    {
+        file = std::make_shared<QFile>(file_name_);
+        if(!file->open(QIODevice::ReadOnly) || !(map = file->map(0,file->size())))
+        {
+            file.reset();
+            return false;
+        }
+    }
+    gz_istream in;
+    // a legacy gzip stream cannot seek, so it is left to gz_mat_read
+    if(!map && (!in.open(file_name_) || !in.random_access()))
+        return false;
+    size_t file_size = map ? size_t(file->size()) : in.size();
+    for(size_t pos = 0;pos < file_size;)
+    {
+        // type, rows, cols, imagf, name length
+        unsigned int header[5];
+        if(map)
+        {
+            if(pos + sizeof(header) > file_size)
+            {
+                entries.clear();
+                break;
+            }
+            std::memcpy(header,map+pos,sizeof(header));
+        }
+        else
+        {
+            in.seek(pos);
+            if(!in.read(header,sizeof(header)))
+            {
+                entries.clear();
+                break;
+            }
+        }
+        entry e;
+        e.type = header[0];
+        e.rows = header[1];
+        e.cols = header[2];
+        // only little-endian, real, full matrices are handled here
+        if(e.type >= 60 || (e.type % 10) > 1 || header[3] || !header[4] || header[4] > 1024)
+        {
+            entries.clear();
+            break;
+        }
+        std::vector<char> name(header[4]);
+        if(map)
+        {
+            if(pos + sizeof(header) + name.size() > file_size)
+            {
+                entries.clear();
+                break;
+            }
+            std::memcpy(&name[0],map+pos+sizeof(header),name.size());
+        }
+        else
+        if(!in.read(&name[0],name.size()))
+        {
+            entries.clear();
+            break;
+        }
+        e.name = std::string(name.begin(),std::find(name.begin(),name.end(),0));
+        e.offset = pos + sizeof(header) + name.size();
+        const size_t element_size[6] = {8,4,4,2,2,1};
+        e.size = size_t(e.rows)*size_t(e.cols)*element_size[e.type/10];
+        if(map && e.offset + e.size > file_size)
+        {
+            entries.clear();
+            break;
+        }
+        entries.push_back(e);
+        pos = e.offset + e.size;
+    }
+    if(entries.empty())
+    {
+        close();
+        return false;
+    }
+    return true;
+}
+
+template<class value_type>
+void add_matrix(gz_mat_read& mat_reader,const std::string& name,const char* data,unsigned int rows,unsigned int cols)
+{
+    mat_reader.add(name.c_str(),reinterpret_cast<const value_type*>(data),rows,cols);
+}
+
+bool mat_directory::load(std::vector<size_t> index_list,gz_mat_read& mat_reader)
+{
+    // read in file order so that a legacy gzip stream is inflated only once
+    std::sort(index_list.begin(),index_list.end(),
+              [&](size_t lhs,size_t rhs){return entries[lhs].offset < entries[rhs].offset;});
+    gz_istream in;
+    if(!map && !in.open(file_name.c_str()))
+        return false;
+    std::vector<char> buf;
+    for(size_t i = 0;i < index_list.size();++i)
+    {
+        if(map)
+            check_prog(i,index_list.size());
+        if(prog_aborted())
+            return false;
+        const entry& e = entries[index_list[i]];
+        const char* data = 0;
+        if(map)
+            data = reinterpret_cast<const char*>(map+e.offset);
+        else
+        {
+            buf.resize(e.size);
+            in.seek(e.offset);
+            if(!buf.empty() && !in.read(&buf[0],buf.size()))
+                return false;
+            data = buf.empty() ? 0 : &buf[0];
+        }
+        switch(e.type)
+        {
+        case 0:
+            add_matrix<double>(mat_reader,e.name,data,e.rows,e.cols);
+            break;
+        case 10:
+            add_matrix<float>(mat_reader,e.name,data,e.rows,e.cols);
+            break;
+        case 20:
+            add_matrix<int>(mat_reader,e.name,data,e.rows,e.cols);
+            break;
+        case 30:
+            add_matrix<short>(mat_reader,e.name,data,e.rows,e.cols);
+            break;
+        case 40:
+            add_matrix<unsigned short>(mat_reader,e.name,data,e.rows,e.cols);
+            break;
+        case 50:
+            add_matrix<unsigned char>(mat_reader,e.name,data,e.rows,e.cols);
+            break;
+        default:
+            add_matrix<char>(mat_reader,e.name,data,e.rows,e.cols);
+            break;
+        }
+    }
+    if(map)
+        check_prog(0,0);
+    return true;
+}
+
+void mat_directory::close(void)
+{
+    entries.clear();
+    file.reset();
+    map = 0;
+}
+
+bool is_odf_matrix(const std::string& name)
+{
+    if(name == "odfs")
+        return true;
+    return name.length() > 3 && name.compare(0,3,"odf") == 0 &&
+           name.find_first_not_of("0123456789",3) == std::string::npos;
+}
+
 bool fib_data::load_from_file(const char* file_name)
 {
     tipl::image<float,3> I;
@@ -538,6 +800,24 @@ bool fib_data::load_from_file(const char* file_name)
         trackable = false;
         return true;
     }
+    if(mat_dir.scan(file_name))
+    {
+        // everything but the odfs is decoded now
+        std::vector<size_t> index_list;
+        for(size_t index = 0;index < mat_dir.size();++index)
+            if(is_odf_matrix(mat_dir.name(index)))
+                deferred_odfs.push_back(index);
+            else
+                index_list.push_back(index);
+        if(!mat_dir.load(index_list,mat_reader) || prog_aborted())
+        {
+            error_msg = prog_aborted() ? "Loading process aborted" : "Invalid file format";
+            return false;
+        }
+        if(deferred_odfs.empty())
+            mat_dir.close();
+    }
+    else
     if (!mat_reader.load_from_file(file_name) || prog_aborted())
     {
         error_msg = prog_aborted() ? "Loading process aborted" : "Invalid file format";
@@ -555,6 +835,21 @@ bool fib_data::load_from_file(const char* file_name)
     }
     return load_from_mat();
 }
+bool fib_data::load_deferred_matrices(void)
+{
+    std::lock_guard<std::mutex> lock(*deferred_mutex);
+    if(!odf_deferred)
+        return true;
+    bool result = mat_dir.load(deferred_odfs,mat_reader);
+    if(result)
+        odf.read(mat_reader);
+    else
+        error_msg = "Cannot read odfs from " + fib_file_name;
+    deferred_odfs.clear();
+    mat_dir.close();
+    odf_deferred = false;
+    return result;
+}
 bool fib_data::load_from_mat(void)
 {
     {
@@ -584,7 +879,10 @@ bool fib_data::load_from_mat(void)
         error_msg = "Empty FA matrix";
         return false;
     }
-    odf.read(mat_reader);
+    if(deferred_odfs.empty())
+        odf.read(mat_reader);
+    else
+        odf_deferred = true;
 
     view_item.push_back(item());
     view_item.back().name =  dir.fa.size() == 1 ? "fa":"qa";
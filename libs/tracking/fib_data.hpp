@@ -3,6 +3,8 @@
 #include <fstream>
 #include <sstream>
 #include <string>
+#include <mutex>
+#include <atomic>
 #include "prog_interface_static_link.h"
 #include "tipl/tipl.hpp"
 #include "gzip_interface.hpp"
@@ -70,6 +72,12 @@ public:
 
 
 class fib_data;
+// interleaved fibers of one voxel: fa and the odf_table index of its direction
+struct fiber_record{
+    float fa;
+    unsigned short findex;
+    unsigned short reserved;
+};
 class tracking_data{
 public:
     tipl::geometry<3> dim;
@@ -82,6 +90,19 @@ public:
     std::vector<const short*> findex;
     std::vector<std::vector<const float*> > other_index;
     std::vector<tipl::vector<3,float> > odf_table;
+public:// compact layout of fa/findex, valid only for odf-based fib without dt_fa
+       // held only while tracking runs, as it duplicates the fa/findex memory
+    bool compact_fiber_table = true;
+    mutable std::vector<fiber_record> fiber_table; // fib_num records per non-empty voxel in Z-order
+    mutable std::vector<unsigned int> fiber_table_index; // voxel index -> first record
+    static const unsigned int no_fiber = 0xFFFFFFFF;
+    void prepare_fiber_table(void) const;
+    void release_fiber_table(void) const;
+private:
+    mutable unsigned int fiber_table_users = 0;
+    mutable std::mutex fiber_table_mutex;
+    void build_fiber_table(void) const;
+public:
 public:
     bool get_nearest_dir_fib(unsigned int space_index,
                          const tipl::vector<3,float>& ref_dir, // reference direction, should be unit vector
@@ -138,6 +159,29 @@ struct item
     }
 };
 
+class QFile;
+// "odfs" or "odf0", "odf1", ...
+bool is_odf_matrix(const std::string& name);
+// variable directory of a MAT v4 file: matrices are decoded only when requested
+class mat_directory{
+    struct entry{
+        std::string name;
+        unsigned int type,rows,cols;
+        size_t offset,size;
+    };
+    std::vector<entry> entries;
+    std::string file_name;
+    std::shared_ptr<QFile> file;// uncompressed files are memory-mapped
+    const unsigned char* map = 0;
+public:
+    bool scan(const char* file_name);
+    size_t size(void) const{return entries.size();}
+    const std::string& name(size_t index) const{return entries[index].name;}
+    // adds the listed matrices to mat_reader
+    bool load(std::vector<size_t> index_list,gz_mat_read& mat_reader);
+    void close(void);
+};
+
 class fib_data
 {
 public:
@@ -153,6 +197,21 @@ public:
 public:
     fiber_directions dir;
     odf_data odf;
+private:// odfs are left in the file until get_odf_data is called
+    mat_directory mat_dir;
+    std::vector<size_t> deferred_odfs;
+    // kept copyable so that fib_data can still be assigned as a whole
+    struct deferred_flag{
+        std::atomic<bool> value;
+        deferred_flag(bool value_):value(value_){}
+        deferred_flag(const deferred_flag& rhs):value(rhs.value.load()){}
+        deferred_flag& operator=(const deferred_flag& rhs){value = rhs.value.load();return *this;}
+        deferred_flag& operator=(bool value_){value = value_;return *this;}
+        operator bool() const{return value;}
+    } odf_deferred;
+    // copies read the odfs from the same file and share the lock
+    std::shared_ptr<std::mutex> deferred_mutex = std::make_shared<std::mutex>();
+public:
     connectometry_db db;
     std::vector<item> view_item;
 public:
@@ -184,17 +243,23 @@ public:
                      std::vector<float>& profile);
 
 public:
-    fib_data(void)
+    fib_data(void):odf_deferred(false)
     {
         vs[0] = vs[1] = vs[2] = 1.0;
     }
-    fib_data(tipl::geometry<3> dim_,tipl::vector<3> vs_):dim(dim_),vs(vs_){}
+    fib_data(tipl::geometry<3> dim_,tipl::vector<3> vs_):dim(dim_),vs(vs_),odf_deferred(false){}
 public:
     bool load_from_file(const char* file_name);
     bool load_from_mat(void);
+    bool load_deferred_matrices(void);
 public:
-    bool has_odfs(void) const{return odf.has_odfs();}
-    const float* get_odf_data(unsigned int index) const{return odf.get_odf_data(index);}
+    bool has_odfs(void) const{return odf_deferred || odf.has_odfs();}
+    const float* get_odf_data(unsigned int index)
+    {
+        if(odf_deferred)
+            load_deferred_matrices();
+        return odf.get_odf_data(index);
+    }
 public:
     size_t get_name_index(const std::string& index_name) const;
     void get_index_list(std::vector<std::string>& index_list) const;
@@ -6,6 +6,7 @@
 #include <boost/mpl/for_each.hpp>
 #include <deque>
 #include <vector>
+#include <type_traits>
 #include "tipl/tipl.hpp"
 #include "interpolation_process.hpp"
 #include "basic_process.hpp"
@@ -148,9 +149,83 @@ struct TrackingParam
 };
 
 
+// streamline rules shared by TrackingMethod::start_tracking and BatchTrackingMethod.
+// The points are kept in buffer[front,back), which grows forward from the middle of
+// the buffer and then backward from the seed.
+enum streamline_step{streamline_rejected = 0,streamline_next = 1,streamline_ended = 2};
+inline void record_streamline_point(std::vector<float>& buffer,unsigned int pos,const tipl::vector<3,float>& position)
+{
+    buffer[pos] = position[0];
+    buffer[pos+1] = position[1];
+    buffer[pos+2] = position[2];
+}
+// appends a point of the forward pass
+inline streamline_step add_forward_point(const RoiMgr& roi_mgr,const tipl::vector<3,float>& position,
+                                         std::vector<float>& buffer,unsigned int front,unsigned int& back,int max_steps3)
+{
+    // make sure that the length won't overflow
+    if(int(back-front) > max_steps3 || back + 3 >= buffer.size())
+        return streamline_rejected;
+    if(roi_mgr.is_excluded_point(position))
+        return streamline_rejected;
+    record_streamline_point(buffer,back,position);
+    back += 3;
+    return roi_mgr.is_terminate_point(position) ? streamline_ended : streamline_next;
+}
+// prepends a point of the backward pass, called after each backward step
+inline streamline_step add_backward_point(const RoiMgr& roi_mgr,const tipl::vector<3,float>& position,bool terminated,
+                                          std::vector<float>& buffer,unsigned int& front,unsigned int back,int max_steps3)
+{
+    // make sure that the length won't overflow
+    if(int(back-front) > max_steps3 || front < 3)
+        return streamline_rejected;
+    if(terminated)
+        return streamline_ended;
+    front -= 3;
+    if(roi_mgr.is_excluded_point(position))
+        return streamline_rejected;
+    record_streamline_point(buffer,front,position);
+    return roi_mgr.is_terminate_point(position) ? streamline_ended : streamline_next;
+}
+// the points of a streamline, reversed when needed so that all streamlines run in the same direction
+inline const float* get_oriented_streamline(const std::vector<float>& buffer,std::vector<float>& reverse_buffer,
+                                            unsigned int front,unsigned int back)
+{
+    tipl::vector<3,float> head(&*(buffer.begin() + front));
+    tipl::vector<3,float> tail(&*(buffer.begin() + back-3));
+    tail -= head;
+    tipl::vector<3,float> abs_dis(std::abs(tail[0]),std::abs(tail[1]),std::abs(tail[2]));
+
+    if((abs_dis[0] > abs_dis[1] && abs_dis[0] > abs_dis[2] && tail[0] < 0) ||
+       (abs_dis[1] > abs_dis[0] && abs_dis[1] > abs_dis[2] && tail[1] < 0) ||
+       (abs_dis[2] > abs_dis[1] && abs_dis[2] > abs_dis[0] && tail[2] < 0))
+    {
+        if(reverse_buffer.size() < back-front)
+            reverse_buffer.resize(buffer.size());
+        std::vector<float>::const_iterator src = buffer.begin() + back-3;
+        std::vector<float>::iterator iter = reverse_buffer.begin();
+        std::vector<float>::iterator end = reverse_buffer.begin()+back-front;
+        for(;iter < end;iter += 3,src -= 3)
+            std::copy(src,src+3,iter);
+        return &*reverse_buffer.begin();
+    }
+    return &*(buffer.begin() + front);
+}
+// end_point1 is where the forward pass ended, end_point2 where the backward pass ended
+inline bool accept_streamline(const RoiMgr& roi_mgr,const float* result,unsigned int buffer_size,int min_steps3,
+                              const tipl::vector<3,float>& end_point2,const tipl::vector<3,float>& end_point1)
+{
+    return int(buffer_size) > min_steps3 &&
+           roi_mgr.have_include(result,buffer_size) &&
+           roi_mgr.fulfill_end_point(end_point2,end_point1);
+}
+
+// interpolation_type and process_list are fixed when a tracking thread starts
+// so that every tracking step is resolved at compile time
+template<class interpolation_type,class process_list>
 class TrackingMethod{
 private:
-    std::auto_ptr<basic_interpolation> interpolation;
+    interpolation_type interpolation;
 public:// Parameters
     tipl::vector<3,float> position;
     tipl::vector<3,float> dir;
@@ -194,12 +269,11 @@ public:
                       const tipl::vector<3,float>& ref_dir,
                       tipl::vector<3,float>& result_dir)
     {
-        return interpolation->evaluate(trk,position,ref_dir,result_dir,current_fa_threshold,current_tracking_angle,current_dt_threshold);
+        return interpolation.evaluate(trk,position,ref_dir,result_dir,current_fa_threshold,current_tracking_angle,current_dt_threshold);
     }
 public:
-    TrackingMethod(const tracking_data& trk_,basic_interpolation* interpolation_,
-                   std::shared_ptr<RoiMgr> roi_mgr_):
-        trk(trk_),interpolation(interpolation_),roi_mgr(roi_mgr_),init_fib_index(0)
+    TrackingMethod(const tracking_data& trk_,std::shared_ptr<RoiMgr> roi_mgr_):
+        trk(trk_),roi_mgr(roi_mgr_),init_fib_index(0)
 	{
 
 
@@ -233,45 +307,31 @@ public:
         buffer_back_pos = current_max_steps3;
         tipl::vector<3,float> end_point1;
         terminated = false;
-		do
-		{
-            if(get_buffer_size() > current_max_steps3 || buffer_back_pos + 3 >= track_buffer.size())
-				return false;
-            if(roi_mgr->is_excluded_point(position))
-				return false;
-            track_buffer[buffer_back_pos] = position[0];
-            track_buffer[buffer_back_pos+1] = position[1];
-            track_buffer[buffer_back_pos+2] = position[2];
-            buffer_back_pos += 3;
-            if(roi_mgr->is_terminate_point(position))
+        do
+        {
+            streamline_step step = add_forward_point(*roi_mgr,position,track_buffer,buffer_front_pos,buffer_back_pos,current_max_steps3);
+            if(step == streamline_rejected)
+                return false;
+            if(step == streamline_ended)
                 break;
             tracking(ProcessList());
-			// make sure that the length won't overflow
-			
-		}
+        }
         while(!terminated);
-		
+
         end_point1 = position;
         terminated = false;
         position = seed_pos;
         dir = -begin_dir;
         forward = false;
-		do
-		{
+        streamline_step step;
+        do
+        {
             tracking(ProcessList());
-			// make sure that the length won't overflow
-            if(get_buffer_size() > current_max_steps3 || buffer_front_pos < 3)
-				return false;			
-            if(terminated)
-				break;
-			buffer_front_pos -= 3;
-            if(roi_mgr->is_excluded_point(position))
-				return false;
-            track_buffer[buffer_front_pos] = position[0];
-            track_buffer[buffer_front_pos+1] = position[1];
-            track_buffer[buffer_front_pos+2] = position[2];
+            step = add_backward_point(*roi_mgr,position,terminated,track_buffer,buffer_front_pos,buffer_back_pos,current_max_steps3);
+            if(step == streamline_rejected)
+                return false;
         }
-        while(!roi_mgr->is_terminate_point(position));
+        while(step == streamline_next);
 
         if(smoothing)
         {
@@ -296,15 +356,14 @@ public:
             smoothed.swap(track_buffer);
         }
 
-        return get_buffer_size() > current_min_steps3 &&
-               roi_mgr->have_include(get_result(),get_buffer_size()) &&
-               roi_mgr->fulfill_end_point(position,end_point1);
+        return accept_streamline(*roi_mgr,get_result(),get_buffer_size(),current_min_steps3,position,end_point1);
 
 
 	}
+        template<class random_generator>
         bool init(unsigned char initial_direction,
                   const tipl::vector<3,float>& position_,
-                  std::mt19937& seed)
+                  random_generator& seed)
         {
             std::uniform_real_distribution<float> gen(0,1);
             position = position_;
@@ -354,53 +413,27 @@ public:
             return false;
         }
 
-        const float* tracking(unsigned char tracking_method,unsigned int& point_count)
+        const float* tracking(unsigned int& point_count)
         {
             point_count = 0;
-            switch (tracking_method)
+            if(std::is_same<process_list,voxel_tracking>::value)
             {
-            case 0:
-                if (!start_tracking<streamline_method_process>(false))
-                    return 0;
-                break;
-            case 1:
-                if (!start_tracking<streamline_runge_kutta_4_method_process>(false))
-                    return 0;
-                break;
-            case 2:
                 position[0] = std::round(position[0]);
                 position[1] = std::round(position[1]);
                 position[2] = std::round(position[2]);
-                if (!start_tracking<voxel_tracking>(true))
+                if (!start_tracking<process_list>(true))
                     return 0;
-                break;
-            default:
-                return 0;
             }
+            else
+                if (!start_tracking<process_list>(false))
+                    return 0;
             point_count = get_point_count();
             return get_result();
         }
 
 	const float* get_result(void) const
 	{
-                tipl::vector<3,float> head(&*(track_buffer.begin() + buffer_front_pos));
-                tipl::vector<3,float> tail(&*(track_buffer.begin() + buffer_back_pos-3));
-		tail -= head;
-                tipl::vector<3,float> abs_dis(std::abs(tail[0]),std::abs(tail[1]),std::abs(tail[2]));
-		
-		if((abs_dis[0] > abs_dis[1] && abs_dis[0] > abs_dis[2] && tail[0] < 0) ||
-		   (abs_dis[1] > abs_dis[0] && abs_dis[1] > abs_dis[2] && tail[1] < 0) ||
-		   (abs_dis[2] > abs_dis[1] && abs_dis[2] > abs_dis[0] && tail[2] < 0))
-		{
-			std::vector<float>::const_iterator src = track_buffer.begin() + buffer_back_pos-3;
-			std::vector<float>::iterator iter = reverse_buffer.begin();
-			std::vector<float>::iterator end = reverse_buffer.begin()+buffer_back_pos-buffer_front_pos;
-			for(;iter < end;iter += 3,src -= 3)
-				std::copy(src,src+3,iter);
-			return &*reverse_buffer.begin();
-		}
-
-		return &*(track_buffer.begin() + buffer_front_pos);
+        return get_oriented_streamline(track_buffer,reverse_buffer,buffer_front_pos,buffer_back_pos);
 	}
 };
 
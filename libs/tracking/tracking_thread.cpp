@@ -3,17 +3,37 @@
 #endif
 #include "tracking_thread.hpp"
 #include "fib_data.hpp"
-void ThreadData::push_tracts(std::vector<std::vector<float> >& local_tract_buffer)
+#include "batch_tracking.hpp"
+void ThreadData::commit_chunk(uint64_t chunk,std::vector<std::vector<float> >& tracts,unsigned int thread_id)
 {
+    accepted_tract_count += tracts.size();
     std::lock_guard<std::mutex> lock(lock_feed_function);
-    pushing_data = true;
-    for(unsigned int index = 0;index < local_tract_buffer.size();++index)
+    pending_chunks[chunk].first = thread_id;
+    pending_chunks[chunk].second.swap(tracts);
+    tracts.clear();
+    // output all chunks that are now contiguous with the ones already output
+    for(auto iter = pending_chunks.begin();
+        iter != pending_chunks.end() && iter->first == next_output_chunk;
+        iter = pending_chunks.erase(iter),++next_output_chunk)
     {
-        track_buffer.push_back(std::vector<float>());
-        track_buffer.back().swap(local_tract_buffer[index]);
+        std::vector<std::vector<float> >& chunk_tracts = iter->second.second;
+        if(param.stop_by_tract == 1)
+            chunk_tracts.resize(std::min<size_t>(chunk_tracts.size(),
+                                param.termination_count-std::min<unsigned int>(output_tract_count,param.termination_count)));
+        if(chunk_tracts.empty())
+            continue;
+        output_tract_count += chunk_tracts.size();
+        // credited to the thread that tracked the chunk, not the one outputting it
+        tract_count[iter->second.first] += chunk_tracts.size();
+        if(sink.get())
+            sink->add(chunk_tracts);
+        else
+        for(unsigned int index = 0;index < chunk_tracts.size();++index)
+        {
+            track_buffer.push_back(std::vector<float>());
+            track_buffer.back().swap(chunk_tracts[index]);
+        }
     }
-    local_tract_buffer.clear();
-    pushing_data = false;
 }
 void ThreadData::end_thread(void)
 {
@@ -26,31 +46,80 @@ void ThreadData::end_thread(void)
     }
 }
 
-void ThreadData::run_thread(TrackingMethod* method_ptr,
-                            unsigned int thread_count,
-                            unsigned int thread_id,
-                            unsigned int max_count)
+template<class method_type>
+void ThreadData::run_thread(method_type* method_ptr,unsigned int thread_id)
 {
-    std::auto_ptr<TrackingMethod> method(method_ptr);
+    std::auto_ptr<method_type> method(method_ptr);
+    philox_engine seed;
     std::uniform_real_distribution<float> rand_gen(0,1),
             angle_gen(float(15.0*M_PI/180.0),float(90.0*M_PI/180.0)),
             smoothing_gen(0.0f,0.95f),
             step_gen(method->trk.vs[0]*0.5f,method->trk.vs[0]*1.5f),
             threshold_gen(0.0,1.0);
-    unsigned int iteration = thread_id; // for center seed
+    uint64_t chunk = 0,iteration = 0,chunk_end = 0;
+    unsigned int center_seed_trial = 0;
+    bool has_chunk = false;
     float white_matter_t = param.threshold*1.2f;
+    std::auto_ptr<BatchTrackingMethod> batch;
+    if(param.tracking_method == 3 && param.interpolation_strategy == 0)
+        batch.reset(new BatchTrackingMethod(method->trk,roi_mgr));
+    std::vector<std::vector<float> > local_track_buffer;
     if(!roi_mgr->seeds.empty())
     try{
-        std::vector<std::vector<float> > local_track_buffer;
-        while(!joinning &&
-              !(param.stop_by_tract == 1 && tract_count[thread_id] >= max_count) &&
-              !(param.stop_by_tract == 0 && seed_count[thread_id] >= max_count) &&
-              !(param.max_seed_count > 0 && seed_count[thread_id] >= param.max_seed_count) &&
-              !(param.center_seed && iteration >= roi_mgr->seeds.size()))
+        auto accept_tract = [&](const float* result,unsigned int point_count,float white_matter_threshold)
         {
+            const float* end = result+point_count+point_count+point_count;
+            if(param.check_ending)
+            {
+                if(point_count < 2)
+                    return;
+                if(result[2] > 0) // not the bottom slice
+                {
+                    tipl::vector<3> p0(result),p1(result+3);
+                    p1 -= p0;
+                    p0 -= p1;
+                    if(method->trk.is_white_matter(p0,white_matter_threshold))
+                        return;
+                }
+                tipl::vector<3> p2(end-6),p3(end-3);
+                if(*(end-1) > 0) // not the bottom slice
+                {
+                    p2 -= p3;
+                    p3 -= p2;
+                    if(method->trk.is_white_matter(p3,white_matter_threshold))
+                        return;
+                }
+            }
+            local_track_buffer.push_back(std::vector<float>(result,end));
+        };
+        auto accept_batch_tract = [&](const float* result,unsigned int point_count,float fa_threshold)
+        {
+            accept_tract(result,point_count,fa_threshold*1.2f);
+        };
+        // the batch is drained at the end of each chunk so that every tract belongs to its seed chunk
+        auto end_chunk = [&]()
+        {
+            while(batch.get() && !batch->empty() && !joinning)
+                batch->step(accept_batch_tract);
+            has_chunk = false;
+            commit_chunk(chunk,local_track_buffer,thread_id);
+        };
+        // chunks past the one that completes the tract target are not needed
+        while(!joinning && !tract_target_reached(output_tract_count))
+        {
+            if(iteration >= chunk_end)
+            {
+                if(has_chunk)
+                    end_chunk();
+                if(tract_target_reached(accepted_tract_count) ||
+                   !(has_chunk = claim_seed_chunk(seed,chunk,iteration,chunk_end)))
+                    break;
+            }
+            if(param.center_seed ? (iteration >= roi_mgr->seeds.size() ||
+                                    (seed_limit && placed_seed_count++ >= seed_limit)) :
+                                   (seed_limit && iteration >= seed_limit))
+                break;
 
-            if(!pushing_data && (iteration & 0x00000FFF) == 0x00000FFF && !local_track_buffer.empty())
-                push_tracts(local_track_buffer);
             if(param.threshold == 0.0f)
             {
                 float w = threshold_gen(seed);
@@ -79,17 +148,21 @@ void ThreadData::run_thread(TrackingMethod* method_ptr,
                                            roi_mgr->seeds[iteration].z()/roi_mgr->seeds_r[iteration]),
                                  seed))
                 {
-                    iteration+=thread_count;
+                    ++iteration;
+                    center_seed_trial = 0;
                     continue;
                 }
-                if(param.initial_direction == 0)// primary direction
-                    iteration+=thread_count;
+                // the primary direction is tracked once, other directions are
+                // tried a fixed number of times so that the chunk always ends
+                if(param.initial_direction == 0 || ++center_seed_trial >= center_seed_trial_count)
+                {
+                    ++iteration;
+                    center_seed_trial = 0;
+                }
             }
             else
             {
-                // this ensure consistency
-                std::lock_guard<std::mutex> lock(lock_seed_function);
-                iteration+=thread_count;
+                ++iteration;
                 unsigned int i = rand_gen(seed)*((float)roi_mgr->seeds.size()-1.0f);
                 tipl::vector<3,float> pos;
                 pos[0] = (float)roi_mgr->seeds[i].x() + rand_gen(seed)-0.5f;
@@ -100,42 +173,30 @@ void ThreadData::run_thread(TrackingMethod* method_ptr,
                 if(!method->init(param.initial_direction,pos,seed))
                     continue;
             }
-            unsigned int point_count;
-            const float *result = method->tracking(param.tracking_method,point_count);
-            if(!result)
-                continue;
-            const float* end = result+point_count+point_count+point_count;
-            if(param.check_ending)
+            if(batch.get())
             {
-                if(point_count < 2)
-                    continue;
-                if(result[2] > 0) // not the bottom slice
-                {
-                    tipl::vector<3> p0(result),p1(result+3);
-                    p1 -= p0;
-                    p0 -= p1;
-                    if(method->trk.is_white_matter(p0,white_matter_t))
-                        continue;
-                }
-                tipl::vector<3> p2(end-6),p3(end-3);
-                if(*(end-1) > 0) // not the bottom slice
-                {
-                    p2 -= p3;
-                    p3 -= p2;
-                    if(method->trk.is_white_matter(p3,white_matter_t))
-                        continue;
-                }
+                batch->add(*method);
+                while(batch->full())
+                    batch->step(accept_batch_tract);
+                continue;
             }
-            ++tract_count[thread_id];
-            local_track_buffer.push_back(std::vector<float>(result,end));
+            unsigned int point_count;
+            const float *result = method->tracking(point_count);
+            if(result)
+                accept_tract(result,point_count,white_matter_t);
         }
-        push_tracts(local_track_buffer);
+        if(has_chunk)
+            end_chunk();
     }
     catch(...)
     {
-
+        // a claimed chunk is always committed, or the later chunks would never be output
+        if(has_chunk)
+            commit_chunk(chunk,local_track_buffer,thread_id);
     }
     running[thread_id] = 0;
+    if(--active_thread_count == 0)
+        method->trk.release_fiber_table();
 }
 
 bool ThreadData::fetchTracks(TractModel* handle)
@@ -149,24 +210,10 @@ bool ThreadData::fetchTracks(TractModel* handle)
     return true;
 
 }
-TrackingMethod* ThreadData::new_method(const tracking_data& trk)
+template<class interpolation_type,class process_list>
+TrackingMethod<interpolation_type,process_list>* ThreadData::new_method(const tracking_data& trk)
 {
-
-    std::auto_ptr<basic_interpolation> interpo_method;
-    switch (param.interpolation_strategy)
-    {
-    case 0:
-        interpo_method.reset(new trilinear_interpolation);
-        break;
-    case 1:
-        interpo_method.reset(new trilinear_interpolation_with_gaussian_basis);
-        break;
-    case 2:
-        interpo_method.reset(new nearest_direction);
-        break;
-
-    }
-    TrackingMethod* method = new TrackingMethod(trk,interpo_method.release(),roi_mgr);
+    auto* method = new TrackingMethod<interpolation_type,process_list>(trk,roi_mgr);
     method->current_fa_threshold = param.threshold;
     method->current_dt_threshold = param.dt_threshold;
     method->current_tracking_angle = param.cull_cos_angle;
@@ -182,12 +229,48 @@ TrackingMethod* ThreadData::new_method(const tracking_data& trk)
     return method;
 }
 
+template<class interpolation_type,class process_list>
+void ThreadData::launch_threads(const tracking_data& trk,unsigned int thread_count,bool wait)
+{
+    for (unsigned int index = 0;index < thread_count-1;++index)
+        threads.push_back(std::make_shared<std::future<void> >(std::async(std::launch::async,
+                [&,index](){run_thread(new_method<interpolation_type,process_list>(trk),index);})));
+
+    if(wait)
+    {
+        run_thread(new_method<interpolation_type,process_list>(trk),thread_count-1);
+        for(int i = 0;i < threads.size();++i)
+            threads[i]->wait();
+    }
+    else
+        threads.push_back(std::make_shared<std::future<void> >(std::async(std::launch::async,
+                [&,thread_count](){run_thread(new_method<interpolation_type,process_list>(trk),thread_count-1);})));
+}
+
+template<class process_list>
+void ThreadData::launch(const tracking_data& trk,unsigned int thread_count,bool wait)
+{
+    switch (param.interpolation_strategy)
+    {
+    case 1:
+        launch_threads<trilinear_interpolation_with_gaussian_basis,process_list>(trk,thread_count,wait);
+        break;
+    case 2:
+        launch_threads<nearest_direction,process_list>(trk,thread_count,wait);
+        break;
+    default:
+        launch_threads<trilinear_interpolation,process_list>(trk,thread_count,wait);
+        break;
+    }
+}
+
 void ThreadData::run(const tracking_data& trk,
                      unsigned int thread_count,
                      bool wait)
 {
     if(!param.termination_count)
         return;
+    trk.prepare_fiber_table();
     if(param.threshold == 0.0f)
     {
         float otsu = tipl::segmentation::otsu_threshold(tipl::make_image(trk.fa[0],trk.dim));
@@ -237,34 +320,37 @@ void ThreadData::run(const tracking_data& trk,
         std::srand(0);
         std::random_shuffle(roi_mgr->seeds.begin(),roi_mgr->seeds.end());
     }
-    seed = std::mt19937(param.random_seed ? std::random_device()():0);
+    seed_value = param.random_seed ? std::random_device()():0;
+    next_seed_chunk = 0;
+    placed_seed_count = 0;
+    pending_chunks.clear();
+    next_output_chunk = 0;
+    accepted_tract_count = 0;
+    output_tract_count = 0;
+    seed_limit = param.stop_by_tract ? 0 : param.termination_count;
+    if(param.max_seed_count > 0 && (!seed_limit || param.max_seed_count < seed_limit))
+        seed_limit = param.max_seed_count;
+    if(thread_count < 1)
+        thread_count = 1;
     seed_count.clear();
     tract_count.clear();
     seed_count.resize(thread_count);
     tract_count.resize(thread_count);
     running.resize(thread_count);
-    pushing_data = false;
     std::fill(running.begin(),running.end(),1);
 
-    unsigned int count = param.termination_count;
     end_thread();
-    if(thread_count > count)
-        thread_count = count;
-    if(thread_count < 1)
-        thread_count = 1;
-    unsigned int run_count = std::max<int>(1,count/thread_count);
-    unsigned int total_run_count = 0;
-    for (unsigned int index = 0;index < thread_count-1;++index,total_run_count += run_count)
-        threads.push_back(std::make_shared<std::future<void> >(std::async(std::launch::async,
-                [&,thread_count,index,run_count](){run_thread(new_method(trk),thread_count,index,run_count);})));
-
-    if(wait)
+    active_thread_count = thread_count;
+    switch(param.tracking_method)
     {
-        run_thread(new_method(trk),thread_count,thread_count-1,count-total_run_count);
-        for(int i = 0;i < threads.size();++i)
-            threads[i]->wait();
+    case 1:
+        launch<streamline_runge_kutta_4_method_process>(trk,thread_count,wait);
+        break;
+    case 2:
+        launch<voxel_tracking>(trk,thread_count,wait);
+        break;
+    default:// 0: streamline, 3: batched streamline
+        launch<streamline_method_process>(trk,thread_count,wait);
+        break;
     }
-    else
-        threads.push_back(std::make_shared<std::future<void> >(std::async(std::launch::async,
-                [&,thread_count,count,total_run_count](){run_thread(new_method(trk),thread_count,thread_count-1,count-total_run_count);})));
 }
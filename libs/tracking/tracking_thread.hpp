@@ -4,16 +4,79 @@
 #include <ctime>
 #include <random>
 #include <memory>
+#include <cstdint>
+#include <atomic>
+#include <map>
 
 #include "roi.hpp"
 #include "tracking_method.hpp"
 #include "fib_data.hpp"
 #include "tract_model.hpp"
 
+// Philox4x32-10 counter-based generator (Salmon et al., SC'11)
+// each seed chunk owns one stream keyed by (seed,chunk id). The high 32 bits
+// of the chunk id go into the top counter word, which the increment never reaches.
+// so that drawing random numbers never requires a lock
+class philox_engine{
+public:
+    typedef uint32_t result_type;
+    static constexpr result_type min(void){return 0;}
+    static constexpr result_type max(void){return 0xFFFFFFFF;}
+private:
+    uint32_t key[2];
+    uint32_t counter[4];
+    uint32_t output[4];
+    unsigned char output_pos;
+    static void mulhilo(uint32_t a,uint32_t b,uint32_t& hi,uint32_t& lo)
+    {
+        uint64_t product = uint64_t(a)*uint64_t(b);
+        hi = uint32_t(product >> 32);
+        lo = uint32_t(product);
+    }
+    void generate(void)
+    {
+        uint32_t c[4] = {counter[0],counter[1],counter[2],counter[3]};
+        uint32_t k[2] = {key[0],key[1]};
+        for(unsigned char round = 0;round < 10;++round)
+        {
+            uint32_t hi0,lo0,hi1,lo1;
+            mulhilo(0xD2511F53,c[0],hi0,lo0);
+            mulhilo(0xCD9E8D57,c[2],hi1,lo1);
+            c[0] = hi1^c[1]^k[0];
+            c[1] = lo1;
+            c[2] = hi0^c[3]^k[1];
+            c[3] = lo0;
+            k[0] += 0x9E3779B9;
+            k[1] += 0xBB67AE85;
+        }
+        std::copy(c,c+4,output);
+        // 128-bit counter increment
+        for(unsigned char i = 0;i < 4 && ++counter[i] == 0;++i)
+            ;
+        output_pos = 0;
+    }
+public:
+    philox_engine(uint32_t seed = 0,uint64_t stream = 0){set_seed(seed,stream);}
+    void set_seed(uint32_t seed,uint64_t stream)
+    {
+        key[0] = seed;
+        key[1] = uint32_t(stream);
+        std::fill(counter,counter+4,0);
+        counter[3] = uint32_t(stream >> 32);
+        output_pos = 4;
+    }
+    result_type operator()(void)
+    {
+        if(output_pos >= 4)
+            generate();
+        return output[output_pos++];
+    }
+};
+
 struct ThreadData
 {
 private:
-    std::mt19937 seed;
+    uint32_t seed_value = 0;
 
 public:
     std::shared_ptr<RoiMgr> roi_mgr;
@@ -24,20 +87,51 @@ public:
     float fa_threshold1,fa_threshold2;// use only if fa_threshold=0
 
 public:
-    ThreadData(void):joinning(false),seed(0),roi_mgr(new RoiMgr){}
+    ThreadData(void):joinning(false),roi_mgr(new RoiMgr),active_thread_count(0),
+        next_seed_chunk(0),placed_seed_count(0),accepted_tract_count(0),output_tract_count(0){}
     ~ThreadData(void)
     {
         end_thread();
     }
 public:
     bool joinning = false;
-    bool pushing_data = false;
 
     std::vector<std::shared_ptr<std::future<void> > > threads;
     std::vector<unsigned int> seed_count;
     std::vector<unsigned int> tract_count;
     std::vector<unsigned char> running;
-    std::mutex  lock_feed_function,lock_seed_function;
+    std::atomic<unsigned int> active_thread_count; // the last one to end releases the fiber table
+    std::mutex  lock_feed_function;
+public:// work stealing: idle threads claim the next chunk of seeds
+    static const unsigned int seed_chunk_size = 256;
+    std::atomic<uint64_t> next_seed_chunk;
+    std::atomic<unsigned int> placed_seed_count;
+    unsigned int seed_limit = 0;
+    // tracking attempts from one center seed before moving to the next seed,
+    // used when the initial direction is not the primary one
+    static const unsigned int center_seed_trial_count = 16;
+    bool claim_seed_chunk(philox_engine& seed,uint64_t& chunk,uint64_t& iteration,uint64_t& chunk_end)
+    {
+        chunk = next_seed_chunk++;
+        iteration = chunk*seed_chunk_size;
+        chunk_end = iteration+seed_chunk_size;
+        seed.set_seed(seed_value,chunk);
+        if(param.center_seed)
+            return iteration < roi_mgr->seeds.size();
+        return !seed_limit || iteration < seed_limit;
+    }
+public:// the tracts of each chunk are output in chunk order, so that the result does not
+       // depend on the thread scheduling. A tract-count run keeps the first termination_count.
+    // chunk -> thread that tracked it and its tracts
+    std::map<uint64_t,std::pair<unsigned int,std::vector<std::vector<float> > > > pending_chunks;
+    uint64_t next_output_chunk = 0;
+    std::atomic<unsigned int> accepted_tract_count; // in finished chunks, output or pending
+    std::atomic<unsigned int> output_tract_count;
+    void commit_chunk(uint64_t chunk,std::vector<std::vector<float> >& tracts,unsigned int thread_id);
+    bool tract_target_reached(unsigned int count) const
+    {
+        return param.stop_by_tract == 1 && count >= param.termination_count;
+    }
     unsigned int get_total_seed_count(void)const
     {
         if(seed_count.empty())
@@ -59,14 +153,20 @@ public:
 
 public:
     std::vector<std::vector<float> > track_buffer;
-    void push_tracts(std::vector<std::vector<float> >& local_tract_buffer);
+    // if assigned, tracts are sent to the sink instead of track_buffer
+    std::shared_ptr<tract_sink> sink;
     void end_thread(void);
 
 public:
-    void run_thread(TrackingMethod* method_ptr,unsigned int thread_count,
-                    unsigned int thread_id,unsigned int max_count);
+    template<class method_type>
+    void run_thread(method_type* method_ptr,unsigned int thread_id);
     bool fetchTracks(TractModel* handle);
-    TrackingMethod* new_method(const tracking_data& trk);
+    template<class interpolation_type,class process_list>
+    TrackingMethod<interpolation_type,process_list>* new_method(const tracking_data& trk);
+    template<class interpolation_type,class process_list>
+    void launch_threads(const tracking_data& trk,unsigned int thread_count,bool wait);
+    template<class process_list>
+    void launch(const tracking_data& trk,unsigned int thread_count,bool wait);
     void run(const tracking_data& trk,
              unsigned int thread_count,
              bool wait);
@@ -0,0 +1,168 @@
+#ifndef TRACT_ARENA_HPP
+#define TRACT_ARENA_HPP
+#include <vector>
+#include <algorithm>
+
+// coordinates of one tract stored in a tract_arena
+template<class value_type>
+struct tract_span{
+    value_type* from;
+    value_type* to;
+    tract_span(value_type* from_,value_type* to_):from(from_),to(to_){}
+    value_type* begin(void) const{return from;}
+    value_type* end(void) const{return to;}
+    size_t size(void) const{return to-from;}
+    bool empty(void) const{return from == to;}
+    value_type& operator[](size_t index) const{return from[index];}
+};
+
+// tracts packed in one coordinate buffer with an offset table (12 bytes per point).
+// Each tract occupies a slot, and the visible tracts are a list of slot ids.
+// Deleting a tract only takes its id out of the list, so that undo puts the id back
+// without copying coordinates. Slots that will never be shown again are released and
+// their coordinates are reclaimed by compact().
+class tract_arena{
+public:
+    typedef tract_span<float> span;
+    typedef tract_span<const float> const_span;
+    static const unsigned int no_slot = 0xFFFFFFFF;
+private:
+    std::vector<float> points;
+    // slot i uses points[offset[i]] to points[offset[i+1]]
+    std::vector<size_t> offset = std::vector<size_t>(1);
+    std::vector<unsigned int> visible;
+    size_t released_size = 0;
+public:
+    size_t size(void) const{return visible.size();}
+    bool empty(void) const{return visible.empty();}
+    span operator[](size_t index){return get_slot(visible[index]);}
+    const_span operator[](size_t index) const{return get_slot(visible[index]);}
+    span get_slot(unsigned int slot)
+    {
+        return span(points.data()+offset[slot],points.data()+offset[slot+1]);
+    }
+    const_span get_slot(unsigned int slot) const
+    {
+        return const_span(points.data()+offset[slot],points.data()+offset[slot+1]);
+    }
+    size_t coordinate_count(void) const{return points.size();}
+private:
+    template<class value_type>
+    static void grow(std::vector<value_type>& buf,size_t more)
+    {
+        // keeps the geometric growth so that repeated appends stay amortized O(1)
+        if(buf.size()+more > buf.capacity())
+            buf.reserve(std::max<size_t>(buf.size()+more,buf.capacity()*2));
+    }
+public:
+    // makes room for more tracts and coordinates on top of the current ones
+    void reserve(size_t more_tracts,size_t more_coordinates)
+    {
+        grow(visible,more_tracts);
+        grow(offset,more_tracts);
+        grow(points,more_coordinates);
+    }
+    // stores a tract without showing it. The coordinates must not come from this arena.
+    unsigned int add_slot(const float* from,size_t length)
+    {
+        points.insert(points.end(),from,from+length);
+        offset.push_back(points.size());
+        return (unsigned int)(offset.size()-2);
+    }
+    template<class tract_type>
+    void push_back(const tract_type& tract)
+    {
+        visible.push_back(add_slot(tract.empty() ? nullptr : &tract[0],tract.size()));
+    }
+    // packs the tracts and frees each source tract once copied, so that the peak
+    // memory stays close to a single copy
+    void append(std::vector<std::vector<float> >& tracts)
+    {
+        size_t more_coordinates = 0;
+        for(size_t index = 0;index < tracts.size();++index)
+            more_coordinates += tracts[index].size();
+        reserve(tracts.size(),more_coordinates);
+        for(size_t index = 0;index < tracts.size();++index)
+        {
+            push_back(tracts[index]);
+            std::vector<float>().swap(tracts[index]);
+        }
+        tracts.clear();
+    }
+    void assign(std::vector<std::vector<float> >& tracts)
+    {
+        clear();
+        append(tracts);
+    }
+    void get_tracts(std::vector<std::vector<float> >& tracts) const
+    {
+        tracts.resize(size());
+        for(size_t index = 0;index < tracts.size();++index)
+            tracts[index].assign((*this)[index].begin(),(*this)[index].end());
+    }
+public:
+    // takes a tract out of the visible list and returns its slot.
+    // The list keeps a hole until erase_removed is called.
+    unsigned int remove(size_t index)
+    {
+        unsigned int slot = visible[index];
+        visible[index] = no_slot;
+        return slot;
+    }
+    bool is_removed(size_t index) const{return visible[index] == no_slot;}
+    // shows a removed slot again at the end of the visible list
+    void restore(unsigned int slot){visible.push_back(slot);}
+    // the slot will not be shown again, and its coordinates can be reclaimed
+    void release(unsigned int slot){released_size += offset[slot+1]-offset[slot];}
+    // closes the holes left by remove. move(from,to) applies the same compaction
+    // to arrays kept in parallel with the visible list.
+    template<class fun_type>
+    void erase_removed(fun_type&& move)
+    {
+        size_t size = 0;
+        for(size_t index = 0;index < visible.size();++index)
+            if(visible[index] != no_slot)
+            {
+                if(index != size)
+                {
+                    visible[size] = visible[index];
+                    move(index,size);
+                }
+                ++size;
+            }
+        visible.resize(size);
+    }
+    bool need_compact(void) const{return released_size && released_size*2 >= points.size();}
+    // drops the released slots. Slots not visible but still in use (e.g. by the undo
+    // history) are listed in hidden_slots and get their new slot ids.
+    void compact(std::vector<unsigned int>& hidden_slots)
+    {
+        tract_arena result;
+        result.reserve(visible.size()+hidden_slots.size(),points.size()-released_size);
+        for(size_t index = 0;index < visible.size();++index)
+            result.push_back((*this)[index]);
+        for(size_t index = 0;index < hidden_slots.size();++index)
+        {
+            auto tract = get_slot(hidden_slots[index]);
+            hidden_slots[index] = result.add_slot(tract.begin(),tract.size());
+        }
+        swap(result);
+    }
+    void clear(void)
+    {
+        std::vector<float>().swap(points);
+        offset.clear();
+        offset.push_back(0);
+        visible.clear();
+        released_size = 0;
+    }
+    void swap(tract_arena& rhs)
+    {
+        points.swap(rhs.points);
+        offset.swap(rhs.offset);
+        visible.swap(rhs.visible);
+        std::swap(released_size,rhs.released_size);
+    }
+};
+
+#endif//TRACT_ARENA_HPP
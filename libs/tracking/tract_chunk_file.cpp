@@ -0,0 +1,256 @@
+#include <cstring>
+#include <thread>
+#include "tract_chunk_file.hpp"
+#include "gzip_interface.hpp"
+
+const char tract_chunk_id[8] = {'D','S','I','T','K','C',0,0};
+
+void tract_chunk::add(const float* tract,unsigned int point_count,
+                      unsigned int cluster_,unsigned int color_,unsigned int tag_,const float* scalar_)
+{
+    length.push_back(point_count);
+    cluster.push_back(cluster_);
+    color.push_back(color_);
+    tag.push_back(tag_);
+    points.insert(points.end(),tract,tract+point_count*3);
+    if(scalar_)
+        scalar.insert(scalar.end(),scalar_,scalar_+point_count);
+}
+size_t tract_chunk::raw_size(void) const
+{
+    return sizeof(unsigned int)*(1+4*size())+sizeof(float)*(points.size()+scalar.size());
+}
+template<class value_type>
+void copy_to_buf(unsigned char*& pos,const std::vector<value_type>& data)
+{
+    if(!data.empty())
+        std::memcpy(pos,&data[0],data.size()*sizeof(value_type));
+    pos += data.size()*sizeof(value_type);
+}
+template<class value_type>
+void copy_from_buf(const unsigned char*& pos,std::vector<value_type>& data,size_t size)
+{
+    data.resize(size);
+    if(size)
+        std::memcpy(&data[0],pos,size*sizeof(value_type));
+    pos += size*sizeof(value_type);
+}
+bool tract_chunk::encode(std::vector<unsigned char>& buf) const
+{
+    std::vector<unsigned char> raw(raw_size());
+    unsigned char* pos = &raw[0];
+    unsigned int count = size();
+    std::memcpy(pos,&count,sizeof(count));
+    pos += sizeof(count);
+    copy_to_buf(pos,length);
+    copy_to_buf(pos,cluster);
+    copy_to_buf(pos,color);
+    copy_to_buf(pos,tag);
+    copy_to_buf(pos,points);
+    copy_to_buf(pos,scalar);
+    uLongf compressed_size = compressBound(raw.size());
+    buf.resize(compressed_size);
+    if(compress2(&buf[0],&compressed_size,&raw[0],raw.size(),Z_DEFAULT_COMPRESSION) != Z_OK)
+        return false;
+    buf.resize(compressed_size);
+    return true;
+}
+bool tract_chunk::decode(const std::vector<unsigned char>& buf,size_t raw_size_)
+{
+    std::vector<unsigned char> raw(raw_size_);
+    uLongf size_ = raw_size_;
+    if(raw_size_ < sizeof(unsigned int) ||
+       uncompress(&raw[0],&size_,&buf[0],buf.size()) != Z_OK || size_ != raw_size_)
+        return false;
+    const unsigned char* pos = &raw[0];
+    unsigned int count = 0;
+    std::memcpy(&count,pos,sizeof(count));
+    pos += sizeof(count);
+    if(raw_size_ < sizeof(unsigned int)*(1+4*size_t(count)))
+        return false;
+    copy_from_buf(pos,length,count);
+    copy_from_buf(pos,cluster,count);
+    copy_from_buf(pos,color,count);
+    copy_from_buf(pos,tag,count);
+    size_t point_count = 0;
+    for(unsigned int i = 0;i < count;++i)
+        point_count += length[i];
+    size_t scalar_size = (raw_size_-size_t(pos-&raw[0]))/sizeof(float);
+    if(scalar_size < point_count*3)
+        return false;
+    scalar_size -= point_count*3;
+    if(scalar_size != 0 && scalar_size != point_count)
+        return false;
+    copy_from_buf(pos,points,point_count*3);
+    copy_from_buf(pos,scalar,scalar_size);
+    return true;
+}
+//---------------------------------------------------------------------------
+bool tract_chunk_writer::open(const char* file_name,tipl::geometry<3> dim,tipl::vector<3> vs,
+                              bool has_scalar,bool has_cluster)
+{
+    out.open(file_name,std::ios::binary);
+    if(!out)
+        return false;
+    std::memset(&header,0,sizeof(header));
+    std::copy(tract_chunk_id,tract_chunk_id+8,header.id);
+    header.version = 1;
+    header.has_scalar = has_scalar ? 1:0;
+    header.has_cluster = has_cluster ? 1:0;
+    std::copy(dim.begin(),dim.end(),header.dim);
+    std::copy(vs.begin(),vs.end(),header.vs);
+    table.clear();
+    pending.clear();
+    out.write((const char*)&header,sizeof(header));
+    return out.good();
+}
+void tract_chunk_writer::add(const float* tract,unsigned int point_count,
+                             unsigned int cluster,unsigned int color,unsigned int tag,const float* scalar)
+{
+    if(pending.empty() || pending.back().points.size() >= chunk_point_count*3)
+    {
+        // compress a full batch of chunks, one per thread
+        if(pending.size() >= std::thread::hardware_concurrency())
+            write_pending();
+        pending.push_back(tract_chunk());
+    }
+    pending.back().add(tract,point_count,cluster,color,tag,header.has_scalar ? scalar:0);
+    if(header.has_scalar && !scalar)
+        pending.back().scalar.resize(pending.back().points.size()/3);
+    ++header.tract_count;
+}
+bool tract_chunk_writer::write_pending(void)
+{
+    std::vector<std::vector<unsigned char> > buf(pending.size());
+    std::vector<char> result(pending.size());
+    tipl::par_for(pending.size(),[&](unsigned int i)
+    {
+        result[i] = pending[i].encode(buf[i]);
+    });
+    unsigned long long first_tract = header.tract_count;
+    for(size_t i = 0;i < pending.size();++i)
+        first_tract -= pending[i].size();
+    for(size_t i = 0;i < pending.size();++i)
+    {
+        if(!result[i])
+            return false;
+        tract_chunk_entry entry;
+        entry.offset = out.tellp();
+        entry.compressed_size = buf[i].size();
+        entry.raw_size = pending[i].raw_size();
+        entry.first_tract = first_tract;
+        out.write((const char*)&buf[i][0],buf[i].size());
+        table.push_back(entry);
+        first_tract += pending[i].size();
+    }
+    pending.clear();
+    return out.good();
+}
+bool tract_chunk_writer::close(void)
+{
+    if(!out.is_open())
+        return false;
+    bool result = write_pending();
+    header.chunk_count = table.size();
+    header.table_offset = out.tellp();
+    if(!table.empty())
+        out.write((const char*)&table[0],table.size()*sizeof(tract_chunk_entry));
+    out.seekp(0);
+    out.write((const char*)&header,sizeof(header));
+    result = result && out.good();
+    out.close();
+    return result;
+}
+//---------------------------------------------------------------------------
+bool tract_chunk_reader::open(const char* file_name)
+{
+    in.open(file_name,std::ios::binary);
+    if(!in || !in.read((char*)&header,sizeof(header)) ||
+       !std::equal(tract_chunk_id,tract_chunk_id+8,header.id))
+        return false;
+    table.resize(header.chunk_count);
+    in.seekg(header.table_offset);
+    if(!table.empty() && !in.read((char*)&table[0],table.size()*sizeof(tract_chunk_entry)))
+        return false;
+    cache.reset();
+    return true;
+}
+size_t tract_chunk_reader::find_chunk(size_t tract_index) const
+{
+    return size_t(std::upper_bound(table.begin(),table.end(),tract_index,
+            [](size_t index,const tract_chunk_entry& entry){return index < entry.first_tract;})-table.begin())-1;
+}
+bool tract_chunk_reader::read_chunk(size_t chunk_index,tract_chunk& chunk)
+{
+    if(chunk_index >= table.size())
+        return false;
+    std::vector<unsigned char> buf(table[chunk_index].compressed_size);
+    {
+        std::lock_guard<std::mutex> lock(read_mutex);
+        in.clear();
+        in.seekg(table[chunk_index].offset);
+        if(!buf.empty() && !in.read((char*)&buf[0],buf.size()))
+            return false;
+    }
+    return chunk.decode(buf,table[chunk_index].raw_size);
+}
+bool tract_chunk_reader::read(size_t from,size_t count,
+                              std::vector<std::vector<float> >& tracts,
+                              std::vector<unsigned int>& cluster,
+                              std::vector<unsigned int>& color,
+                              std::vector<unsigned int>& tag)
+{
+    if(from >= size())
+        return false;
+    count = std::min<size_t>(count,size()-from);
+    tracts.resize(count);
+    cluster.resize(has_cluster() ? count : 0);
+    color.resize(count);
+    tag.resize(count);
+    size_t first_chunk = find_chunk(from);
+    size_t last_chunk = find_chunk(from+count-1);
+    std::vector<char> result(last_chunk-first_chunk+1);
+    tipl::par_for(result.size(),[&](unsigned int i)
+    {
+        tract_chunk chunk;
+        size_t chunk_index = first_chunk+i;
+        if(!(result[i] = read_chunk(chunk_index,chunk)))
+            return;
+        const float* pos = chunk.points.empty() ? 0 : &chunk.points[0];
+        for(size_t j = 0,index = table[chunk_index].first_tract;j < chunk.size();++j,++index)
+        {
+            if(index >= from && index < from+count)
+            {
+                size_t k = index-from;
+                tracts[k].assign(pos,pos+chunk.length[j]*3);
+                if(has_cluster())
+                    cluster[k] = chunk.cluster[j];
+                color[k] = chunk.color[j];
+                tag[k] = chunk.tag[j];
+            }
+            pos += chunk.length[j]*3;
+        }
+    });
+    return std::find(result.begin(),result.end(),0) == result.end();
+}
+bool tract_chunk_reader::get_tract(size_t index,std::vector<float>& tract)
+{
+    if(index >= size())
+        return false;
+    size_t chunk_index = find_chunk(index);
+    if(!cache.get() || cache_index != chunk_index)
+    {
+        std::shared_ptr<tract_chunk> new_cache(new tract_chunk);
+        if(!read_chunk(chunk_index,*new_cache))
+            return false;
+        cache_offset.resize(new_cache->size()+1);
+        cache_offset[0] = 0;
+        for(size_t i = 0;i < new_cache->size();++i)
+            cache_offset[i+1] = cache_offset[i]+new_cache->length[i]*3;
+        cache = new_cache;
+        cache_index = chunk_index;
+    }
+    size_t i = index-table[chunk_index].first_tract;
+    tract.assign(cache->points.begin()+cache_offset[i],cache->points.begin()+cache_offset[i+1]);
+    return true;
+}
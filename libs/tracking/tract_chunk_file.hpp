@@ -0,0 +1,96 @@
+#ifndef TRACT_CHUNK_FILE_HPP
+#define TRACT_CHUNK_FILE_HPP
+#include <vector>
+#include <fstream>
+#include <mutex>
+#include <memory>
+#include "tipl/tipl.hpp"
+
+// .tkc file layout:
+//   header (64 bytes)
+//   chunks, each compressed independently
+//   chunk table (file offset, compressed size, raw size, first tract of each chunk)
+// A chunk holds the point count, cluster, color, and tag of its tracts,
+// followed by the voxel coordinates and the per-point scalars (if any).
+// The cluster column is meaningful only if has_cluster is set.
+struct tract_chunk_header{
+    char id[8];
+    unsigned long long tract_count;
+    unsigned long long chunk_count;
+    unsigned long long table_offset;
+    unsigned int version;
+    unsigned int has_scalar;
+    short dim[3];
+    short reserved1;
+    float vs[3];
+    unsigned int has_cluster;
+};
+struct tract_chunk_entry{
+    unsigned long long offset;
+    unsigned long long compressed_size;
+    unsigned long long raw_size;
+    unsigned long long first_tract;
+};
+struct tract_chunk{
+    std::vector<unsigned int> length;// number of points
+    std::vector<unsigned int> cluster,color,tag;
+    std::vector<float> points;
+    std::vector<float> scalar;
+    size_t size(void) const{return length.size();}
+    void add(const float* tract,unsigned int point_count,
+             unsigned int cluster_,unsigned int color_,unsigned int tag_,const float* scalar_);
+    size_t raw_size(void) const;
+    bool encode(std::vector<unsigned char>& buf) const;
+    bool decode(const std::vector<unsigned char>& buf,size_t raw_size);
+};
+
+class tract_chunk_writer{
+    std::ofstream out;
+    tract_chunk_header header;
+    std::vector<tract_chunk_entry> table;
+    std::vector<tract_chunk> pending;
+    bool write_pending(void);
+public:
+    // points stored in one chunk before a new one is started
+    size_t chunk_point_count = 1 << 20;
+public:
+    bool open(const char* file_name,tipl::geometry<3> dim,tipl::vector<3> vs,
+              bool has_scalar = false,bool has_cluster = false);
+    // scalar is needed only if the file was opened with has_scalar
+    void add(const float* tract,unsigned int point_count,
+             unsigned int cluster = 0,unsigned int color = 0,unsigned int tag = 0,const float* scalar = 0);
+    size_t size(void) const{return header.tract_count;}
+    bool close(void);
+};
+
+class tract_chunk_reader{
+    std::ifstream in;
+    std::mutex read_mutex;
+    tract_chunk_header header;
+    std::vector<tract_chunk_entry> table;
+    // the last decoded chunk serves get_tract calls on neighboring tracts
+    std::shared_ptr<tract_chunk> cache;
+    std::vector<size_t> cache_offset;
+    size_t cache_index = 0;
+    size_t find_chunk(size_t tract_index) const;
+public:
+    bool open(const char* file_name);
+    size_t size(void) const{return header.tract_count;}
+    size_t chunk_count(void) const{return table.size();}
+    tipl::geometry<3> dim(void) const{return tipl::geometry<3>(header.dim[0],header.dim[1],header.dim[2]);}
+    tipl::vector<3> vs(void) const{return tipl::vector<3>(header.vs);}
+    bool has_scalar(void) const{return header.has_scalar;}
+    bool has_cluster(void) const{return header.has_cluster;}
+    // thread-safe: only the file access is serialized
+    bool read_chunk(size_t chunk_index,tract_chunk& chunk);
+    // reads tracts [from,from+count) and decodes the chunks in parallel.
+    // cluster is left empty if the file has no cluster information.
+    bool read(size_t from,size_t count,
+              std::vector<std::vector<float> >& tracts,
+              std::vector<unsigned int>& cluster,
+              std::vector<unsigned int>& color,
+              std::vector<unsigned int>& tag);
+    bool get_tract(size_t index,std::vector<float>& tract);
+};
+
+#endif // TRACT_CHUNK_FILE_HPP
@@ -1,6 +1,8 @@
 #include <set>
+#include <limits>
 #include "tract_cluster.hpp"
 #include "tipl/tipl.hpp"
+#include "prog_interface_static_link.h"
 
 struct compare_cluster
 {
@@ -35,15 +37,6 @@ TractCluster::TractCluster(const float* param):error_distance(param[3])
 
 }
 
-void TractCluster::set_tract_labels(Cluster* from,Cluster* to)
-{
-    std::vector<unsigned int>::const_iterator iter = from->tracts.begin();
-    std::vector<unsigned int>::const_iterator end = from->tracts.end();
-    for (;iter != end;++iter)
-        tract_labels[*iter] = to;
-
-}
-
 int TractCluster::get_index(short x,short y,short z)
 {
     int index = z;
@@ -53,71 +46,86 @@ int TractCluster::get_index(short x,short y,short z)
     index += x;
     return index;
 }
-/**
-prerequite:
-    tract_index1 > tract_index2
-*/
+unsigned int TractCluster::find_root(unsigned int tract_index)
+{
+    while(true)
+    {
+        unsigned long long value = tract_parent[tract_index];
+        unsigned int parent = (unsigned int)value;
+        if(parent == tract_index)
+            return tract_index;
+        // path halving: point to the grandparent while walking up
+        unsigned int grand_parent = (unsigned int)tract_parent[parent].load();
+        if(grand_parent != parent)
+            tract_parent[tract_index].compare_exchange_weak(value,(value & 0xFFFFFFFF00000000ull) | grand_parent);
+        tract_index = grand_parent;
+    }
+}
+
 void TractCluster::merge_tract(unsigned int tract_index1,unsigned int tract_index2)
 {
-    if (tract_index1 == tract_index2)
-        return;
-    std::lock_guard<std::mutex> lock(lock_merge);
-    Cluster* cluster_index = tract_labels[tract_index1];
-    if (cluster_index == 0) // no cluster
+    while(true)
     {
-        cluster_index = tract_labels[tract_index2];
-        if (cluster_index == 0) // create a cluster for both
-        {
-            std::shared_ptr<Cluster> new_cluster_index(new Cluster);
-            new_cluster_index->index = clusters.size();
-            clusters.push_back(new_cluster_index);
-
-            new_cluster_index->tracts.push_back(tract_index2);
-            tract_labels[tract_index2] = new_cluster_index.get();
-            new_cluster_index->tracts.push_back(tract_index1);
-            tract_labels[tract_index1] = new_cluster_index.get();
+        tract_index1 = find_root(tract_index1);
+        tract_index2 = find_root(tract_index2);
+        if (tract_index1 == tract_index2) // already in the same group
             return;
+        unsigned int rank1 = (unsigned int)(tract_parent[tract_index1] >> 32);
+        unsigned int rank2 = (unsigned int)(tract_parent[tract_index2] >> 32);
+        // link the lower-ranked root under the other one
+        if (rank1 > rank2 || (rank1 == rank2 && tract_index1 < tract_index2))
+        {
+            std::swap(rank1,rank2);
+            std::swap(tract_index1,tract_index2);
         }
-        else
+        unsigned long long root = ((unsigned long long)rank1 << 32) | tract_index1;
+        if (!tract_parent[tract_index1].compare_exchange_strong(root,((unsigned long long)rank1 << 32) | tract_index2))
+            continue; // the root changed by another thread, try again
+        if (rank1 == rank2)
         {
-            cluster_index->tracts.push_back(tract_index1);
-            tract_labels[tract_index1] = cluster_index;
-            return;
+            root = ((unsigned long long)rank2 << 32) | tract_index2;
+            tract_parent[tract_index2].compare_exchange_strong(root,((unsigned long long)(rank2+1) << 32) | tract_index2);
         }
+        return;
     }
-    else
+}
+
+void TractCluster::run_clustering(void)
+{
+    // materialize the clusters once: tracts sharing a root form one cluster
+    std::vector<unsigned int> root(tract_parent.size());
+    tipl::par_for(tract_parent.size(),[&](unsigned int tract_index)
     {
-        Cluster* another_cluster_index = tract_labels[tract_index2];
-        if (another_cluster_index == 0) // add tract2 to the cluster
+        root[tract_index] = find_root(tract_index);
+    });
+    std::vector<unsigned int> cluster_size(root.size());
+    for (unsigned int tract_index = 0;tract_index < root.size();++tract_index)
+        ++cluster_size[root[tract_index]];
+    std::vector<unsigned int> cluster_index(root.size(),0);// 0 is no cluster
+    clusters.clear();
+    for (unsigned int tract_index = 0;tract_index < root.size();++tract_index)
+    {
+        unsigned int r = root[tract_index];
+        if (cluster_size[r] < 2) // not merged with any tract
+            continue;
+        if (!cluster_index[r])
         {
-            cluster_index->tracts.push_back(tract_index2);
-            tract_labels[tract_index2] = cluster_index;
-            return;
+            clusters.push_back(std::make_shared<Cluster>());
+            clusters.back()->tracts.reserve(cluster_size[r]);
+            cluster_index[r] = clusters.size();
         }
-        if (another_cluster_index == cluster_index) // already in the same group
-            return;
-        // merge two clusters
-        if (another_cluster_index->tracts.size() > cluster_index->tracts.size())
-            std::swap(cluster_index,another_cluster_index);
-
-        cluster_index->tracts.resize(another_cluster_index->tracts.size()+cluster_index->tracts.size());
-        std::copy(another_cluster_index->tracts.begin(),another_cluster_index->tracts.end(),
-                  cluster_index->tracts.end()-another_cluster_index->tracts.size());
-
-        set_tract_labels(another_cluster_index,cluster_index);
-        clusters.back()->index = another_cluster_index->index;
-        clusters[another_cluster_index->index] = clusters.back();
-        clusters.pop_back();
-
+        clusters[cluster_index[r]-1]->tracts.push_back(tract_index);
     }
+    sort_cluster();
 }
 
-void TractCluster::add_tracts(const std::vector<std::vector<float> >& tracks)
+void TractCluster::add_tracts(const tract_arena& tracks)
 {
-    tract_labels.clear();
     tract_passed_voxels.clear();
     tract_ranged_voxels.clear();
-    tract_labels.resize(tracks.size());
+    tract_parent = std::vector<std::atomic<unsigned long long> >(tracks.size());
+    for(unsigned int tract_index = 0;tract_index < tracks.size();++tract_index)
+        tract_parent[tract_index] = tract_index;
     tract_length.resize(tracks.size());
     tract_passed_voxels.resize(tracks.size());
     tract_ranged_voxels.resize(tracks.size());
@@ -163,6 +171,8 @@ void TractCluster::add_tracts(const std::vector<std::vector<float> >& tracks)
     // book keeping passing points
     for(unsigned int tract_index = 0;tract_index < tracks.size();++tract_index)
     {
+        if(tract_passed_voxels[tract_index].empty())
+            continue;
         voxel_connection[tract_passed_voxels[tract_index].front()].push_back(tract_index);
         voxel_connection[tract_passed_voxels[tract_index].back()].push_back(tract_index);
     }
@@ -192,9 +202,7 @@ void TractCluster::add_tracts(const std::vector<std::vector<float> >& tracks)
         for (int i = 0;i < passing_tracts.size();++i)
         {
             unsigned int cur_index = passing_tracts[i];
-            Cluster* label1 = tract_labels[tract_index];
-            Cluster* label2 = tract_labels[cur_index];
-            if (label1 != 0 && label1 == label2)
+            if (find_root(tract_index) == find_root(cur_index))
                 continue;
             unsigned int cur_count = tract_length[cur_index];
             float dif = cur_count;
@@ -210,3 +218,194 @@ void TractCluster::add_tracts(const std::vector<std::vector<float> >& tracks)
         }
     });
 }
+
+unsigned long long QuickBundleCluster::get_cell(const tipl::vector<3,float>& center,int dx,int dy,int dz) const
+{
+    unsigned long long x = int(std::floor(center[0]/threshold))+dx+(1 << 20);
+    unsigned long long y = int(std::floor(center[1]/threshold))+dy+(1 << 20);
+    unsigned long long z = int(std::floor(center[2]/threshold))+dz+(1 << 20);
+    return (z << 42) | (y << 21) | x;
+}
+
+void QuickBundleCluster::resample(tract_arena::const_span tract,float* points) const
+{
+    unsigned int count = tract.size()/3;
+    // arc length at each point
+    std::vector<float> length(count);
+    for(unsigned int i = 1;i < count;++i)
+        length[i] = length[i-1]+(tipl::vector<3,float>(&tract[i*3])-tipl::vector<3,float>(&tract[i*3-3])).length();
+    float step = length.back()/float(point_count-1);
+    for(unsigned int k = 0,i = 0;k < point_count;++k,points += 3)
+    {
+        if(count == 1)
+        {
+            std::copy(tract.begin(),tract.begin()+3,points);
+            continue;
+        }
+        float pos = step*float(k);
+        while(i+2 < count && length[i+1] < pos)
+            ++i;
+        float segment = length[i+1]-length[i];
+        float w = segment > 0.0f ? std::min<float>(1.0f,(pos-length[i])/segment) : 0.0f;
+        for(unsigned int d = 0;d < 3;++d)
+            points[d] = tract[i*3+d]*(1.0f-w)+tract[i*3+3+d]*w;
+    }
+}
+
+float QuickBundleCluster::distance(const float* points,const float* centroid,float max_distance,bool& flip) const
+{
+    float max_sum = max_distance*float(point_count);
+    float direct = 0.0f,flipped = 0.0f;
+    for(unsigned int k = 0;k < point_count && (direct < max_sum || flipped < max_sum);++k)
+    {
+        direct += (tipl::vector<3,float>(points+k*3)-tipl::vector<3,float>(centroid+k*3)).length();
+        flipped += (tipl::vector<3,float>(points+k*3)-tipl::vector<3,float>(centroid+(point_count-1-k)*3)).length();
+    }
+    flip = flipped < direct;
+    return std::min(direct,flipped)/float(point_count);
+}
+
+void QuickBundleCluster::add_to_centroid(unsigned int centroid_index,const float* points,bool flip)
+{
+    if(centroid_index == centroids.size())
+    {
+        centroids.push_back(std::vector<float>(points,points+point_count*3));
+        centroid_center.push_back(tipl::vector<3,float>());
+        centroid_size.push_back(1);
+    }
+    else
+    {
+        // running mean of the aligned points
+        float w = 1.0f/float(++centroid_size[centroid_index]);
+        float* centroid = &centroids[centroid_index][0];
+        for(unsigned int k = 0;k < point_count;++k)
+        {
+            const float* p = points+(flip ? point_count-1-k : k)*3;
+            for(unsigned int d = 0;d < 3;++d)
+                centroid[k*3+d] += (p[d]-centroid[k*3+d])*w;
+        }
+        std::vector<unsigned int>& cell = grid[get_cell(centroid_center[centroid_index])];
+        cell.erase(std::find(cell.begin(),cell.end(),centroid_index));
+    }
+    tipl::vector<3,float> center;
+    for(unsigned int k = 0;k < point_count;++k)
+        center += tipl::vector<3,float>(&centroids[centroid_index][k*3]);
+    center /= float(point_count);
+    centroid_center[centroid_index] = center;
+    grid[get_cell(center)].push_back(centroid_index);
+}
+
+template<class function_type>
+void QuickBundleCluster::for_each_nearby_centroid(const tipl::vector<3,float>& center,function_type fun) const
+{
+    for(int dz = -1;dz <= 1;++dz)
+        for(int dy = -1;dy <= 1;++dy)
+            for(int dx = -1;dx <= 1;++dx)
+            {
+                auto iter = grid.find(get_cell(center,dx,dy,dz));
+                if(iter == grid.end())
+                    continue;
+                for(unsigned int i = 0;i < iter->second.size();++i)
+                    fun(iter->second[i]);
+            }
+}
+
+void QuickBundleCluster::add_tracts(const tract_arena& tracks)
+{
+    const unsigned int no_cluster = std::numeric_limits<unsigned int>::max();
+    centroids.clear();
+    centroid_center.clear();
+    centroid_size.clear();
+    grid.clear();
+    tract_labels.clear();
+    tract_labels.resize(tracks.size(),no_cluster);
+    // only one batch of resampled tracts is kept in memory
+    std::vector<float> batch_points;
+    std::vector<tipl::vector<3,float> > batch_center;
+    std::vector<float> batch_distance;
+    std::vector<unsigned int> batch_label;
+    std::vector<char> batch_flip;
+    for(size_t from = 0,batch_size = 1024;from < tracks.size();
+        from += batch_size,batch_size = std::min<size_t>(batch_size*2,65536))
+    {
+        size_t size = std::min<size_t>(batch_size,tracks.size()-from);
+        batch_points.resize(size*point_count*3);
+        batch_center.resize(size);
+        batch_distance.resize(size);
+        batch_label.resize(size);
+        batch_flip.resize(size);
+        // match the tracts to the centroids from the previous batches in parallel
+        tipl::par_for(size,[&](unsigned int i)
+        {
+            batch_label[i] = no_cluster;
+            batch_distance[i] = threshold;
+            if(tracks[from+i].empty())
+                return;
+            float* points = &batch_points[i*point_count*3];
+            resample(tracks[from+i],points);
+            tipl::vector<3,float> center;
+            for(unsigned int k = 0;k < point_count;++k)
+                center += tipl::vector<3,float>(points+k*3);
+            center /= float(point_count);
+            batch_center[i] = center;
+            // the distance between the centers is a lower bound of MDF
+            for_each_nearby_centroid(center,[&](unsigned int j)
+            {
+                if((centroid_center[j]-center).length() >= batch_distance[i])
+                    return;
+                bool flip = false;
+                float d = distance(points,&centroids[j][0],batch_distance[i],flip);
+                if(d < batch_distance[i])
+                {
+                    batch_distance[i] = d;
+                    batch_label[i] = j;
+                    batch_flip[i] = flip;
+                }
+            });
+        });
+        // then check the centroids created within this batch in tract order
+        unsigned int first_new = centroids.size();
+        for(size_t i = 0;i < size;++i)
+        {
+            if(tracks[from+i].empty())
+                continue;
+            const float* points = &batch_points[i*point_count*3];
+            for_each_nearby_centroid(batch_center[i],[&](unsigned int j)
+            {
+                if(j < first_new || (centroid_center[j]-batch_center[i]).length() >= batch_distance[i])
+                    return;
+                bool flip = false;
+                float d = distance(points,&centroids[j][0],batch_distance[i],flip);
+                if(d < batch_distance[i])
+                {
+                    batch_distance[i] = d;
+                    batch_label[i] = j;
+                    batch_flip[i] = flip;
+                }
+            });
+            if(batch_label[i] == no_cluster)
+                batch_label[i] = centroids.size();
+            add_to_centroid(batch_label[i],points,batch_flip[i]);
+            tract_labels[from+i] = batch_label[i];
+        }
+        check_prog(from+size,tracks.size());
+        if(prog_aborted())
+            break;
+    }
+    check_prog(0,0);
+}
+
+void QuickBundleCluster::run_clustering(void)
+{
+    clusters.resize(centroids.size());
+    for(unsigned int index = 0;index < clusters.size();++index)
+    {
+        clusters[index] = std::make_shared<Cluster>();
+        clusters[index]->tracts.reserve(centroid_size[index]);
+    }
+    for(unsigned int tract_index = 0;tract_index < tract_labels.size();++tract_index)
+        if(tract_labels[tract_index] < clusters.size())
+            clusters[tract_labels[tract_index]]->tracts.push_back(tract_index);
+    std::vector<unsigned int>().swap(tract_labels);
+    sort_cluster();
+}
@@ -1,8 +1,11 @@
 #ifndef TRACT_CLUSTER_HPP
 #define TRACT_CLUSTER_HPP
 #include <vector>
+#include <atomic>
+#include <unordered_map>
 #include "tipl/tipl.hpp"
 #include <map>
+#include "tract_arena.hpp"
 
 struct Cluster
 {
@@ -17,7 +20,7 @@ protected:
     std::vector<std::shared_ptr<Cluster> > clusters;
     void sort_cluster(void);
 public:
-    virtual void add_tracts(const std::vector<std::vector<float> >& tracks) = 0;
+    virtual void add_tracts(const tract_arena& tracks) = 0;
     virtual void run_clustering(void) = 0;
 public:
     unsigned int get_cluster_count(void) const
@@ -44,7 +47,7 @@ public:
     virtual ~FeatureBasedClutering(void) {}
 
 public:
-    virtual void add_tracts(const std::vector<std::vector<float> >& tracks)
+    virtual void add_tracts(const tract_arena& tracks)
     {
         for(int i = 0;i < tracks.size();++i)
             if(!tracks[i].empty())
@@ -89,17 +92,15 @@ class TractCluster : public BasicCluster
     tipl::geometry<3> dim;
     unsigned int w,wh;
     float error_distance;
-    std::mutex  lock_merge;
 private:
-
-
-    void set_tract_labels(Cluster* from,Cluster* to);
+    // lock-free union-find: rank in the upper 32 bits, parent tract in the lower 32 bits
+    std::vector<std::atomic<unsigned long long> > tract_parent;
+    unsigned int find_root(unsigned int tract_index);
     void merge_tract(unsigned int tract_index1,unsigned int tract_index2);
     int get_index(short x,short y,short z);
 private:
     std::vector<std::vector<unsigned int> > voxel_connection;
 private:
-    std::vector<Cluster*> tract_labels;// 0 is no cluster
     std::vector<std::vector<unsigned short> > tract_passed_voxels;
     std::vector<std::vector<unsigned short> > tract_ranged_voxels;
     std::vector<unsigned int>							 tract_length;
@@ -108,12 +109,38 @@ private:
 
 public:
     TractCluster(const float* param);
-    void add_tracts(const std::vector<std::vector<float> >& tracks);
-	void run_clustering(void){sort_cluster();}
+    void add_tracts(const tract_arena& tracks);
+    void run_clustering(void);
 
 };
 
 
 
 
+// QuickBundles: tracts resampled to a fixed number of points are assigned to the
+// nearest centroid by the minimum average direct-flip (MDF) distance
+class QuickBundleCluster : public BasicCluster
+{
+    static const unsigned int point_count = 12;
+    float threshold;
+    std::vector<std::vector<float> > centroids;// resampled points
+    std::vector<tipl::vector<3,float> > centroid_center;
+    std::vector<unsigned int> centroid_size;
+    std::vector<unsigned int> tract_labels;
+    // centroids indexed by the grid cell (threshold wide) of their center points
+    std::unordered_map<unsigned long long,std::vector<unsigned int> > grid;
+private:
+    unsigned long long get_cell(const tipl::vector<3,float>& center,int dx = 0,int dy = 0,int dz = 0) const;
+    template<class function_type>
+    void for_each_nearby_centroid(const tipl::vector<3,float>& center,function_type fun) const;
+    void resample(tract_arena::const_span tract,float* points) const;
+    float distance(const float* points,const float* centroid,float max_distance,bool& flip) const;
+    void add_to_centroid(unsigned int centroid_index,const float* points,bool flip);
+public:
+    // param[3] is the distance threshold in voxels
+    QuickBundleCluster(const float* param):threshold(param[3]){}
+    void add_tracts(const tract_arena& tracks);
+    void run_clustering(void);
+};
+
 #endif//TRACT_CLUSTER_HPP
@@ -1,10 +1,19 @@
 //---------------------------------------------------------------------------
 #include <QString>
+#include <QFile>
 #include <fstream>
 #include <sstream>
 #include <iterator>
 #include <set>
 #include <map>
+#include <queue>
+#include <bitset>
+#include <numeric>
+#include <iomanip>
+#include <thread>
+#include <future>
+#include <mutex>
+#include <cstring>
 #include "roi.hpp"
 #include "tract_model.hpp"
 #include "prog_interface_static_link.h"
@@ -13,6 +22,7 @@
 #include "mapping/atlas.hpp"
 #include "gzip_interface.hpp"
 #include "tract_cluster.hpp"
+#include "tract_chunk_file.hpp"
 #include "../../tracking/region/Regions.h"
 
 void smoothed_tracks(const std::vector<float>& track,std::vector<float>& smoothed)
@@ -90,6 +100,47 @@ void resample_tracks(const std::vector<float>& track,std::vector<float>& new_tra
 }
 
 
+// converts tracts [from,to) in parallel into consecutive records of one buffer
+// record_size(i) gives the number of floats of tract i, and fill(i,ptr) writes them
+template<class size_fun,class fill_fun>
+void pack_tracts(size_t from,size_t to,std::vector<float>& buf,size_fun record_size,fill_fun fill)
+{
+    std::vector<size_t> pos(to-from+1);
+    for(size_t i = from;i < to;++i)
+        pos[i-from+1] = pos[i-from]+record_size(i);
+    buf.resize(pos.back());
+    tipl::par_for(to-from,[&](unsigned int i)
+    {
+        fill(from+i,buf.data()+pos[i]);
+    });
+}
+// the next batch of tracts is converted while the previous one is compressed and written
+template<class stream_type,class size_fun,class fill_fun>
+bool write_tracts(stream_type& out,size_t tract_count,size_fun record_size,fill_fun fill)
+{
+    const size_t batch_size = 65536;
+    std::vector<float> buf,write_buf;
+    std::future<void> writing;
+    begin_prog("saving");
+    for(size_t from = 0;from < tract_count && !prog_aborted();from += batch_size)
+    {
+        check_prog(from*100/tract_count,100);
+        pack_tracts(from,std::min<size_t>(from+batch_size,tract_count),buf,record_size,fill);
+        if(writing.valid())
+            writing.wait();
+        buf.swap(write_buf);
+        if(!write_buf.empty())
+            writing = std::async(std::launch::async,[&]()
+            {
+                out.write((const char*)&write_buf[0],write_buf.size()*sizeof(float));
+            });
+    }
+    if(writing.valid())
+        writing.wait();
+    check_prog(0,0);
+    return out.good();
+}
+
 struct TrackVis
 {
     char id_string[6];//ID string for track file. The first 5 characters must be "TRACK".
@@ -149,34 +200,38 @@ struct TrackVis
         version = 2;
         hdr_size = 1000;
     }
-    bool load_from_file(const char* file_name_,
-                std::vector<std::vector<float> >& loaded_tract_data,
-                std::vector<unsigned int>& loaded_tract_cluster,
-                               tipl::vector<3> vs)
+    // converts the complete records in buf and returns the number of bytes consumed
+    size_t read_tracts(const char* buf,size_t buf_size,size_t max_count,
+                       std::vector<std::vector<float> >& loaded_tract_data,
+                       std::vector<unsigned int>& loaded_tract_cluster,
+                       const tipl::vector<3>& vs)
     {
-        gz_istream in;
-        if (!in.open(file_name_))
-            return false;
-        in.read((char*)this,1000);
-        unsigned int track_number = n_count;
-        if(!track_number) // number is not stored
-            track_number = 100000000;
-        begin_prog("loading");
-        for (unsigned int index = 0;!(!in) && check_prog(index,track_number);++index)
+        // locating the records only needs the point counts
+        unsigned int index_shift = 3 + n_scalars;
+        std::vector<const float*> record;
+        std::vector<unsigned int> record_point;
+        size_t pos = 0;
+        while(record.size() < max_count && pos + sizeof(int) <= buf_size)
         {
-            unsigned int n_point;
-            in.read((char*)&n_point,sizeof(int));
-            unsigned int index_shift = 3 + n_scalars;
-            std::vector<float> tract(index_shift*n_point + n_properties);
-            if(!in.read((char*)&*tract.begin(),sizeof(float)*tract.size()))
-            {
-                check_prog(0,0);
+            unsigned int n_point = *(const unsigned int*)(buf+pos);
+            size_t record_size = sizeof(int)+sizeof(float)*(size_t(index_shift)*n_point + n_properties);
+            if(buf_size - pos < record_size)
                 break;
-            }
-
-            loaded_tract_data.push_back(std::move(std::vector<float>(n_point*3)));
-            const float *from = &*tract.begin();
-            float *to = &*loaded_tract_data.back().begin();
+            record.push_back((const float*)(buf+pos+sizeof(int)));
+            record_point.push_back(n_point);
+            pos += record_size;
+        }
+        size_t base = loaded_tract_data.size();
+        loaded_tract_data.resize(base+record.size());
+        if(n_properties == 1)
+            loaded_tract_cluster.resize(base+record.size());
+        tipl::par_for(record.size(),[&](unsigned int index)
+        {
+            unsigned int n_point = record_point[index];
+            std::vector<float>& tract = loaded_tract_data[base+index];
+            tract.resize(n_point*3);
+            const float *from = record[index];
+            float *to = &*tract.begin();
             for (unsigned int i = 0;i < n_point;++i,from += index_shift,to += 3)
             {
                 float x = from[0]/vs[0];
@@ -193,14 +248,64 @@ struct TrackVis
                 to[2] = z;
             }
             if(n_properties == 1)
-                loaded_tract_cluster.push_back(from[0]);
+                loaded_tract_cluster[base+index] = from[0];
+        });
+        return pos;
+    }
+    bool load_from_file(const char* file_name_,
+                std::vector<std::vector<float> >& loaded_tract_data,
+                std::vector<unsigned int>& loaded_tract_cluster,
+                               tipl::vector<3> vs)
+    {
+        // uncompressed files are parsed directly from the mapped memory
+        if(!QString(file_name_).endsWith(".gz"))
+        {
+            QFile file(file_name_);
+            if(!file.open(QIODevice::ReadOnly) || file.size() < 1000)
+                return false;
+            if(const char* buf = (const char*)file.map(0,file.size()))
+            {
+                std::copy(buf,buf+1000,(char*)this);
+                begin_prog("loading");
+                read_tracts(buf+1000,size_t(file.size())-1000,n_count ? size_t(n_count):~size_t(0),
+                            loaded_tract_data,loaded_tract_cluster,vs);
+                check_prog(0,0);
+                return true;
+            }
+        }
+        gz_istream in;
+        if (!in.open(file_name_))
+            return false;
+        if(!in.read((char*)this,1000))
+            return false;
+        size_t track_number = n_count ? size_t(n_count):~size_t(0);
+        // inflate in large blocks and carry the incomplete record over to the next block
+        const size_t block_size = 1 << 26;
+        std::vector<char> buf;
+        size_t buf_used = 0;
+        begin_prog("loading");
+        while(loaded_tract_data.size() < track_number)
+        {
+            if(buf.size() < buf_used + block_size)
+                buf.resize(buf_used + block_size);
+            size_t read_size = in.read_some(&buf[buf_used],block_size);
+            buf_used += read_size;
+            size_t used = read_tracts(&buf[0],buf_used,track_number-loaded_tract_data.size(),
+                                      loaded_tract_data,loaded_tract_cluster,vs);
+            std::copy(buf.begin()+used,buf.begin()+buf_used,buf.begin());
+            buf_used -= used;
+            check_prog(std::min<size_t>(99,100*in.cur()/std::max<size_t>(1,in.size())),100);
+            if(!read_size || prog_aborted())
+                break;
         }
+        check_prog(0,0);
         return true;
     }
+    template<class tracts_type>
     static bool save_to_file(const char* file_name,
                              tipl::geometry<3> geo,
                              tipl::vector<3> vs,
-                             const std::vector<std::vector<float> >& tract_data,
+                             const tracts_type& tract_data,
                              const std::vector<std::vector<float> >& scalar)
     {
         gz_ostream out;
@@ -213,31 +318,24 @@ struct TrackVis
             trk.n_scalars = 1;
         out.write((const char*)&trk,1000);
 
-        begin_prog("saving");
-        for (unsigned int i = 0;check_prog(i,tract_data.size());++i)
-        {
-            int n_point = tract_data[i].size()/3;
-            std::vector<float> buffer(trk.n_scalars ? tract_data[i].size()+scalar[i].size() : tract_data[i].size());
-            float* to = &*buffer.begin();
-            for (unsigned int flag = 0,j = 0,k = 0;j < tract_data[i].size();++j,++to)
+        unsigned int index_shift = 3 + trk.n_scalars;
+        bool result = write_tracts(out,tract_data.size(),
+            [&](size_t i){return 1+tract_data[i].size()/3*index_shift;},
+            [&](size_t i,float* to)
             {
-                *to = tract_data[i][j]*vs[flag];
-                ++flag;
-                if (flag == 3)
+                int n_point = tract_data[i].size()/3;
+                std::memcpy(to,&n_point,sizeof(int));
+                ++to;
+                for (unsigned int j = 0,k = 0;j < tract_data[i].size();j += 3,++k,to += index_shift)
                 {
-                    flag = 0;
+                    to[0] = tract_data[i][j]*vs[0];
+                    to[1] = tract_data[i][j+1]*vs[1];
+                    to[2] = tract_data[i][j+2]*vs[2];
                     if(trk.n_scalars)
-                    {
-                        ++to;
-                        *to = scalar[i][k];
-                        ++k;
-                    }
+                        to[3] = scalar[i][k];
                 }
-            }
-            out.write((const char*)&n_point,sizeof(int));
-            out.write((const char*)&*buffer.begin(),sizeof(float)*buffer.size());
-        }
-        return true;
+            });
+        return out.close() && result;
     }
 };
 
@@ -254,12 +352,17 @@ void TractModel::add(const TractModel& rhs)
     for(unsigned int index = 0;index < rhs.redo_size.size();++index)
         redo_size.push_back(std::make_pair(rhs.redo_size[index].first + tract_data.size(),
                                            rhs.redo_size[index].second));
-    tract_data.insert(tract_data.end(),rhs.tract_data.begin(),rhs.tract_data.end());
+    tract_data.reserve(rhs.tract_data.size()+rhs.deleted_tract_slot.size(),rhs.tract_data.coordinate_count());
+    for(size_t index = 0;index < rhs.tract_data.size();++index)
+        tract_data.push_back(rhs.tract_data[index]);
+    clear_start_point_bucket();
     tract_color.insert(tract_color.end(),rhs.tract_color.begin(),rhs.tract_color.end());
     tract_tag.insert(tract_tag.end(),rhs.tract_tag.begin(),rhs.tract_tag.end());
-    deleted_tract_data.insert(deleted_tract_data.end(),
-                              rhs.deleted_tract_data.begin(),
-                              rhs.deleted_tract_data.end());
+    for(size_t index = 0;index < rhs.deleted_tract_slot.size();++index)
+    {
+        auto tract = rhs.tract_data.get_slot(rhs.deleted_tract_slot[index]);
+        deleted_tract_slot.push_back(tract_data.add_slot(tract.begin(),tract.size()));
+    }
     deleted_tract_color.insert(deleted_tract_color.end(),
                                rhs.deleted_tract_color.begin(),
                                rhs.deleted_tract_color.end());
@@ -276,12 +379,24 @@ bool TractModel::load_from_file(const char* file_name_,bool append)
 {
     std::string file_name(file_name_);
     std::vector<std::vector<float> > loaded_tract_data;
-    std::vector<unsigned int> loaded_tract_cluster;
+    std::vector<unsigned int> loaded_tract_cluster,loaded_tract_color,loaded_tract_tag;
 
     std::string ext;
     if(file_name.length() > 4)
         ext = std::string(file_name.end()-4,file_name.end());
 
+    if(ext == std::string(".tkc"))
+    {
+        tract_chunk_reader in;
+        if(!in.open(file_name_))
+            return false;
+        begin_prog("loading");
+        bool result = in.read(0,in.size(),loaded_tract_data,loaded_tract_cluster,loaded_tract_color,loaded_tract_tag);
+        check_prog(0,0);
+        if(!result)
+            return false;
+    }
+    else
     if(ext == std::string(".trk") || ext == std::string("k.gz"))
         {
             TrackVis trk;
@@ -312,25 +427,35 @@ bool TractModel::load_from_file(const char* file_name_,bool append)
         else
         if (ext == std::string(".txt"))
         {
-            std::ifstream in(file_name_);
+            std::ifstream in(file_name_,std::ios::binary);
             if (!in)
                 return false;
-            std::string line;
+            std::string text;
             in.seekg(0,std::ios::end);
-            unsigned int total = in.tellg();
+            text.resize(size_t(in.tellg()));
             in.seekg(0,std::ios::beg);
+            if(!text.empty() && !in.read(&text[0],text.size()))
+                return false;
+            // one tract per line, parsed in parallel
+            std::vector<size_t> line_pos;
+            for(size_t pos = 0;pos < text.size();)
+            {
+                line_pos.push_back(pos);
+                pos = text.find('\n',pos);
+                pos = (pos == std::string::npos) ? text.size() : pos+1;
+            }
+            line_pos.push_back(text.size());
+            loaded_tract_data.resize(line_pos.size()-1);
             begin_prog("loading");
-            while (std::getline(in,line))
+            tipl::par_for(loaded_tract_data.size(),[&](unsigned int index)
             {
-                check_prog(in.tellg(),total);
-                loaded_tract_data.push_back(std::vector<float>());
-                std::istringstream in(line);
+                std::istringstream in(text.substr(line_pos[index],line_pos[index+1]-line_pos[index]));
                 std::copy(std::istream_iterator<float>(in),
-                          std::istream_iterator<float>(),std::back_inserter(loaded_tract_data.back()));
-
-                if(loaded_tract_data.back().size() == 1)// cluster info
-                    loaded_tract_cluster.push_back(loaded_tract_data.back()[0]);
-            }
+                          std::istream_iterator<float>(),std::back_inserter(loaded_tract_data[index]));
+            });
+            for(unsigned int index = 0;index < loaded_tract_data.size();++index)
+                if(loaded_tract_data[index].size() == 1)// cluster info
+                    loaded_tract_cluster.push_back(loaded_tract_data[index][0]);
             check_prog(0,0);
 
         }
@@ -382,29 +507,55 @@ bool TractModel::load_from_file(const char* file_name_,bool append)
                         if(!in)
                             return false;
                     }
-                    std::ifstream in(file_name.c_str(),std::ios::binary);
-                    if(!in)
+                    QFile file(file_name_);
+                    if(!file.open(QIODevice::ReadOnly) || file.size() <= offset)
+                        return false;
+                    const unsigned int* buf = (const unsigned int*)file.map(offset,file.size()-offset);
+                    if(!buf)
                         return false;
-                    in.seekg(0,std::ios::end);
-                    unsigned int total_size = in.tellg();
-                    in.seekg(offset,std::ios::beg);
-                    std::vector<unsigned int> buf((total_size-offset)/4);
-                    in.read((char*)&*buf.begin(),total_size-offset-16);// 16 skip the final inf
-                    for(unsigned int index = 0;index < buf.size();)
+                    // points and delimiters are all triplets: NaN ends a tract, and Inf ends the file
+                    size_t triplet_count = size_t(file.size()-offset)/12;
+                    unsigned int block_count = std::max<unsigned int>(1,std::thread::hardware_concurrency());
+                    std::vector<std::vector<size_t> > block_delimiter(block_count);
+                    std::vector<size_t> block_end(block_count,triplet_count);
+                    begin_prog("loading");
+                    tipl::par_for(block_count,[&](unsigned int block)
                     {
-
-                        unsigned int end = std::find(buf.begin()+index,buf.end(),0x7FC00000)-buf.begin(); // NaN
-                        if(end-index > 3)
+                        for(size_t i = triplet_count*block/block_count;i < triplet_count*(block+1)/block_count;++i)
                         {
-                            std::vector<float> track(end-index);
-                            std::copy((const float*)&*buf.begin() + index,
-                                      (const float*)&*buf.begin() + end,
-                                      track.begin());
-                            loaded_tract_data.push_back(std::move(track));
-                            tipl::divide_constant(loaded_tract_data.back().begin(),loaded_tract_data.back().end(),handle->vs[0]);
+                            if(buf[i*3] == 0x7FC00000) // NaN
+                                block_delimiter[block].push_back(i);
+                            if(buf[i*3] == 0x7F800000) // Inf
+                            {
+                                block_end[block] = i;
+                                break;
+                            }
                         }
-                        index = end+3;
-                    }
+                    });
+                    size_t end = *std::min_element(block_end.begin(),block_end.end());
+                    std::vector<std::pair<size_t,size_t> > tract_range;
+                    size_t from = 0;
+                    for(unsigned int block = 0;block < block_count;++block)
+                        for(size_t to : block_delimiter[block])
+                        {
+                            if(to > end)
+                                break;
+                            if(to-from > 1)
+                                tract_range.push_back(std::make_pair(from,to));
+                            from = to+1;
+                        }
+                    if(end > from+1)
+                        tract_range.push_back(std::make_pair(from,end));
+                    loaded_tract_data.resize(tract_range.size());
+                    tipl::par_for(tract_range.size(),[&](unsigned int index)
+                    {
+                        const float* first = (const float*)buf + tract_range[index].first*3;
+                        const float* last = (const float*)buf + tract_range[index].second*3;
+                        loaded_tract_data[index].resize(last-first);
+                        std::transform(first,last,loaded_tract_data[index].begin(),
+                                       [&](float v){return v/handle->vs[0];});
+                    });
+                    check_prog(0,0);
 
                 }
 
@@ -419,12 +570,13 @@ bool TractModel::load_from_file(const char* file_name_,bool append)
         loaded_tract_cluster.swap(tract_cluster);
     else
         tract_cluster.clear();
-    loaded_tract_data.swap(tract_data);
-    tract_color.clear();
-    tract_color.resize(tract_data.size());
-    tract_tag.clear();
-    tract_tag.resize(tract_data.size());
-    deleted_tract_data.clear();
+    loaded_tract_color.resize(loaded_tract_data.size());
+    loaded_tract_tag.resize(loaded_tract_data.size());
+    tract_data.assign(loaded_tract_data);
+    clear_start_point_bucket();
+    loaded_tract_color.swap(tract_color);
+    loaded_tract_tag.swap(tract_tag);
+    deleted_tract_slot.clear();
     deleted_tract_color.clear();
     deleted_tract_tag.clear();
     deleted_count.clear();
@@ -433,6 +585,47 @@ bool TractModel::load_from_file(const char* file_name_,bool append)
     return true;
 }
 
+//---------------------------------------------------------------------------
+bool TractModel::load_range_from_file(const char* file_name,size_t from,size_t count)
+{
+    tract_chunk_reader in;
+    std::vector<std::vector<float> > loaded_tract_data;
+    std::vector<unsigned int> loaded_tract_cluster,loaded_tract_color,loaded_tract_tag;
+    if(!in.open(file_name) ||
+       !in.read(from,count,loaded_tract_data,loaded_tract_cluster,loaded_tract_color,loaded_tract_tag))
+        return false;
+    tract_data.assign(loaded_tract_data);
+    clear_start_point_bucket();
+    loaded_tract_cluster.swap(tract_cluster);
+    loaded_tract_color.swap(tract_color);
+    loaded_tract_tag.swap(tract_tag);
+    deleted_tract_slot.clear();
+    deleted_tract_color.clear();
+    deleted_tract_tag.clear();
+    deleted_count.clear();
+    is_cut.clear();
+    redo_size.clear();
+    return true;
+}
+//---------------------------------------------------------------------------
+bool TractModel::save_chunk_file(const char* file_name,const std::vector<std::vector<float> >* scalar)
+{
+    tract_chunk_writer out;
+    bool has_cluster = !tract_cluster.empty() && tract_cluster.size() == tract_data.size();
+    if(!out.open(file_name,geometry,vs,scalar != 0,has_cluster))
+        return false;
+    begin_prog("saving");
+    for(size_t i = 0;i < tract_data.size();++i)
+    {
+        if((i & 0xFFF) == 0)
+            check_prog(i*100/tract_data.size(),100);
+        out.add(tract_data[i].empty() ? 0 : &tract_data[i][0],tract_data[i].size()/3,
+                has_cluster ? tract_cluster[i] : 0,tract_color[i],tract_tag[i],
+                scalar && !(*scalar)[i].empty() ? &(*scalar)[i][0] : 0);
+    }
+    check_prog(0,0);
+    return out.close();
+}
 //---------------------------------------------------------------------------
 bool TractModel::save_data_to_file(const char* file_name,const std::string& index_name)
 {
@@ -451,6 +644,8 @@ bool TractModel::save_data_to_file(const char* file_name,const std::string& inde
             file_name_s += ".gz";
         return TrackVis::save_to_file(file_name_s.c_str(),geometry,vs,tract_data,data);
     }
+    if(ext == std::string(".tkc"))
+        return save_chunk_file(file_name,&data);
     if (ext == std::string(".txt"))
     {
         std::ofstream out(file_name,std::ios::binary);
@@ -470,12 +665,14 @@ bool TractModel::save_data_to_file(const char* file_name,const std::string& inde
         if(!out)
             return false;
         std::vector<float> buf;
-        std::vector<unsigned int> length;
-        for(unsigned int index = 0;index < data.size();++index)
-        {
-            length.push_back((unsigned int)data[index].size());
-            std::copy(data[index].begin(),data[index].end(),std::back_inserter(buf));
-        }
+        std::vector<unsigned int> length(data.size());
+        pack_tracts(0,data.size(),buf,
+            [&](size_t i){return data[i].size();},
+            [&](size_t i,float* to)
+            {
+                length[i] = data[i].size();
+                std::copy(data[i].begin(),data[i].end(),to);
+            });
         out.write("data",&*buf.begin(),1,(unsigned int)buf.size());
         out.write("length",&*length.begin(),1,(unsigned int)length.size());
         return true;
@@ -486,7 +683,7 @@ bool TractModel::save_data_to_file(const char* file_name,const std::string& inde
 //---------------------------------------------------------------------------
 bool TractModel::save_tracts_in_native_space(const char* file_name,tipl::image<tipl::vector<3,float>,3 > native_position)
 {
-    std::vector<std::vector<float> > keep_tract_data(tract_data);
+    tract_arena keep_tract_data(tract_data);
     tipl::par_for(tract_data.size(),[&](int i)
     {
         for(int j = 0;j < tract_data[i].size();j += 3)
@@ -500,6 +697,7 @@ bool TractModel::save_tracts_in_native_space(const char* file_name,tipl::image<t
     });
     bool result = save_tracts_to_file(file_name);
     keep_tract_data.swap(tract_data);
+    clear_start_point_bucket();
     return result;
 }
 //---------------------------------------------------------------------------
@@ -516,6 +714,8 @@ bool TractModel::save_tracts_to_file(const char* file_name_)
         std::vector<std::vector<float> > empty_scalar;
         return TrackVis::save_to_file(file_name.c_str(),geometry,vs,tract_data,empty_scalar);
     }
+    if(ext == std::string(".tkc"))
+        return save_chunk_file(file_name_,0);
     if(ext == std::string(".tck"))
     {
         char header[100] = {0};
@@ -529,21 +729,22 @@ bool TractModel::save_tracts_to_file(const char* file_name_)
         }
         std::ofstream out(file_name.c_str(),std::ios::binary);
         out.write(header,sizeof(header));
-        unsigned int NaN = 0x7FC00000;
-        for(size_t i = 0;i < tract_data.size();++i)
-        {
-            std::vector<float> buf(tract_data[i]);
-            tipl::multiply_constant(buf,handle->vs[0]);
-            out.write((char*)&buf[0],buf.size()*sizeof(float));
-            out.write((char*)&NaN,sizeof(NaN));
-            out.write((char*)&NaN,sizeof(NaN));
-            out.write((char*)&NaN,sizeof(NaN));
-        }
+        const unsigned int NaN[3] = {0x7FC00000,0x7FC00000,0x7FC00000};
+        float tck_vs = handle->vs[0];
+        write_tracts(out,tract_data.size(),
+            [&](size_t i){return tract_data[i].size()+3;},
+            [&](size_t i,float* to)
+            {
+                for(size_t j = 0;j < tract_data[i].size();++j)
+                    to[j] = tract_data[i][j]*tck_vs;
+                std::memcpy(to+tract_data[i].size(),NaN,sizeof(NaN));
+            });
         unsigned int INF = 0x7FB00000;
         out.write((char*)&INF,sizeof(INF));
         out.write((char*)&INF,sizeof(INF));
         out.write((char*)&INF,sizeof(INF));
-        return true;
+        out.close();
+        return out.good();
     }
 
     if (ext == std::string(".txt"))
@@ -567,12 +768,14 @@ bool TractModel::save_tracts_to_file(const char* file_name_)
         if(!out)
             return false;
         std::vector<float> buf;
-        std::vector<unsigned int> length;
-        for(unsigned int index = 0;index < tract_data.size();++index)
-        {
-            length.push_back((unsigned int)tract_data[index].size()/3);
-            std::copy(tract_data[index].begin(),tract_data[index].end(),std::back_inserter(buf));
-        }
+        std::vector<unsigned int> length(tract_data.size());
+        pack_tracts(0,tract_data.size(),buf,
+            [&](size_t i){return tract_data[i].size();},
+            [&](size_t i,float* to)
+            {
+                length[i] = tract_data[i].size()/3;
+                std::copy(tract_data[i].begin(),tract_data[i].end(),to);
+            });
         out.write("tracts",&*buf.begin(),3,(unsigned int)buf.size()/3);
         out.write("length",&*length.begin(),1,(unsigned int)length.size());
         return true;
@@ -588,6 +791,189 @@ bool TractModel::save_tracts_to_file(const char* file_name_)
     }
     return false;
 }
+//---------------------------------------------------------------------------
+class trackvis_sink : public tract_sink{
+    gz_ostream out;
+    tipl::vector<3> vs;
+    size_t count = 0;
+public:
+    bool open(const char* file_name,tipl::geometry<3> geo,tipl::vector<3> vs_)
+    {
+        vs = vs_;
+        if (!out.open(file_name))
+            return false;
+        TrackVis trk;
+        trk.init(geo,vs);// n_count = 0: the number of tracts is not stored
+        out.write((const char*)&trk,1000);
+        return true;
+    }
+    virtual void add(std::vector<std::vector<float> >& tracts)
+    {
+        std::vector<float> buffer;
+        for (unsigned int i = 0;i < tracts.size();++i)
+        {
+            int n_point = tracts[i].size()/3;
+            buffer.resize(tracts[i].size());
+            for (unsigned int j = 0;j < buffer.size();j += 3)
+            {
+                buffer[j] = tracts[i][j]*vs[0];
+                buffer[j+1] = tracts[i][j+1]*vs[1];
+                buffer[j+2] = tracts[i][j+2]*vs[2];
+            }
+            out.write((const char*)&n_point,sizeof(int));
+            out.write((const char*)&*buffer.begin(),sizeof(float)*buffer.size());
+        }
+        count += tracts.size();
+        tracts.clear();
+    }
+    virtual bool close(void)
+    {
+        return out.close();
+    }
+    virtual size_t get_count(void) const{return count;}
+};
+class tck_sink : public tract_sink{
+    std::ofstream out;
+    float vs = 1.0f;
+    size_t count = 0;
+    bool write_header(void)
+    {
+        // count is zero-padded so that the header can be rewritten in place
+        char header[100] = {0};
+        std::ostringstream str;
+        str << "mrtrix tracks\ndatatype: Float32LE\nfile: . 100\ncount: "
+            << std::setw(12) << std::setfill('0') << count << "\nEND\n";
+        std::string t = str.str();
+        if(t.length() > 100)
+            return false;
+        std::copy(t.begin(),t.end(),header);
+        out.seekp(0);
+        out.write(header,sizeof(header));
+        return true;
+    }
+public:
+    bool open(const char* file_name,float vs_)
+    {
+        vs = vs_;
+        out.open(file_name,std::ios::binary);
+        return out && write_header();
+    }
+    virtual void add(std::vector<std::vector<float> >& tracts)
+    {
+        unsigned int NaN[3] = {0x7FC00000,0x7FC00000,0x7FC00000};
+        for(size_t i = 0;i < tracts.size();++i)
+        {
+            tipl::multiply_constant(tracts[i],vs);
+            out.write((char*)&tracts[i][0],tracts[i].size()*sizeof(float));
+            out.write((char*)NaN,sizeof(NaN));
+        }
+        count += tracts.size();
+        tracts.clear();
+    }
+    virtual bool close(void)
+    {
+        unsigned int INF[3] = {0x7FB00000,0x7FB00000,0x7FB00000};
+        out.write((char*)INF,sizeof(INF));
+        bool result = write_header() && out;
+        out.close();
+        return result && out.good();
+    }
+    virtual size_t get_count(void) const{return count;}
+};
+class tdi_sink : public tract_sink{
+    tipl::vector<3> vs;
+    std::vector<float> trans;
+    tipl::image<unsigned int,3> tdi;
+    std::vector<unsigned int> point_list;
+    size_t count = 0;
+public:
+    tdi_sink(const std::string& file_name_,tipl::geometry<3> geo,tipl::vector<3> vs_,const std::vector<float>& trans_):
+        vs(vs_),trans(trans_),tdi(geo){file_name = file_name_;}
+    virtual void add(std::vector<std::vector<float> >& tracts)
+    {
+        for (unsigned int i = 0;i < tracts.size();++i)
+        {
+            point_list.clear();
+            for (unsigned int j = 0;j < tracts[i].size();j+=3)
+            {
+                int x = std::round(tracts[i][j]);
+                int y = std::round(tracts[i][j+1]);
+                int z = std::round(tracts[i][j+2]);
+                if (tdi.geometry().is_valid(x,y,z))
+                    point_list.push_back((z*tdi.height()+y)*tdi.width()+x);
+            }
+            std::sort(point_list.begin(),point_list.end());
+            point_list.erase(std::unique(point_list.begin(),point_list.end()),point_list.end());
+            for(unsigned int j = 0;j < point_list.size();++j)
+                ++tdi[point_list[j]];
+        }
+        count += tracts.size();
+        tracts.clear();
+    }
+    virtual bool close(void)
+    {
+        gz_nifti nii_header;
+        nii_header.set_voxel_size(vs);
+        if(!trans.empty())
+            nii_header.set_LPS_transformation(trans.begin(),tdi.geometry());
+        tipl::flip_xy(tdi);
+        nii_header << tdi;
+        return nii_header.save_to_file(file_name.c_str());
+    }
+    virtual size_t get_count(void) const{return count;}
+};
+class tract_chunk_sink : public tract_sink{
+    tract_chunk_writer out;
+public:
+    bool open(const char* file_name,tipl::geometry<3> geo,tipl::vector<3> vs)
+    {
+        return out.open(file_name,geo,vs);
+    }
+    virtual void add(std::vector<std::vector<float> >& tracts)
+    {
+        for(size_t i = 0;i < tracts.size();++i)
+            if(!tracts[i].empty())
+                out.add(&tracts[i][0],tracts[i].size()/3);
+        tracts.clear();
+    }
+    virtual bool close(void){return out.close();}
+    virtual size_t get_count(void) const{return out.size();}
+};
+std::shared_ptr<tract_sink> create_tract_sink(const std::string& file_name,
+                                              tipl::geometry<3> geo,tipl::vector<3> vs,
+                                              const std::vector<float>& trans)
+{
+    std::string ext;
+    if(file_name.length() > 4)
+        ext = std::string(file_name.end()-4,file_name.end());
+    if (ext == std::string(".trk") || ext == std::string("k.gz"))
+    {
+        std::shared_ptr<trackvis_sink> sink(new trackvis_sink);
+        sink->file_name = ext == std::string(".trk") ? file_name + ".gz" : file_name;
+        if(sink->open(sink->file_name.c_str(),geo,vs))
+            return sink;
+        return std::shared_ptr<tract_sink>();
+    }
+    if (ext == std::string(".tkc"))
+    {
+        std::shared_ptr<tract_chunk_sink> sink(new tract_chunk_sink);
+        sink->file_name = file_name;
+        if(sink->open(file_name.c_str(),geo,vs))
+            return sink;
+        return std::shared_ptr<tract_sink>();
+    }
+    if (ext == std::string(".tck"))
+    {
+        std::shared_ptr<tck_sink> sink(new tck_sink);
+        sink->file_name = file_name;
+        if(sink->open(file_name.c_str(),vs[0]))
+            return sink;
+        return std::shared_ptr<tract_sink>();
+    }
+    if (ext == std::string(".nii") || ext == std::string("i.gz"))
+        return std::make_shared<tdi_sink>(file_name,geo,vs,trans);
+    return std::shared_ptr<tract_sink>();
+}
 void TractModel::save_vrml(const char* file_name,
                            unsigned char tract_style,
                            unsigned char tract_color_style,
@@ -827,6 +1213,20 @@ bool TractModel::save_all(const char* file_name_,const std::vector<std::shared_p
         return true;
     }
 
+    if (ext == std::string(".tkc"))
+    {
+        tract_chunk_writer out;
+        // each tract model is stored as a cluster
+        if (!out.open(file_name_,all[0]->geometry,all[0]->vs,false,true))
+            return false;
+        begin_prog("saving");
+        for(unsigned int index = 0;check_prog(index,all.size());++index)
+        for (unsigned int i = 0;i < all[index]->tract_data.size();++i)
+            if(!all[index]->tract_data[i].empty())
+                out.add(&all[index]->tract_data[i][0],all[index]->tract_data[i].size()/3,
+                        index,all[index]->tract_color[i],all[index]->tract_tag[i]);
+        return out.close();
+    }
     if (ext == std::string(".trk") || ext == std::string("k.gz"))
     {
         gz_ostream out;
@@ -863,7 +1263,7 @@ bool TractModel::save_all(const char* file_name_,const std::vector<std::shared_p
             out.write((const char*)&n_point,sizeof(int));
             out.write((const char*)&*buffer.begin(),sizeof(float)*buffer.size());
         }
-        return true;
+        return out.close();
     }
 
     if (ext == std::string(".mat"))
@@ -891,7 +1291,7 @@ bool TractModel::save_all(const char* file_name_,const std::vector<std::shared_p
 //---------------------------------------------------------------------------
 bool TractModel::save_transformed_tracts_to_file(const char* file_name,const float* transform,bool end_point)
 {
-    std::vector<std::vector<float> > new_tract_data(tract_data);
+    tract_arena new_tract_data(tract_data);
     for(unsigned int i = 0;i < tract_data.size();++i)
         for(unsigned int j = 0;j < tract_data[i].size();j += 3)
         tipl::vector_transformation(&(new_tract_data[i][j]),
@@ -902,6 +1302,7 @@ bool TractModel::save_transformed_tracts_to_file(const char* file_name,const flo
     else
         result = save_tracts_to_file(file_name);
     new_tract_data.swap(tract_data);
+    clear_start_point_bucket();
     return result;
 }
 //---------------------------------------------------------------------------
@@ -1072,35 +1473,60 @@ void TractModel::select(float select_angle,
 //---------------------------------------------------------------------------
 void TractModel::release_tracts(std::vector<std::vector<float> >& released_tracks)
 {
-    released_tracks.clear();
-    released_tracks.swap(tract_data);
-    tract_color.clear();
-    tract_tag.clear();
+    tract_data.get_tracts(released_tracks);
+    for(size_t index = 0;index < tract_data.size();++index)
+        tract_data.release(tract_data.remove(index));
+    erase_empty();
     redo_size.clear();
 }
 //---------------------------------------------------------------------------
+void TractModel::get_deleted_tracts(std::vector<std::vector<float> >& tracts) const
+{
+    tracts.resize(deleted_tract_slot.size());
+    for(size_t index = 0;index < tracts.size();++index)
+    {
+        auto tract = tract_data.get_slot(deleted_tract_slot[index]);
+        tracts[index].assign(tract.begin(),tract.end());
+    }
+}
+//---------------------------------------------------------------------------
 void TractModel::erase_empty(void)
 {
-    tract_color.erase(std::remove_if(tract_color.begin(),tract_color.end(),
-                        [&](const unsigned int& data){return tract_data[&data-&tract_color[0]].empty();}), tract_color.end());
-    tract_tag.erase(std::remove_if(tract_tag.begin(),tract_tag.end(),
-                        [&](const unsigned int& data){return tract_data[&data-&tract_tag[0]].empty();}), tract_tag.end());
-    tract_data.erase(std::remove_if(tract_data.begin(),tract_data.end(),
-                        [&](const std::vector<float>& data){return data.empty();}), tract_data.end() );
+    // removed and zero-length tracts leave the visible list in one compaction pass,
+    // which moves 4-byte slot ids together with the color and tag arrays
+    for(size_t index = 0;index < tract_data.size();++index)
+        if(!tract_data.is_removed(index) && tract_data[index].empty())
+            tract_data.release(tract_data.remove(index));
+    tract_data.erase_removed([&](size_t from,size_t to)
+    {
+        tract_color[to] = tract_color[from];
+        tract_tag[to] = tract_tag[from];
+    });
+    tract_color.resize(tract_data.size());
+    tract_tag.resize(tract_data.size());
+    if(tract_data.need_compact())
+        tract_data.compact(deleted_tract_slot);
+    clear_start_point_bucket();
 }
 //---------------------------------------------------------------------------
 void TractModel::delete_tracts(const std::vector<unsigned int>& tracts_to_delete)
 {
     if (tracts_to_delete.empty())
         return;
+    // only the slot ids move to the undo list, the coordinates stay in the arena
+    unsigned int count = 0;
     for (unsigned int index = 0;index < tracts_to_delete.size();++index)
     {
-        deleted_tract_data.push_back(std::move(tract_data[tracts_to_delete[index]]));
-        deleted_tract_color.push_back(tract_color[tracts_to_delete[index]]);
-        deleted_tract_tag.push_back(tract_tag[tracts_to_delete[index]]);
+        unsigned int i = tracts_to_delete[index];
+        if(tract_data.is_removed(i))
+            continue;
+        deleted_tract_slot.push_back(tract_data.remove(i));
+        deleted_tract_color.push_back(tract_color[i]);
+        deleted_tract_tag.push_back(tract_tag[i]);
+        ++count;
     }
     erase_empty();
-    deleted_count.push_back(tracts_to_delete.size());
+    deleted_count.push_back(count);
     is_cut.push_back(0);
     // no redo once track deleted
     redo_size.clear();
@@ -1121,12 +1547,53 @@ void TractModel::select_tracts(const std::vector<unsigned int>& tracts_to_select
     delete_tracts(not_selected);
 }
 //---------------------------------------------------------------------------
+// hash key of a grid cell, each coordinate takes 21 bits
+inline uint64_t tract_bucket_key(int x,int y,int z)
+{
+    return (uint64_t(x+(1 << 20)) << 42) | (uint64_t(y+(1 << 20)) << 21) | uint64_t(z+(1 << 20));
+}
+void TractModel::get_start_point_candidates(const float* trk,float width,std::vector<unsigned int>& candidates)
+{
+    std::lock_guard<std::mutex> lock(*start_point_bucket_mutex);
+    // width is fixed by the voxel size, so the buckets only need to be rebuilt after tract_data changes
+    if(!start_point_bucket_built)
+    {
+        for(unsigned int i = 0;i < tract_data.size();++i)
+            if(!tract_data[i].empty())
+                start_point_bucket[tract_bucket_key(int(std::floor(tract_data[i][0]/width)),
+                                       int(std::floor(tract_data[i][1]/width)),
+                                       int(std::floor(tract_data[i][2]/width)))].push_back(i);
+        start_point_bucket_built = true;
+    }
+    // a starting point within the L1 distance of width must be in one of the 27 neighboring buckets
+    int x = int(std::floor(trk[0]/width)),y = int(std::floor(trk[1]/width)),z = int(std::floor(trk[2]/width));
+    candidates.clear();
+    for(int dz = -1;dz <= 1;++dz)
+        for(int dy = -1;dy <= 1;++dy)
+            for(int dx = -1;dx <= 1;++dx)
+            {
+                auto iter = start_point_bucket.find(tract_bucket_key(x+dx,y+dy,z+dz));
+                if(iter != start_point_bucket.end())
+                    candidates.insert(candidates.end(),iter->second.begin(),iter->second.end());
+            }
+    // keep the original visiting order so that ties are resolved the same way
+    std::sort(candidates.begin(),candidates.end());
+}
+//---------------------------------------------------------------------------
 unsigned int TractModel::find_nearest(const float* trk,unsigned int length,bool contain)
 {
     auto norm1 = [](const float* v1,const float* v2){return std::fabs(v1[0]-v2[0])+std::fabs(v1[1]-v2[1])+std::fabs(v1[2]-v2[2]);};
     float best_distance = contain ? 100.0f : 30.0f/handle->vs[0];
     unsigned int best_index = tract_data.size()-1;
-    for(int i = 0;i < tract_data.size();++i)
+    std::vector<unsigned int> candidates;
+    if(contain)
+    {
+        candidates.resize(tract_data.size());
+        std::iota(candidates.begin(),candidates.end(),0);
+    }
+    else
+        get_start_point_candidates(trk,best_distance,candidates);
+    for(unsigned int i : candidates)
     {
         bool skip = false;
         float max_dis = 0.0f;
@@ -1177,52 +1644,104 @@ unsigned int TractModel::find_nearest(const float* trk,unsigned int length,bool
 void TractModel::delete_repeated(double d)
 {
     auto norm1 = [](const float* v1,const float* v2){return std::fabs(v1[0]-v2[0])+std::fabs(v1[1]-v2[1])+std::fabs(v1[2]-v2[2]);};
-    std::vector<bool> repeated(tract_data.size());
-    tipl::par_for(tract_data.size(),[&](int i)
+    auto is_repeated = [&](unsigned int i,unsigned int j)
     {
-        if(!repeated[i])
+        // check endpoints
+        if(norm1(&tract_data[i][0],&tract_data[j][0]) > d ||
+           norm1(&tract_data[i][tract_data[i].size()-3],&tract_data[j][tract_data[j].size()-3]) > d)
+            return false;
+        for(int m = 0;m < tract_data[i].size();m += 3)
         {
-        for(int j = i+1;j < tract_data.size();++j)
-            if(!repeated[j])
-            {
-                // check endpoints
-                if(norm1(&tract_data[i][0],&tract_data[j][0]) > d ||
-                   norm1(&tract_data[i][tract_data[i].size()-3],&tract_data[j][tract_data[j].size()-3]) > d)
-                    continue;
-
-                bool not_repeated = false;
-                for(int m = 0;m < tract_data[i].size();m += 3)
+            float min_dis = norm1(&tract_data[i][m],&tract_data[j][0]);
+            for(int n = 3;n < tract_data[j].size();n += 3)
+                min_dis = std::min<float>(min_dis,norm1(&tract_data[i][m],&tract_data[j][n]));
+            if(min_dis > d)
+                return false;
+        }
+        for(int m = 0;m < tract_data[j].size();m += 3)
+        {
+            float min_dis = norm1(&tract_data[j][m],&tract_data[i][0]);
+            for(int n = 0;n < tract_data[i].size();n += 3)
+                min_dis = std::min<float>(min_dis,norm1(&tract_data[j][m],&tract_data[i][n]));
+            if(min_dis > d)
+                return false;
+        }
+        return true;
+    };
+    // bucket the starting points so that only tracts starting within d are compared
+    float width = std::max<float>(float(d),0.1f);
+    auto cell = [&](const float* p,int* c)
+    {
+        c[0] = int(std::floor(p[0]/width));
+        c[1] = int(std::floor(p[1]/width));
+        c[2] = int(std::floor(p[2]/width));
+    };
+    std::unordered_map<uint64_t,std::vector<unsigned int> > bucket;
+    for(unsigned int i = 0;i < tract_data.size();++i)
+    {
+        int c[3];
+        cell(&tract_data[i][0],c);
+        bucket[tract_bucket_key(c[0],c[1],c[2])].push_back(i);
+    }
+    // tracts before j that start within d, in ascending order
+    auto get_candidates = [&](unsigned int j,std::vector<unsigned int>& candidates)
+    {
+        int c[3];
+        cell(&tract_data[j][0],c);
+        candidates.clear();
+        for(int dz = -1;dz <= 1;++dz)
+            for(int dy = -1;dy <= 1;++dy)
+                for(int dx = -1;dx <= 1;++dx)
                 {
-                    float min_dis = norm1(&tract_data[i][m],&tract_data[j][0]);
-                    for(int n = 3;n < tract_data[j].size();n += 3)
-                        min_dis = std::min<float>(min_dis,norm1(&tract_data[i][m],&tract_data[j][n]));
-                    if(min_dis > d)
-                    {
-                        not_repeated = true;
-                        break;
-                    }
+                    auto iter = bucket.find(tract_bucket_key(c[0]+dx,c[1]+dy,c[2]+dz));
+                    if(iter != bucket.end())
+                        for(unsigned int i : iter->second)
+                        {
+                            if(i >= j)
+                                break;
+                            candidates.push_back(i);
+                        }
                 }
-                if(!not_repeated)
-                for(int m = 0;m < tract_data[j].size();m += 3)
+        std::sort(candidates.begin(),candidates.end());
+    };
+
+    // a tract is deleted if it repeats an earlier tract that is kept.
+    // the first repeated tract is searched in parallel, and the rare case
+    // where that tract is itself deleted is resolved in index order
+    const unsigned int no_repeat = std::numeric_limits<unsigned int>::max();
+    std::vector<unsigned int> first_repeat(tract_data.size(),no_repeat);
+    tipl::par_for(tract_data.size(),[&](int j)
+    {
+        std::vector<unsigned int> candidates;
+        get_candidates(j,candidates);
+        for(unsigned int i : candidates)
+            if(is_repeated(i,j))
+            {
+                first_repeat[j] = i;
+                return;
+            }
+    });
+    std::vector<char> repeated(tract_data.size());
+    std::vector<unsigned int> track_to_delete,candidates;
+    for(unsigned int j = 0;j < tract_data.size();++j)
+    {
+        if(first_repeat[j] == no_repeat)
+            continue;
+        if(!repeated[first_repeat[j]])
+            repeated[j] = 1;
+        else
+        {
+            get_candidates(j,candidates);
+            for(unsigned int i : candidates)
+                if(i > first_repeat[j] && !repeated[i] && is_repeated(i,j))
                 {
-                    float min_dis = norm1(&tract_data[j][m],&tract_data[i][0]);
-                    for(int n = 0;n < tract_data[i].size();n += 3)
-                        min_dis = std::min<float>(min_dis,norm1(&tract_data[j][m],&tract_data[i][n]));
-                    if(min_dis > d)
-                    {
-                        not_repeated = true;
-                        break;
-                    }
+                    repeated[j] = 1;
+                    break;
                 }
-                if(!not_repeated)
-                    repeated[j] = true;
-            }
         }
-    });
-    std::vector<unsigned int> track_to_delete;
-    for(unsigned int i = 0;i < tract_data.size();++i)
-        if(repeated[i])
-            track_to_delete.push_back(i);
+        if(repeated[j])
+            track_to_delete.push_back(j);
+    }
     delete_tracts(track_to_delete);
 }
 //---------------------------------------------------------------------------
@@ -1269,12 +1788,13 @@ void TractModel::cut(float select_angle,const std::vector<tipl::vector<3,float>
     is_cut.back() = cur_cut_id;
     for (unsigned int index = 0;index < new_tract.size();++index)
     {
-        tract_data.push_back(std::move(new_tract[index]));
+        tract_data.push_back(new_tract[index]);
         tract_color.push_back(new_tract_color[index]);
         tract_tag.push_back(cur_cut_id);
     }
     ++cur_cut_id;
     redo_size.clear();
+    clear_start_point_bucket();
 
 }
 void TractModel::cut_by_slice(unsigned int dim, unsigned int pos,bool greater)
@@ -1310,12 +1830,13 @@ void TractModel::cut_by_slice(unsigned int dim, unsigned int pos,bool greater)
     for (unsigned int index = 0;index < new_tract.size();++index)
     if(new_tract[index].size() >= 6)
         {
-            tract_data.push_back(std::move(new_tract[index]));
+            tract_data.push_back(new_tract[index]);
             tract_color.push_back(new_tract_color[index]);
             tract_tag.push_back(cur_cut_id);
         }
     ++cur_cut_id;
     redo_size.clear();
+    clear_start_point_bucket();
 }
 //---------------------------------------------------------------------------
 void TractModel::filter_by_roi(std::shared_ptr<RoiMgr> roi_mgr)
@@ -1564,11 +2085,15 @@ bool TractModel::trim(void)
 //---------------------------------------------------------------------------
 void TractModel::clear_deleted(void)
 {
+    for(size_t index = 0;index < deleted_tract_slot.size();++index)
+        tract_data.release(deleted_tract_slot[index]);
     deleted_count.clear();
-    deleted_tract_data.clear();
+    deleted_tract_slot.clear();
     deleted_tract_color.clear();
     deleted_tract_tag.clear();
     redo_size.clear();
+    if(tract_data.need_compact())
+        tract_data.compact(deleted_tract_slot);
 }
 
 void TractModel::undo(void)
@@ -1576,21 +2101,23 @@ void TractModel::undo(void)
     if (deleted_count.empty())
         return;
     redo_size.push_back(std::make_pair((unsigned int)tract_data.size(),deleted_count.back()));
+    // the deleted slots are shown again without copying coordinates
     for (unsigned int index = 0;index < deleted_count.back();++index)
     {
-        tract_data.push_back(std::move(deleted_tract_data.back()));
+        tract_data.restore(deleted_tract_slot.back());
         tract_color.push_back(deleted_tract_color.back());
         tract_tag.push_back(deleted_tract_tag.back());
-        deleted_tract_data.pop_back();
+        deleted_tract_slot.pop_back();
         deleted_tract_color.pop_back();
         deleted_tract_tag.pop_back();
     }
+    clear_start_point_bucket();
     // handle the cut situation
     if(is_cut.back())
     {
         for(int i = 0;i < tract_tag.size();++i)
             if(tract_tag[i] == is_cut.back())
-                tract_data[i].clear();
+                tract_data.release(tract_data.remove(i));
         erase_empty();
     }
     is_cut.pop_back();
@@ -1621,40 +2148,102 @@ void TractModel::add_tracts(std::vector<std::vector<float> >& new_tracks)
 //---------------------------------------------------------------------------
 void TractModel::add_tracts(std::vector<std::vector<float> >& new_tract,tipl::rgb color)
 {
-    tract_data.reserve(tract_data.size()+new_tract.size());
+    size_t coordinate_count = 0;
+    for (unsigned int index = 0;index < new_tract.size();++index)
+        coordinate_count += new_tract[index].size();
+    tract_data.reserve(new_tract.size(),coordinate_count);
 
     for (unsigned int index = 0;index < new_tract.size();++index)
     {
         if (new_tract[index].empty())
             continue;
-        tract_data.push_back(std::move(new_tract[index]));
+        tract_data.push_back(new_tract[index]);
+        std::vector<float>().swap(new_tract[index]);
         tract_color.push_back(color);
         tract_tag.push_back(0);
     }
+    clear_start_point_bucket();
 }
 
 void TractModel::add_tracts(std::vector<std::vector<float> >& new_tract, unsigned int length_threshold)
 {
-    tract_data.reserve(tract_data.size()+new_tract.size()/2.0);
+    tract_data.reserve(new_tract.size()/2,0);
     tipl::rgb def_color(200,100,30);
     for (unsigned int index = 0;index < new_tract.size();++index)
     {
         if (new_tract[index].size()/3-1 < length_threshold)
             continue;
-        tract_data.push_back(std::move(new_tract[index]));
+        tract_data.push_back(new_tract[index]);
+        std::vector<float>().swap(new_tract[index]);
         tract_color.push_back(def_color);
         tract_tag.push_back(0);
     }
+    clear_start_point_bucket();
 }
 //---------------------------------------------------------------------------
-void TractModel::get_density_map(tipl::image<unsigned int,3>& mapping,
-                                 const tipl::matrix<4,4,float>& transformation,bool endpoint)
-{
-    tipl::geometry<3> geometry = mapping.geometry();
-    begin_prog("calculating");
-    for (unsigned int i = 0;check_prog(i,tract_data.size());++i)
+struct density_dir{
+    unsigned int pos;
+    float dir[3];
+    bool operator<(const density_dir& rhs) const{return pos < rhs.pos;}
+};
+inline unsigned int density_pos(unsigned int pos){return pos;}
+inline unsigned int density_pos(const density_dir& d){return d.pos;}
+// each thread collects the voxels visited by its tracts in a buffer that is sorted and
+// added to the map when full. The buffers of all threads together hold about as many
+// entries as the image has voxels, so the memory does not grow with thread count x image size.
+// A full buffer is added slab by slab along z, and each slab has its own lock, so that
+// threads flushing at the same time only wait for one another within the same slab.
+class density_merger{
+    size_t slab_size;
+    std::vector<std::mutex> slab_mutex;
+public:
+    size_t buffer_size;
+    density_merger(const tipl::geometry<3>& geo,unsigned int thread_count)
     {
-        std::set<unsigned int> point_set;
+        size_t plane_size = size_t(geo[0])*size_t(geo[1]);
+        size_t slab_count = std::max<size_t>(1,std::min<size_t>(geo[2],thread_count*4));
+        slab_size = plane_size*((geo[2]+slab_count-1)/slab_count);
+        std::vector<std::mutex>(slab_count).swap(slab_mutex);
+        buffer_size = std::min<size_t>(1 << 22,std::max<size_t>(1 << 16,geo.size()/thread_count));
+    }
+    template<class value_type,class fun_type>
+    void add(std::vector<value_type>& buffer,unsigned int id,fun_type&& fun)
+    {
+        std::sort(buffer.begin(),buffer.end());
+        auto less_pos = [](const value_type& v,size_t pos){return density_pos(v) < pos;};
+        // threads start from different slabs
+        for(size_t k = 0;k < slab_mutex.size();++k)
+        {
+            size_t slab = (k+id) % slab_mutex.size();
+            auto from = std::lower_bound(buffer.begin(),buffer.end(),slab*slab_size,less_pos);
+            auto to = std::lower_bound(from,buffer.end(),(slab+1)*slab_size,less_pos);
+            if(from == to)
+                continue;
+            std::lock_guard<std::mutex> lock(slab_mutex[slab]);
+            for(;from != to;++from)
+                fun(*from);
+        }
+        buffer.clear();
+    }
+};
+void TractModel::get_density_map(tipl::image<unsigned int,3>& mapping,
+                                 const tipl::matrix<4,4,float>& transformation,bool endpoint)
+{
+    tipl::geometry<3> geometry = mapping.geometry();
+    unsigned int thread_count = std::max<unsigned int>(1,std::thread::hardware_concurrency());
+    std::vector<std::vector<unsigned int> > voxel_buffer(thread_count);
+    std::vector<std::vector<unsigned int> > point_list(thread_count);
+    density_merger merger(geometry,thread_count);
+    auto add_buffer = [&](std::vector<unsigned int>& buffer,unsigned int id)
+    {
+        merger.add(buffer,id,[&](unsigned int pos){++mapping[pos];});
+    };
+    begin_prog("calculating");
+    tipl::par_for2(tract_data.size(),[&](unsigned int i,unsigned int id)
+    {
+        if(!id)
+            check_prog(i,tract_data.size());
+        std::vector<unsigned int>& points = point_list[id];
         for (unsigned int j = 0;j < tract_data[i].size();j+=3)
         {
             if(j && endpoint)
@@ -1668,13 +2257,22 @@ void TractModel::get_density_map(tipl::image<unsigned int,3>& mapping,
             int z = std::round(tmp[2]);
             if (!geometry.is_valid(x,y,z))
                 continue;
-            point_set.insert((z*mapping.height()+y)*mapping.width()+x);
+            points.push_back((z*mapping.height()+y)*mapping.width()+x);
         }
-
-        std::vector<unsigned int> point_list(point_set.begin(),point_set.end());
-        for(unsigned int j = 0;j < point_list.size();++j)
-            ++mapping[point_list[j]];
-    }
+        // count each voxel once per tract
+        std::sort(points.begin(),points.end());
+        points.erase(std::unique(points.begin(),points.end()),points.end());
+        std::vector<unsigned int>& buffer = voxel_buffer[id];
+        buffer.insert(buffer.end(),points.begin(),points.end());
+        points.clear();
+        if(buffer.size() >= merger.buffer_size)
+            add_buffer(buffer,id);
+    },thread_count);
+    check_prog(tract_data.size(),tract_data.size());
+    tipl::par_for(thread_count,[&](unsigned int id)
+    {
+        add_buffer(voxel_buffer[id],id);
+    });
 }
 //---------------------------------------------------------------------------
 void TractModel::get_density_map(
@@ -1682,10 +2280,22 @@ void TractModel::get_density_map(
         const tipl::matrix<4,4,float>& transformation,bool endpoint)
 {
     tipl::geometry<3> geometry = mapping.geometry();
-    tipl::image<float,3> map_r(geometry),
-                            map_g(geometry),map_b(geometry);
-    for (unsigned int i = 0;i < tract_data.size();++i)
+    unsigned int thread_count = std::max<unsigned int>(1,std::thread::hardware_concurrency());
+    tipl::image<tipl::vector<3,float>,3> map_rgb(geometry);
+    std::vector<std::vector<density_dir> > dir_buffer(thread_count);
+    density_merger merger(geometry,thread_count);
+    auto add_buffer = [&](std::vector<density_dir>& buffer,unsigned int id)
     {
+        merger.add(buffer,id,[&](const density_dir& d)
+        {
+            map_rgb[d.pos][0] += d.dir[0];
+            map_rgb[d.pos][1] += d.dir[1];
+            map_rgb[d.pos][2] += d.dir[2];
+        });
+    };
+    tipl::par_for2(tract_data.size(),[&](unsigned int i,unsigned int id)
+    {
+        std::vector<density_dir>& buffer = dir_buffer[id];
         const float* buf = &*tract_data[i].begin();
         for (unsigned int j = 3;j < tract_data[i].size();j+=3)
         {
@@ -1703,22 +2313,30 @@ void TractModel::get_density_map(
             int z = std::round(tmp[2]);
             if (!geometry.is_valid(x,y,z))
                 continue;
-            unsigned int ptr = (z*mapping.height()+y)*mapping.width()+x;
-            map_r[ptr] += std::fabs(dir[0]);
-            map_g[ptr] += std::fabs(dir[1]);
-            map_b[ptr] += std::fabs(dir[2]);
+            density_dir d;
+            d.pos = (z*mapping.height()+y)*mapping.width()+x;
+            d.dir[0] = std::fabs(dir[0]);
+            d.dir[1] = std::fabs(dir[1]);
+            d.dir[2] = std::fabs(dir[2]);
+            buffer.push_back(d);
         }
-    }
+        if(buffer.size() >= merger.buffer_size)
+            add_buffer(buffer,id);
+    },thread_count);
+    tipl::par_for(thread_count,[&](unsigned int id)
+    {
+        add_buffer(dir_buffer[id],id);
+    });
     float max_value = 0.0f;
     for(unsigned int index = 0;index < mapping.size();++index)
-        max_value = std::max<float>(max_value,map_r[index]+map_g[index]+map_b[index]);
+        max_value = std::max<float>(max_value,map_rgb[index][0]+map_rgb[index][1]+map_rgb[index][2]);
 
     for(unsigned int index = 0;index < mapping.size();++index)
     {
-        float sum = map_r[index]+map_g[index]+map_b[index];
+        float sum = map_rgb[index][0]+map_rgb[index][1]+map_rgb[index][2];
         if(sum == 0.0f)
             continue;
-        tipl::vector<3> v(map_r[index],map_g[index],map_b[index]);
+        tipl::vector<3> v(map_rgb[index]);
         sum = v.normalize();
         v*=255.0*std::log(200.0f*sum/max_value+1)/2.303f;
         mapping[index] = tipl::rgb(
@@ -1728,36 +2346,29 @@ void TractModel::get_density_map(
     }
 }
 
-void TractModel::save_tdi(const char* file_name,bool sub_voxel,bool endpoint,const std::vector<float>& trans)
+void TractModel::save_tdi(const char* file_name,float ratio,bool endpoint,const std::vector<float>& trans)
 {
+    if(ratio <= 0.0f)
+        ratio = 1.0f;
     tipl::matrix<4,4,float> tr;
     tr.zero();
-    tr[0] = tr[5] = tr[10] = tr[15] = (sub_voxel ? 4.0:1.0);
+    tr[0] = tr[5] = tr[10] = ratio;
+    tr[15] = 1.0f;
     tipl::vector<3,float> new_vs(vs);
-    if(sub_voxel)
-        new_vs /= 4.0;
-    tipl::image<unsigned int,3> tdi;
-
-    if(sub_voxel)
-        tdi.resize(tipl::geometry<3>(geometry[0]*4,geometry[1]*4,geometry[2]*4));
-    else
-        tdi.resize(geometry);
-
+    new_vs /= ratio;
+    tipl::image<unsigned int,3> tdi(tipl::geometry<3>(int(std::ceil(geometry[0]*ratio)),
+                                                      int(std::ceil(geometry[1]*ratio)),
+                                                      int(std::ceil(geometry[2]*ratio))));
     get_density_map(tdi,tr,endpoint);
     gz_nifti nii_header;
     nii_header.set_voxel_size(new_vs);
     if(!trans.empty())
     {
-        if(sub_voxel)
-        {
-            std::vector<float> new_trans(trans);
-            new_trans[0] /= 4.0;
-            new_trans[4] /= 4.0;
-            new_trans[8] /= 4.0;
-            nii_header.set_LPS_transformation(new_trans.begin(),tdi.geometry());
-        }
-        else
-            nii_header.set_LPS_transformation(trans.begin(),tdi.geometry());
+        std::vector<float> new_trans(trans);
+        new_trans[0] /= ratio;
+        new_trans[4] /= ratio;
+        new_trans[8] /= ratio;
+        nii_header.set_LPS_transformation(new_trans.begin(),tdi.geometry());
     }
     tipl::flip_xy(tdi);
     nii_header << tdi;
@@ -2139,7 +2750,7 @@ void TractModel::get_tracts_data(unsigned int data_index,float& mean, float& sd)
     }
 }
 
-void TractModel::get_passing_list(const std::vector<std::vector<short> >& region_map,
+void TractModel::get_passing_list(const region_label_map& region_map,
                                   unsigned int region_count,
                                   std::vector<std::vector<short> >& passing_list1,
                                   std::vector<std::vector<short> >& passing_list2) const
@@ -2148,13 +2759,15 @@ void TractModel::get_passing_list(const std::vector<std::vector<short> >& region
     passing_list1.resize(tract_data.size());
     passing_list2.clear();
     passing_list2.resize(tract_data.size());
-    // create regions maps
-
-    for(unsigned int index = 0;index < tract_data.size();++index)
+    // per-thread region flags, cleared through the touched labels after each tract
+    unsigned int thread_count = std::max<unsigned int>(1,std::thread::hardware_concurrency());
+    std::vector<std::vector<unsigned char> > has_region(thread_count,std::vector<unsigned char>(region_count));
+    tipl::par_for2(tract_data.size(),[&](unsigned int index,unsigned int id)
     {
         if(tract_data[index].size() < 6)
-            continue;
-        std::vector<unsigned char> has_region(region_count);
+            return;
+        std::vector<unsigned char>& flag = has_region[id];
+        std::vector<short>& list = passing_list1[index];
         for(unsigned int ptr = 0;ptr < tract_data[index].size();ptr += 3)
         {
             tipl::pixel_index<3> pos(std::round(tract_data[index][ptr]),
@@ -2162,20 +2775,21 @@ void TractModel::get_passing_list(const std::vector<std::vector<short> >& region
                                         std::round(tract_data[index][ptr+2]),geometry);
             if(!geometry.is_valid(pos))
                 continue;
-            unsigned int pos_index = pos.index();
-            for(unsigned int j = 0;j < region_map[pos_index].size();++j)
-                has_region[region_map[pos_index][j]] = 1;
+            for(short r : region_map[pos.index()])
+                if(!flag[r])
+                {
+                    flag[r] = 1;
+                    list.push_back(r);
+                }
         }
-        for(unsigned int i = 0;i < has_region.size();++i)
-            if(has_region[i])
-            {
-                passing_list1[index].push_back(i);
-                passing_list2[index].push_back(i);
-            }
-    }
+        for(short r : list)
+            flag[r] = 0;
+        std::sort(list.begin(),list.end());
+        passing_list2[index] = list;
+    },thread_count);
 }
 
-void TractModel::get_end_list(const std::vector<std::vector<short> >& region_map,
+void TractModel::get_end_list(const region_label_map& region_map,
                               std::vector<std::vector<short> >& end_pair1,
                               std::vector<std::vector<short> >& end_pair2) const
 {
@@ -2183,10 +2797,10 @@ void TractModel::get_end_list(const std::vector<std::vector<short> >& region_map
     end_pair1.resize(tract_data.size());
     end_pair2.clear();
     end_pair2.resize(tract_data.size());
-    for(unsigned int index = 0;index < tract_data.size();++index)
+    tipl::par_for(tract_data.size(),[&](unsigned int index)
     {
         if(tract_data[index].size() < 6)
-            continue;
+            return;
         tipl::pixel_index<3> end1(std::round(tract_data[index][0]),
                                     std::round(tract_data[index][1]),
                                     std::round(tract_data[index][2]),geometry);
@@ -2194,23 +2808,27 @@ void TractModel::get_end_list(const std::vector<std::vector<short> >& region_map
                                     std::round(tract_data[index][tract_data[index].size()-2]),
                                     std::round(tract_data[index][tract_data[index].size()-1]),geometry);
         if(!geometry.is_valid(end1) || !geometry.is_valid(end2))
-            continue;
-        end_pair1[index] = region_map[end1.index()];
-        end_pair2[index] = region_map[end2.index()];
-    }
+            return;
+        auto r1 = region_map[end1.index()];
+        auto r2 = region_map[end2.index()];
+        end_pair1[index].assign(r1.begin(),r1.end());
+        end_pair2[index].assign(r2.begin(),r2.end());
+    });
 }
 
 
 void TractModel::run_clustering(unsigned char method_id,unsigned int cluster_count,float detail)
 {
     float param[4] = {0};
-    if(method_id)// k-means or EM
+    if(method_id == 1 || method_id == 2)// k-means or EM
         param[0] = cluster_count;
     else
     {
         std::copy(handle->dim.begin(),
                   handle->dim.end(),param);
         param[3] = detail;
+        if(method_id == 3)// QuickBundles takes the distance threshold in voxels
+            param[3] /= handle->vs[0];
     }
     std::unique_ptr<BasicCluster> c;
     switch (method_id)
@@ -2224,12 +2842,17 @@ void TractModel::run_clustering(unsigned char method_id,unsigned int cluster_cou
     case 2:
         c.reset(new FeatureBasedClutering<tipl::ml::expectation_maximization<double,unsigned char> >(param));
         break;
+    case 3:
+        c.reset(new QuickBundleCluster(param));
+        break;
+    default:
+        return;
     }
 
     c->add_tracts(tract_data);
     c->run_clustering();
     {
-        cluster_count = method_id ? c->get_cluster_count() : std::min<float>(c->get_cluster_count(),cluster_count);
+        cluster_count = (method_id == 1 || method_id == 2) ? c->get_cluster_count() : std::min<float>(c->get_cluster_count(),cluster_count);
         tract_cluster.resize(tract_data.size());
         std::fill(tract_cluster.begin(),tract_cluster.end(),cluster_count);
         for(int index = 0;index < cluster_count;++index)
@@ -2312,31 +2935,42 @@ void ConnectivityMatrix::set_regions(const tipl::geometry<3>& geo,
                                      const std::vector<std::vector<tipl::vector<3,short> > >& regions)
 {
     region_count = regions.size();
+    region_map.clear(geo.size(),region_count);
 
-    region_map.clear();
-    region_map.resize(geo.size());
-
-    std::vector<std::set<short> > regions_set(geo.size());
+    // the first region of each voxel, and the full region list of voxels shared by several regions
+    std::vector<short> first_region(geo.size(),-1);
+    std::map<unsigned int,std::vector<short> > shared;
     for(unsigned int roi = 0;roi < region_count;++roi)
     {
         for(unsigned int index = 0;index < regions[roi].size();++index)
         {
             tipl::vector<3,short> pos = regions[roi][index];
-            if(geo.is_valid(pos))
-                regions_set[tipl::pixel_index<3>(pos[0],pos[1],pos[2],geo).index()].insert(roi);
+            if(!geo.is_valid(pos))
+                continue;
+            unsigned int i = tipl::pixel_index<3>(pos[0],pos[1],pos[2],geo).index();
+            if(first_region[i] == -1)
+                first_region[i] = short(roi);
+            else
+            if(first_region[i] != short(roi))
+            {
+                std::vector<short>& list = shared[i];
+                if(list.empty())
+                    list.push_back(first_region[i]);
+                if(list.back() != short(roi))
+                    list.push_back(short(roi));
+            }
         }
     }
-    unsigned int overlap_count = 0,total_count = 0;
+    std::vector<short> single(1);
     for(unsigned int index = 0;index < geo.size();++index)
-        if(!regions_set[index].empty())
+        if(first_region[index] != -1)
         {
-            for(auto i : regions_set[index])
-                region_map[index].push_back(i);
-            ++total_count;
-            if(region_map[index].size() > 1)
-                ++overlap_count;
+            single[0] = first_region[index];
+            region_map.set(index,single);
         }
-    overlap_ratio = (float)overlap_count/(float)total_count;
+    for(auto& each : shared)
+        region_map.set(each.first,each.second);
+    overlap_ratio = (float)region_map.overlap_count()/(float)region_map.labeled_count();
     atlas_name = "roi";
 }
 
@@ -2352,25 +2986,39 @@ void ConnectivityMatrix::set_atlas(std::shared_ptr<atlas> data,const tipl::image
         region_name.push_back(data->get_list()[label_index]);
     data->is_labeled_as(mni_position.front(),0);// trigger load from file
 
-    region_map.clear();
-    region_map.resize(geo.size());
-    for(int i = 0;i < region_count;++i)
+    region_map.clear(geo.size(),region_count);
+    // -1: no region, -2: shared by several regions listed in the thread buffer
+    std::vector<short> first_region(geo.size(),-1);
+    std::vector<std::vector<std::pair<unsigned int,std::vector<short> > > > shared(std::thread::hardware_concurrency());
+    mni_position.for_each_mt2([&](const tipl::vector<3,float>& mni,const tipl::pixel_index<3>& index,int id)
     {
-        mni_position.for_each_mt([&](const tipl::vector<3,float>& mni,const tipl::pixel_index<3>& index)
+        if(mni == null)
+            return;
+        std::vector<short> regions;
+        for(unsigned int i = 0;i < region_count;++i)
+            if(data->is_labeled_as(mni,i))
+                regions.push_back(short(i));
+        if(regions.empty())
+            return;
+        if(regions.size() == 1)
+            first_region[index.index()] = regions[0];
+        else
         {
-            if(mni != null && data->is_labeled_as(mni,i))
-                region_map[index.index()].push_back(i);
-        });
-    }
-    unsigned int overlap_count = 0,total_count = 0;
+            first_region[index.index()] = -2;
+            shared[id].push_back(std::make_pair(index.index(),std::move(regions)));
+        }
+    });
+    std::vector<short> single(1);
     for(unsigned int index = 0;index < geo.size();++index)
-        if(!region_map[index].empty())
+        if(first_region[index] >= 0)
         {
-            ++total_count;
-            if(region_map[index].size() > 1)
-                ++overlap_count;
+            single[0] = first_region[index];
+            region_map.set(index,single);
         }
-    overlap_ratio = (float)overlap_count/(float)total_count;
+    for(auto& each_thread : shared)
+        for(auto& each : each_thread)
+            region_map.set(each.first,each.second);
+    overlap_ratio = (float)region_map.overlap_count()/(float)region_map.labeled_count();
     atlas_name = data->name;
 }
 
@@ -2409,14 +3057,13 @@ bool ConnectivityMatrix::calculate(TractModel& tract_model,std::string matrix_va
         error_msg = "No region information. Please assign regions";
         return false;
     }
-
-    std::vector<std::vector<short> > end_list1,end_list2;
-    if(use_end_only)
-        tract_model.get_end_list(region_map,end_list1,end_list2);
-    else
-        tract_model.get_passing_list(region_map,region_count,end_list1,end_list2);
     if(matrix_value_type == "trk")
     {
+        std::vector<std::vector<short> > end_list1,end_list2;
+        if(use_end_only)
+            tract_model.get_end_list(region_map,end_list1,end_list2);
+        else
+            tract_model.get_passing_list(region_map,region_count,end_list1,end_list2);
         std::vector<std::vector<std::vector<unsigned int> > > region_passing_list;
         init_matrix(region_passing_list,region_count);
 
@@ -2434,111 +3081,223 @@ bool ConnectivityMatrix::calculate(TractModel& tract_model,std::string matrix_va
                 TractModel tm(tract_model.get_handle());
                 std::vector<std::vector<float> > new_tracts;
                 for (unsigned int k = 0;k < region_passing_list[i][j].size();++k)
-                    new_tracts.push_back(tract_model.get_tract(region_passing_list[i][j][k]));
+                {
+                    auto tract = tract_model.get_tract(region_passing_list[i][j][k]);
+                    new_tracts.push_back(std::vector<float>(tract.begin(),tract.end()));
+                }
                 tm.add_tracts(new_tracts);
                 if(!tm.save_tracts_to_file(file_name.c_str()))
                     return false;
             }
         return true;
     }
-    matrix_value.clear();
-    matrix_value.resize(tipl::geometry<2>(region_count,region_count));
-    std::vector<std::vector<unsigned int> > count;
-    init_matrix(count,region_count);
-
-    for_each_connectivity(end_list1,end_list2,
-                          [&](unsigned int,short i,short j){
-        ++count[i][j];
-    });
-
-    // determine the threshold for counting the connectivity
-    unsigned int threshold_count = 0;
-    for(unsigned int i = 0,index = 0;i < count.size();++i)
-        for(unsigned int j = 0;j < count[i].size();++j,++index)
-            threshold_count = std::max<unsigned int>(threshold_count,count[i][j]);
-    threshold_count *= threshold;
+    std::vector<tipl::image<float,2> > values;
+    if(!calculate(tract_model,std::vector<std::string>(1,matrix_value_type),use_end_only,threshold,values))
+        return false;
+    matrix_value.swap(values[0]);
+    return true;
+}
 
-    if(matrix_value_type == "count")
+bool ConnectivityMatrix::calculate(TractModel& tract_model,
+                                   const std::vector<std::string>& matrix_value_types,
+                                   bool use_end_only,float threshold,
+                                   std::vector<tipl::image<float,2> >& matrix_values)
+{
+    if(region_count == 0)
     {
-        for(unsigned int i = 0,index = 0;i < count.size();++i)
-            for(unsigned int j = 0;j < count[i].size();++j,++index)
-                matrix_value[index] = (count[i][j] > threshold_count ? count[i][j] : 0);
-        return true;
+        error_msg = "No region information. Please assign regions";
+        return false;
     }
-    if(matrix_value_type == "ncount" || matrix_value_type == "ncount2")
+    // find out what has to be accumulated in the tract sweep
+    bool need_length = false,need_inv_length = false,need_length_list = false;
+    std::vector<unsigned int> index_list,index_slot(matrix_value_types.size());
+    for(unsigned int k = 0;k < matrix_value_types.size();++k)
     {
-        std::vector<std::vector<std::vector<unsigned int> > > length_matrix;
-        init_matrix(length_matrix,region_count);
-
-        for_each_connectivity(end_list1,end_list2,
-                              [&](unsigned int index,short i,short j){
-            length_matrix[i][j].push_back(tract_model.get_tract_length(index));
-        });
+        const std::string& type = matrix_value_types[k];
+        if(type == "count")
+            continue;
+        if(type == "ncount")
+        {
+            need_length_list = true;
+            continue;
+        }
+        if(type == "ncount2")
+        {
+            need_inv_length = true;
+            continue;
+        }
+        if(type == "mean_length")
+        {
+            need_length = true;
+            continue;
+        }
+        unsigned int index_num = tract_model.get_handle()->get_name_index(type);
+        if(type == "trk" || index_num == tract_model.get_handle()->view_item.size())
+        {
+            error_msg = "Cannot quantify matrix value using ";
+            error_msg += type;
+            return false;
+        }
+        index_slot[k] = std::find(index_list.begin(),index_list.end(),index_num)-index_list.begin();
+        if(index_slot[k] == index_list.size())
+            index_list.push_back(index_num);
+    }
 
-        for(unsigned int i = 0,index = 0;i < count.size();++i)
-            for(unsigned int j = 0;j < count[i].size();++j,++index)
-                if(!length_matrix[i][j].empty() && count[i][j] >= threshold_count)
-                {
-                    float length = 0.0;
-                    if(matrix_value_type == "ncount")
-                        length = 1.0f/tipl::median(length_matrix[i][j].begin(),length_matrix[i][j].end());
-                    else
+    const tract_arena& tracts = tract_model.get_tracts();
+    const tipl::geometry<3>& geo = tract_model.get_handle()->dim;
+    const unsigned int n = region_count;
+    unsigned int thread_count = std::max<unsigned int>(1,std::thread::hardware_concurrency());
+    // the sums of each thread are kept in a hash map keyed by r1*n+r2, so that only the
+    // region pairs connected by the thread's tracts take memory: O(threads x connected pairs)
+    // instead of dense n x n partial matrices for every value type. An entry takes about
+    // 100 bytes with its hash node, plus 8 bytes per quantified index, and ncount keeps
+    // 4 bytes per tract and pair for the median length. Only the output matrices are n x n.
+    struct connectivity_sum{
+        unsigned int count = 0,length = 0;
+        double inv_length = 0.0;
+        std::vector<double> index_sum;
+        std::vector<unsigned int> lengths;
+    };
+    typedef std::unordered_map<unsigned int,connectivity_sum> connectivity_sums;
+    std::vector<connectivity_sums> thread_sums(thread_count);
+    // per-thread region bitset and list of the regions passed by the current tract
+    std::vector<std::vector<bool> > thread_has_region(thread_count);
+    std::vector<std::vector<short> > thread_passing(thread_count);
+    tipl::par_for2(tracts.size(),[&](unsigned int index,unsigned int id)
+    {
+        auto tract = tracts[index];
+        if(tract.size() < 6)
+            return;
+        if(thread_has_region[id].empty())
+            thread_has_region[id].resize(n);
+        region_label_map::span r1,r2;
+        if(use_end_only)
+        {
+            tipl::pixel_index<3> end1(std::round(tract[0]),std::round(tract[1]),std::round(tract[2]),geo);
+            tipl::pixel_index<3> end2(std::round(tract[tract.size()-3]),
+                                      std::round(tract[tract.size()-2]),
+                                      std::round(tract[tract.size()-1]),geo);
+            if(!geo.is_valid(end1) || !geo.is_valid(end2))
+                return;
+            r1 = region_map[end1.index()];
+            r2 = region_map[end2.index()];
+        }
+        else
+        {
+            std::vector<bool>& has_region = thread_has_region[id];
+            std::vector<short>& passing = thread_passing[id];
+            passing.clear();
+            size_t last_index = geo.size();
+            for(unsigned int ptr = 0;ptr < tract.size();ptr += 3)
+            {
+                tipl::pixel_index<3> pos(std::round(tract[ptr]),std::round(tract[ptr+1]),std::round(tract[ptr+2]),geo);
+                // consecutive points often fall in the same voxel
+                if(!geo.is_valid(pos) || pos.index() == last_index)
+                    continue;
+                last_index = pos.index();
+                for(short r : region_map[last_index])
+                    if(!has_region[r])
                     {
-                        for(int k = 0;k < length_matrix[i][j].size();++k)
-                            length += 1.0/length_matrix[i][j][k];
+                        has_region[r] = true;
+                        passing.push_back(r);
                     }
-                    matrix_value[index] = count[i][j]*length;
+            }
+            for(short r : passing)
+                has_region[r] = false;
+            std::sort(passing.begin(),passing.end());
+            r1 = r2 = region_label_map::span{passing.data(),passing.data()+passing.size()};
+        }
+        if(r1.empty() || r2.empty())
+            return;
+        std::vector<float> m(index_list.size());
+        for(unsigned int k = 0;k < index_list.size();++k)
+        {
+            std::vector<float> data;
+            tract_model.get_tract_data(index,index_list[k],data);
+            m[k] = tipl::mean(data.begin(),data.end());
+        }
+        unsigned int length = tract.size();
+        connectivity_sums& sums = thread_sums[id];
+        auto add = [&](unsigned int pos)
+        {
+            connectivity_sum& sum = sums[pos];
+            ++sum.count;
+            if(need_length)
+                sum.length += length;
+            if(need_inv_length)
+                sum.inv_length += 1.0/length;
+            if(need_length_list)
+                sum.lengths.push_back(length);
+            sum.index_sum.resize(m.size());
+            for(unsigned int k = 0;k < m.size();++k)
+                sum.index_sum[k] += m[k];
+        };
+        for(unsigned int i = 0;i < r1.size();++i)
+            for(unsigned int j = 0;j < r2.size();++j)
+                if(r1[i] != r2[j])
+                {
+                    add(r1[i]*n+r2[j]);
+                    add(r2[j]*n+r1[i]);
                 }
-                else
-                    matrix_value[index] = 0;
-
-        return true;
-    }
-
+    },thread_count);
 
-    if(matrix_value_type == "mean_length")
+    // merge the thread sums into the first one, releasing each after it is merged
+    connectivity_sums& sums = thread_sums[0];
+    for(unsigned int id = 1;id < thread_count;++id)
     {
-        std::vector<std::vector<unsigned int> > sum_length,sum_n;
-        init_matrix(sum_length,region_count);
-        init_matrix(sum_n,region_count);
+        for(auto& iter : thread_sums[id])
+        {
+            connectivity_sum& sum = sums[iter.first];
+            sum.count += iter.second.count;
+            sum.length += iter.second.length;
+            sum.inv_length += iter.second.inv_length;
+            sum.lengths.insert(sum.lengths.end(),iter.second.lengths.begin(),iter.second.lengths.end());
+            sum.index_sum.resize(index_list.size());
+            for(unsigned int k = 0;k < iter.second.index_sum.size();++k)
+                sum.index_sum[k] += iter.second.index_sum[k];
+        }
+        connectivity_sums().swap(thread_sums[id]);
+    }
 
-        for_each_connectivity(end_list1,end_list2,
-                              [&](unsigned int index,short i,short j){
-            sum_length[i][j] += tract_model.get_tract_length(index);
-            ++sum_n[i][j];
-        });
+    // determine the threshold for counting the connectivity
+    unsigned int threshold_count = 0;
+    for(auto& iter : sums)
+        threshold_count = std::max<unsigned int>(threshold_count,iter.second.count);
+    threshold_count *= threshold;
 
-        for(unsigned int i = 0,index = 0;i < count.size();++i)
-            for(unsigned int j = 0;j < count[i].size();++j,++index)
-                if(sum_n[i][j] && count[i][j] > threshold_count)
-                    matrix_value[index] = (float)sum_length[i][j]/(float)sum_n[i][j]/3.0;
-        return true;
-    }
-    std::vector<std::vector<float> > data;
-    if(!tract_model.get_tracts_data(matrix_value_type,data))
+    matrix_values.clear();
+    matrix_values.resize(matrix_value_types.size());
+    for(unsigned int k = 0;k < matrix_value_types.size();++k)
+        matrix_values[k].resize(tipl::geometry<2>(n,n));
+    for(auto& iter : sums)
     {
-        error_msg = "Cannot quantify matrix value using ";
-        error_msg += matrix_value_type;
-        return false;
+        unsigned int index = iter.first;
+        connectivity_sum& sum = iter.second;
+        unsigned int count = sum.count;
+        for(unsigned int k = 0;k < matrix_value_types.size();++k)
+        {
+            const std::string& type = matrix_value_types[k];
+            tipl::image<float,2>& value = matrix_values[k];
+            if(type == "count")
+                value[index] = (count > threshold_count ? count : 0);
+            else
+            if(type == "ncount" || type == "ncount2")
+            {
+                if(count && count >= threshold_count)
+                    value[index] = count*(type == "ncount" ?
+                                   1.0f/float(tipl::median(sum.lengths.begin(),sum.lengths.end())) : float(sum.inv_length));
+            }
+            else
+            if(type == "mean_length")
+            {
+                if(count && count > threshold_count)
+                    value[index] = (float)sum.length/(float)count/3.0;
+            }
+            else
+                value[index] = (count > threshold_count ? float(sum.index_sum[index_slot[k]])/(float)count : 0);
+        }
     }
-    std::vector<std::vector<float> > sum;
-    init_matrix(sum,region_count);
-
-    std::vector<float> m(data.size());
-    for(unsigned int index = 0;index < data.size();++index)
-        m[index] = tipl::mean(data[index].begin(),data[index].end());
-
-    for_each_connectivity(end_list1,end_list2,
-                          [&](unsigned int index,short i,short j){
-        sum[i][j] += m[index];
-    });
-
-
-    for(unsigned int i = 0,index = 0;i < count.size();++i)
-        for(unsigned int j = 0;j < count[i].size();++j,++index)
-            matrix_value[index] = (count[i][j] > threshold_count ? sum[i][j]/(float)count[i][j] : 0);
     return true;
-
 }
 template<class matrix_type>
 void distance_bin(const matrix_type& bin,tipl::image<float,2>& D)
@@ -2626,6 +3385,353 @@ void inv_dis(const matrix_type& D,matrix_type& e)
         e[pos] = 0;
 }
 
+// compressed sparse row adjacency for the network measures of large parcellations.
+// the edges are the positive entries, and rows are the outgoing edges.
+class sparse_graph{
+private:
+    unsigned int n;
+    std::vector<unsigned int> offset,neighbor,in_offset,in_neighbor;
+    std::vector<float> weight,in_weight;
+    typedef std::pair<float,unsigned int> heap_item;
+    typedef std::priority_queue<heap_item,std::vector<heap_item>,std::greater<heap_item> > heap_type;
+    static float cube_root(float w){return std::pow(w,(float)(1.0/3.0));}
+    // Dijkstra from s on the nodes accepted by use(v) with the edge length of length(edge).
+    // dis has to be filled with max, order receives the settled nodes, and only those are reset by the caller
+    template<class use_type,class length_type>
+    void shortest_path(unsigned int s,use_type use,length_type length,
+                       std::vector<float>& dis,std::vector<unsigned int>& order) const
+    {
+        heap_type heap;
+        dis[s] = 0.0f;
+        heap.push(heap_item(0.0f,s));
+        order.clear();
+        while(!heap.empty())
+        {
+            heap_item top = heap.top();
+            heap.pop();
+            unsigned int v = top.second;
+            if(top.first > dis[v])
+                continue;
+            order.push_back(v);
+            for(unsigned int e = offset[v];e < offset[v+1];++e)
+            {
+                unsigned int w = neighbor[e];
+                if(!use(w))
+                    continue;
+                float d = dis[v]+length(e);
+                if(d < dis[w])
+                {
+                    dis[w] = d;
+                    heap.push(heap_item(d,w));
+                }
+            }
+        }
+    }
+public:
+    sparse_graph(const tipl::image<float,2>& w):n(w.width()),offset(1),in_offset(n+1)
+    {
+        for(unsigned int i = 0,index = 0;i < n;++i)
+        {
+            for(unsigned int j = 0;j < n;++j,++index)
+                if(w[index] > 0.0f)
+                {
+                    neighbor.push_back(j);
+                    weight.push_back(w[index]);
+                    ++in_offset[j+1];
+                }
+            offset.push_back(neighbor.size());
+        }
+        for(unsigned int i = 0;i < n;++i)
+            in_offset[i+1] += in_offset[i];
+        in_neighbor.resize(neighbor.size());
+        in_weight.resize(neighbor.size());
+        std::vector<unsigned int> pos(in_offset.begin(),in_offset.end()-1);
+        for(unsigned int i = 0;i < n;++i)
+            for(unsigned int e = offset[i];e < offset[i+1];++e)
+            {
+                in_neighbor[pos[neighbor[e]]] = i;
+                in_weight[pos[neighbor[e]]++] = weight[e];
+            }
+    }
+    // triangle counts of the binary graph, diag((W.^1/3)^3), trace(W^2), trace(W^3), and sum(W^2)
+    void triangles(std::vector<float>& tri_bin,std::vector<float>& cyc3,
+                   double& trace2,double& trace3,double& sum2) const
+    {
+        unsigned int words = (n+63)/64;
+        std::vector<uint64_t> bits(size_t(n)*words);
+        for(unsigned int i = 0;i < n;++i)
+            for(unsigned int e = offset[i];e < offset[i+1];++e)
+                bits[size_t(i)*words+(neighbor[e] >> 6)] |= uint64_t(1) << (neighbor[e] & 63);
+        std::vector<float> root(weight.size());
+        for(unsigned int e = 0;e < weight.size();++e)
+            root[e] = cube_root(weight[e]);
+        tri_bin.clear();
+        tri_bin.resize(n);
+        cyc3.clear();
+        cyc3.resize(n);
+        std::vector<double> t2(n),t3(n);
+        unsigned int thread_count = std::thread::hardware_concurrency();
+        std::vector<std::vector<float> > in_w(thread_count),in_r(thread_count);
+        tipl::par_for2(n,[&](unsigned int i,unsigned int id)
+        {
+            std::vector<float>& wi = in_w[id];
+            std::vector<float>& ri = in_r[id];
+            if(wi.empty())
+            {
+                wi.resize(n);
+                ri.resize(n);
+            }
+            // scatter the incoming edges of i
+            for(unsigned int e = in_offset[i];e < in_offset[i+1];++e)
+            {
+                wi[in_neighbor[e]] = in_weight[e];
+                ri[in_neighbor[e]] = cube_root(in_weight[e]);
+            }
+            const uint64_t* bi = &bits[size_t(i)*words];
+            unsigned int count = 0;
+            double c3 = 0.0,s2 = 0.0,s3 = 0.0;
+            for(unsigned int e = offset[i];e < offset[i+1];++e)
+            {
+                unsigned int j = neighbor[e];
+                const uint64_t* bj = &bits[size_t(j)*words];
+                for(unsigned int k = 0;k < words;++k)
+                    count += std::bitset<64>(bi[k] & bj[k]).count();
+                s2 += weight[e]*wi[j];
+                double sr = 0.0,sw = 0.0;
+                for(unsigned int f = offset[j];f < offset[j+1];++f)
+                {
+                    sr += root[f]*ri[neighbor[f]];
+                    sw += weight[f]*wi[neighbor[f]];
+                }
+                c3 += root[e]*sr;
+                s3 += weight[e]*sw;
+            }
+            for(unsigned int e = in_offset[i];e < in_offset[i+1];++e)
+                wi[in_neighbor[e]] = ri[in_neighbor[e]] = 0.0f;
+            tri_bin[i] = count;
+            cyc3[i] = c3;
+            t2[i] = s2;
+            t3[i] = s3;
+        },thread_count);
+        trace2 = std::accumulate(t2.begin(),t2.end(),0.0);
+        trace3 = std::accumulate(t3.begin(),t3.end(),0.0);
+        // sum(W^2) = sum_j (column sum of j)*(row sum of j)
+        sum2 = 0.0;
+        for(unsigned int j = 0;j < n;++j)
+            sum2 += double(std::accumulate(in_weight.begin()+in_offset[j],in_weight.begin()+in_offset[j+1],0.0))*
+                    double(std::accumulate(weight.begin()+offset[j],weight.begin()+offset[j+1],0.0));
+    }
+    // same as distance_bin or distance_wei: infinity for unreachable pairs. The binary diagonal
+    // holds the shortest closed walk as in distance_bin, while the weighted diagonal is infinity.
+    void distance(tipl::image<float,2>& D,bool binary) const
+    {
+        D.resize(tipl::geometry<2>(n,n));
+        unsigned int thread_count = std::thread::hardware_concurrency();
+        std::vector<std::vector<float> > thread_dis(thread_count);
+        std::vector<std::vector<unsigned int> > thread_order(thread_count);
+        tipl::par_for2(n,[&](unsigned int i,unsigned int id)
+        {
+            std::vector<float>& dis = thread_dis[id];
+            if(dis.empty())
+                dis.resize(n,std::numeric_limits<float>::max());
+            shortest_path(i,[](unsigned int){return true;},
+                          [&](unsigned int e){return binary ? 1.0f : 1.0f/weight[e];},dis,thread_order[id]);
+            float* row = &D[size_t(i)*n];
+            std::copy(dis.begin(),dis.end(),row);
+            row[i] = std::numeric_limits<float>::max();
+            if(binary)
+                for(unsigned int e = in_offset[i];e < in_offset[i+1];++e)
+                    row[i] = std::min<float>(row[i],in_neighbor[e] == i ? 1.0f : dis[in_neighbor[e]]+1.0f);
+            for(unsigned int v : thread_order[id])
+                dis[v] = std::numeric_limits<float>::max();
+        },thread_count);
+    }
+    // local efficiency computed on the subgraph of the neighbors of each node
+    void local_efficiency(std::vector<float>& bin,std::vector<float>& wei) const
+    {
+        bin.clear();
+        bin.resize(n);
+        wei.clear();
+        wei.resize(n);
+        unsigned int thread_count = std::thread::hardware_concurrency();
+        std::vector<std::vector<float> > thread_dis(thread_count),thread_sw(thread_count);
+        std::vector<std::vector<char> > thread_in_set(thread_count);
+        std::vector<std::vector<unsigned int> > thread_order(thread_count);
+        tipl::par_for2(n,[&](unsigned int i,unsigned int id)
+        {
+            unsigned int new_n = offset[i+1]-offset[i];
+            if(new_n < 2)
+                return;
+            std::vector<float>& dis = thread_dis[id];
+            std::vector<float>& sw = thread_sw[id];
+            std::vector<char>& in_set = thread_in_set[id];
+            std::vector<unsigned int>& order = thread_order[id];
+            if(dis.empty())
+            {
+                dis.resize(n,std::numeric_limits<float>::max());
+                sw.resize(n);
+                in_set.resize(n);
+            }
+            for(unsigned int e = offset[i];e < offset[i+1];++e)
+            {
+                in_set[neighbor[e]] = 1;
+                sw[neighbor[e]] = cube_root(weight[e]);
+            }
+            auto use = [&](unsigned int v){return in_set[v] != 0;};
+            double sum_bin = 0.0,sum_wei = 0.0;
+            for(unsigned int e = offset[i];e < offset[i+1];++e)
+            {
+                unsigned int s = neighbor[e];
+                shortest_path(s,use,[](unsigned int){return 1.0f;},dis,order);
+                for(unsigned int v : order)
+                {
+                    if(v != s)
+                        sum_bin += 1.0/dis[v];
+                    dis[v] = std::numeric_limits<float>::max();
+                }
+                shortest_path(s,use,[&](unsigned int f){return 1.0f/weight[f];},dis,order);
+                for(unsigned int v : order)
+                {
+                    if(v != s)
+                        sum_wei += cube_root(1.0f/dis[v])*sw[s]*sw[v];
+                    dis[v] = std::numeric_limits<float>::max();
+                }
+            }
+            for(unsigned int e = offset[i];e < offset[i+1];++e)
+                in_set[neighbor[e]] = 0;
+            bin[i] = sum_bin/(new_n*new_n-new_n);
+            wei[i] = sum_wei/(new_n*new_n-new_n);
+        },thread_count);
+    }
+    // Brandes betweenness, using unit length or the edge weight as the length
+    void betweenness(std::vector<float>& result,bool binary) const
+    {
+        unsigned int thread_count = std::thread::hardware_concurrency();
+        std::vector<std::vector<double> > thread_result(thread_count);
+        std::vector<std::vector<float> > thread_dis(thread_count),thread_np(thread_count),thread_dp(thread_count);
+        std::vector<std::vector<std::vector<unsigned int> > > thread_pred(thread_count);
+        std::vector<std::vector<unsigned int> > thread_order(thread_count);
+        tipl::par_for2(n,[&](unsigned int s,unsigned int id)
+        {
+            std::vector<float>& dis = thread_dis[id];
+            std::vector<float>& np = thread_np[id];
+            std::vector<float>& dp = thread_dp[id];
+            std::vector<std::vector<unsigned int> >& pred = thread_pred[id];
+            std::vector<unsigned int>& order = thread_order[id];
+            if(dis.empty())
+            {
+                thread_result[id].resize(n);
+                dis.resize(n,std::numeric_limits<float>::max());
+                np.resize(n);
+                dp.resize(n);
+                pred.resize(n);
+            }
+            heap_type heap;
+            dis[s] = 0.0f;
+            np[s] = 1.0f;
+            heap.push(heap_item(0.0f,s));
+            order.clear();
+            while(!heap.empty())
+            {
+                heap_item top = heap.top();
+                heap.pop();
+                unsigned int v = top.second;
+                if(top.first > dis[v])
+                    continue;
+                order.push_back(v);
+                for(unsigned int e = offset[v];e < offset[v+1];++e)
+                {
+                    unsigned int w = neighbor[e];
+                    float d = dis[v]+(binary ? 1.0f : weight[e]);
+                    if(d < dis[w])
+                    {
+                        dis[w] = d;
+                        np[w] = np[v];
+                        pred[w].clear();
+                        pred[w].push_back(v);
+                        heap.push(heap_item(d,w));
+                    }
+                    else
+                    if(d == dis[w])
+                    {
+                        np[w] += np[v];
+                        pred[w].push_back(v);
+                    }
+                }
+            }
+            for(size_t k = order.size()-1;k > 0;--k)
+            {
+                unsigned int w = order[k];
+                thread_result[id][w] += dp[w];
+                for(unsigned int v : pred[w])
+                    dp[v] += (1.0f+dp[w])*np[v]/np[w];
+            }
+            for(unsigned int v : order)
+            {
+                dis[v] = std::numeric_limits<float>::max();
+                np[v] = dp[v] = 0.0f;
+                pred[v].clear();
+            }
+        },thread_count);
+        result.clear();
+        result.resize(n);
+        for(unsigned int id = 0;id < thread_count;++id)
+            for(unsigned int i = 0;i < thread_result[id].size();++i)
+                result[i] += thread_result[id][i];
+    }
+    // leading eigenvector by power iteration on A+I, which shares the eigenvectors of A
+    void eigenvector_centrality(std::vector<float>& result,bool binary) const
+    {
+        std::vector<double> x(n,1.0/std::sqrt(double(n))),y(n);
+        for(unsigned int iter = 0;iter < 1000;++iter)
+        {
+            tipl::par_for(n,[&](unsigned int i)
+            {
+                double sum = x[i];
+                for(unsigned int e = offset[i];e < offset[i+1];++e)
+                    sum += (binary ? 1.0 : weight[e])*x[neighbor[e]];
+                y[i] = sum;
+            });
+            double length = std::sqrt(std::inner_product(y.begin(),y.end(),y.begin(),0.0));
+            if(length == 0.0)
+                break;
+            double change = 0.0;
+            for(unsigned int i = 0;i < n;++i)
+            {
+                y[i] /= length;
+                change = std::max<double>(change,std::fabs(y[i]-x[i]));
+            }
+            x.swap(y);
+            if(change < 1.0e-7)
+                break;
+        }
+        result.assign(x.begin(),x.end());
+    }
+    // solves (I-d*A*diag(1/deg))x = (1-d)/n by fixed-point iteration
+    void pagerank(std::vector<float>& result,const std::vector<float>& deg,bool binary) const
+    {
+        const double d = 0.85;
+        std::vector<double> x(n,(1.0-d)/n),y(n);
+        for(unsigned int iter = 0;iter < 1000;++iter)
+        {
+            tipl::par_for(n,[&](unsigned int i)
+            {
+                double sum = 0.0;
+                for(unsigned int e = offset[i];e < offset[i+1];++e)
+                    sum += (binary ? 1.0 : weight[e])*x[neighbor[e]]/deg[neighbor[e]];
+                y[i] = (1.0-d)/n + d*sum;
+            });
+            double change = 0.0;
+            for(unsigned int i = 0;i < n;++i)
+                change = std::max<double>(change,std::fabs(y[i]-x[i]));
+            x.swap(y);
+            if(change < 1.0e-9)
+                break;
+        }
+        result.assign(x.begin(),x.end());
+    }
+};
+
 template<class vec_type>
 void output_node_measures(std::ostream& out,const char* name,const vec_type& data)
 {
@@ -2635,7 +3741,7 @@ void output_node_measures(std::ostream& out,const char* name,const vec_type& dat
     out << std::endl;
 }
 
-void ConnectivityMatrix::network_property(std::string& report)
+void ConnectivityMatrix::network_property(std::string& report,bool sparse)
 {
     std::ostringstream out;
     size_t n = matrix_value.width();
@@ -2660,40 +3766,68 @@ void ConnectivityMatrix::network_property(std::string& report)
     std::vector<float> strength(n);
     for(unsigned int i = 0;i < n;++i)
         strength[i] = std::accumulate(norm_matrix.begin()+i*n,norm_matrix.begin()+(i+1)*n,0.0);
+    std::shared_ptr<sparse_graph> graph;
+    if(sparse)
+        graph = std::make_shared<sparse_graph>(norm_matrix);
+
     // calculate clustering coefficient
     std::vector<float> cluster_co(n);
-    for(unsigned int i = 0,posi = 0;i < n;++i,posi += n)
-    if(degree[i] >= 2)
+    // diag((W.^1/3)^3), trace(W^2), trace(W^3), and sum(W^2)
+    std::vector<float> cyc3(n);
+    double trace2 = 0.0,trace3 = 0.0,sum2 = 0.0;
+    if(sparse)
     {
-        for(unsigned int j = 0,index = 0;j < n;++j)
-            for(unsigned int k = 0;k < n;++k,++index)
-                if(binary_matrix[posi + j] && binary_matrix[posi + k])
-                    cluster_co[i] += binary_matrix[index];
-        float d = degree[i];
-        cluster_co[i] /= (d*d-d);
+        std::vector<float> triangle;
+        graph->triangles(triangle,cyc3,trace2,trace3,sum2);
+        for(unsigned int i = 0;i < n;++i)
+        if(degree[i] >= 2)
+        {
+            float d = degree[i];
+            cluster_co[i] = triangle[i]/(d*d-d);
+        }
     }
-    float cc_bin = tipl::mean(cluster_co.begin(),cluster_co.end());
-    out << "clustering_coeff_average(binary)\t" << cc_bin << std::endl;
-
-    // calculate weighted clustering coefficient
-    tipl::image<float,2> cyc3(norm_matrix.geometry());
-    std::vector<float> wcluster_co(n);
+    else
     {
+        for(unsigned int i = 0,posi = 0;i < n;++i,posi += n)
+        if(degree[i] >= 2)
+        {
+            for(unsigned int j = 0,index = 0;j < n;++j)
+                for(unsigned int k = 0;k < n;++k,++index)
+                    if(binary_matrix[posi + j] && binary_matrix[posi + k])
+                        cluster_co[i] += binary_matrix[index];
+            float d = degree[i];
+            cluster_co[i] /= (d*d-d);
+        }
         tipl::image<float,2> root(norm_matrix);
         // root = W.^ 1/3
         for(unsigned int j = 0;j < root.size();++j)
             root[j] = std::pow(root[j],(float)(1.0/3.0));
         // cyc3 = (W.^1/3)^3
-        tipl::image<float,2> t(root.geometry());
+        tipl::image<float,2> t(root.geometry()),root3(root.geometry());
         tipl::mat::product(root.begin(),root.begin(),t.begin(),tipl::dyndim(n,n),tipl::dyndim(n,n));
-        tipl::mat::product(t.begin(),root.begin(),cyc3.begin(),tipl::dyndim(n,n),tipl::dyndim(n,n));
-        // wcc = diag(cyc3)/(K.*(K-1));
+        tipl::mat::product(t.begin(),root.begin(),root3.begin(),tipl::dyndim(n,n),tipl::dyndim(n,n));
         for(unsigned int i = 0;i < n;++i)
-        if(degree[i] >= 2)
-        {
-            float d = degree[i];
-            wcluster_co[i] = cyc3[i*(n+1)]/(d*d-d);
-        }
+            cyc3[i] = root3[i*(n+1)];
+
+        tipl::image<float,2> norm_matrix2(norm_matrix.geometry());
+        tipl::image<float,2> norm_matrix3(norm_matrix.geometry());
+        tipl::mat::product(norm_matrix.begin(),norm_matrix.begin(),norm_matrix2.begin(),tipl::dyndim(n,n),tipl::dyndim(n,n));
+        tipl::mat::product(norm_matrix2.begin(),norm_matrix.begin(),norm_matrix3.begin(),tipl::dyndim(n,n),tipl::dyndim(n,n));
+        trace2 = tipl::mat::trace(norm_matrix2.begin(),tipl::dyndim(n,n));
+        trace3 = tipl::mat::trace(norm_matrix3.begin(),tipl::dyndim(n,n));
+        sum2 = std::accumulate(norm_matrix2.begin(),norm_matrix2.end(),0.0);
+    }
+    float cc_bin = tipl::mean(cluster_co.begin(),cluster_co.end());
+    out << "clustering_coeff_average(binary)\t" << cc_bin << std::endl;
+
+    // calculate weighted clustering coefficient
+    std::vector<float> wcluster_co(n);
+    // wcc = diag(cyc3)/(K.*(K-1));
+    for(unsigned int i = 0;i < n;++i)
+    if(degree[i] >= 2)
+    {
+        float d = degree[i];
+        wcluster_co[i] = cyc3[i]/(d*d-d);
     }
     float cc_wei = tipl::mean(wcluster_co.begin(),wcluster_co.end());
     out << "clustering_coeff_average(weighted)\t" << cc_wei << std::endl;
@@ -2701,24 +3835,27 @@ void ConnectivityMatrix::network_property(std::string& report)
 
     // transitivity
     {
-        tipl::image<float,2> norm_matrix2(norm_matrix.geometry());
-        tipl::image<float,2> norm_matrix3(norm_matrix.geometry());
-        tipl::mat::product(norm_matrix.begin(),norm_matrix.begin(),norm_matrix2.begin(),tipl::dyndim(n,n),tipl::dyndim(n,n));
-        tipl::mat::product(norm_matrix2.begin(),norm_matrix.begin(),norm_matrix3.begin(),tipl::dyndim(n,n),tipl::dyndim(n,n));
-        out << "transitivity(binary)\t" << tipl::mat::trace(norm_matrix3.begin(),tipl::dyndim(n,n)) /
-                (std::accumulate(norm_matrix2.begin(),norm_matrix2.end(),0.0) - tipl::mat::trace(norm_matrix2.begin(),tipl::dyndim(n,n))) << std::endl;
+        out << "transitivity(binary)\t" << trace3/(sum2-trace2) << std::endl;
         float k = 0;
         for(unsigned int i = 0;i < n;++i)
             k += degree[i]*(degree[i]-1);
-        out << "transitivity(weighted)\t" << (k == 0 ? 0 : tipl::mat::trace(cyc3.begin(),tipl::dyndim(n,n))/k) << std::endl;
+        out << "transitivity(weighted)\t" << (k == 0 ? 0 : std::accumulate(cyc3.begin(),cyc3.end(),0.0)/k) << std::endl;
     }
 
     std::vector<float> eccentricity_bin(n),eccentricity_wei(n);
 
     {
         tipl::image<float,2> dis_bin,dis_wei;
-        distance_bin(binary_matrix,dis_bin);
-        distance_wei(norm_matrix,dis_wei);
+        if(sparse)
+        {
+            graph->distance(dis_bin,true);
+            graph->distance(dis_wei,false);
+        }
+        else
+        {
+            distance_bin(binary_matrix,dis_bin);
+            distance_wei(norm_matrix,dis_wei);
+        }
         unsigned int inf_count_bin = std::count(dis_bin.begin(),dis_bin.end(),std::numeric_limits<float>::max());
         unsigned int inf_count_wei = std::count(dis_wei.begin(),dis_wei.end(),std::numeric_limits<float>::max());
         std::replace(dis_bin.begin(),dis_bin.end(),std::numeric_limits<float>::max(),(float)0);
@@ -2755,7 +3892,10 @@ void ConnectivityMatrix::network_property(std::string& report)
         std::replace(eccentricity_wei.begin(),eccentricity_wei.end(),std::numeric_limits<float>::max(),(float)0);
     }
 
-    std::vector<float> local_efficiency_bin(n);
+    std::vector<float> local_efficiency_bin(n),local_efficiency_wei(n);
+    if(sparse)
+        graph->local_efficiency(local_efficiency_bin,local_efficiency_wei);
+    else
     //claculate local efficiency
     {
         for(unsigned int i = 0,ipos = 0;i < n;++i,ipos += n)
@@ -2781,7 +3921,7 @@ void ConnectivityMatrix::network_property(std::string& report)
         }
     }
 
-    std::vector<float> local_efficiency_wei(n);
+    if(!sparse)
     {
 
         for(unsigned int i = 0,ipos = 0;i < n;++i,ipos += n)
@@ -2910,7 +4050,13 @@ void ConnectivityMatrix::network_property(std::string& report)
     }
 
     // betweenness
-    std::vector<float> betweenness_bin(n);
+    std::vector<float> betweenness_bin(n),betweenness_wei(n);
+    if(sparse)
+    {
+        graph->betweenness(betweenness_bin,true);
+        graph->betweenness(betweenness_wei,false);
+    }
+    else
     {
 
         tipl::image<unsigned int,2> NPd(binary_matrix),NSPd(binary_matrix),NSP(binary_matrix);
@@ -2957,7 +4103,7 @@ void ConnectivityMatrix::network_property(std::string& report)
             for(unsigned int j = 0;j < n;++j,++index)
                 betweenness_bin[j] += DP[index];
     }
-    std::vector<float> betweenness_wei(n);
+    if(!sparse)
     {
 
         for(unsigned int i = 0;i < n;++i)
@@ -3037,6 +4183,12 @@ void ConnectivityMatrix::network_property(std::string& report)
 
 
     std::vector<float> eigenvector_centrality_bin(n),eigenvector_centrality_wei(n);
+    if(sparse)
+    {
+        graph->eigenvector_centrality(eigenvector_centrality_bin,true);
+        graph->eigenvector_centrality(eigenvector_centrality_wei,false);
+    }
+    else
     {
         tipl::image<float,2> bin;
         bin = binary_matrix;
@@ -3053,26 +4205,33 @@ void ConnectivityMatrix::network_property(std::string& report)
         std::vector<float> deg_bin(degree.begin(),degree.end()),deg_wei(strength.begin(),strength.end());
         std::replace(deg_bin.begin(),deg_bin.end(),0.0f,1.0f);
         std::replace(deg_wei.begin(),deg_wei.end(),0.0f,1.0f);
-
-        tipl::image<float,2> B_bin(binary_matrix.geometry()),B_wei(binary_matrix.geometry());
-        for(unsigned int i = 0,index = 0;i < n;++i)
-            for(unsigned int j = 0;j < n;++j,++index)
-            {
-                B_bin[index] = -d*((float)binary_matrix[index])*1.0/deg_bin[j];
-                B_wei[index] = -d*norm_matrix[index]*1.0/deg_wei[j];
-                if(i == j)
+        if(sparse)
+        {
+            graph->pagerank(pagerank_centrality_bin,deg_bin,true);
+            graph->pagerank(pagerank_centrality_wei,deg_wei,false);
+        }
+        else
+        {
+            tipl::image<float,2> B_bin(binary_matrix.geometry()),B_wei(binary_matrix.geometry());
+            for(unsigned int i = 0,index = 0;i < n;++i)
+                for(unsigned int j = 0;j < n;++j,++index)
                 {
-                    B_bin[index] += 1.0;
-                    B_wei[index] += 1.0;
+                    B_bin[index] = -d*((float)binary_matrix[index])*1.0/deg_bin[j];
+                    B_wei[index] = -d*norm_matrix[index]*1.0/deg_wei[j];
+                    if(i == j)
+                    {
+                        B_bin[index] += 1.0;
+                        B_wei[index] += 1.0;
+                    }
                 }
-            }
-        std::vector<unsigned int> pivot(n);
-        std::vector<float> b(n);
-        std::fill(b.begin(),b.end(),(1.0-d)/n);
-        tipl::mat::lu_decomposition(B_bin.begin(),pivot.begin(),tipl::dyndim(n,n));
-        tipl::mat::lu_solve(B_bin.begin(),pivot.begin(),b.begin(),pagerank_centrality_bin.begin(),tipl::dyndim(n,n));
-        tipl::mat::lu_decomposition(B_wei.begin(),pivot.begin(),tipl::dyndim(n,n));
-        tipl::mat::lu_solve(B_wei.begin(),pivot.begin(),b.begin(),pagerank_centrality_wei.begin(),tipl::dyndim(n,n));
+            std::vector<unsigned int> pivot(n);
+            std::vector<float> b(n);
+            std::fill(b.begin(),b.end(),(1.0-d)/n);
+            tipl::mat::lu_decomposition(B_bin.begin(),pivot.begin(),tipl::dyndim(n,n));
+            tipl::mat::lu_solve(B_bin.begin(),pivot.begin(),b.begin(),pagerank_centrality_bin.begin(),tipl::dyndim(n,n));
+            tipl::mat::lu_decomposition(B_wei.begin(),pivot.begin(),tipl::dyndim(n,n));
+            tipl::mat::lu_solve(B_wei.begin(),pivot.begin(),b.begin(),pagerank_centrality_wei.begin(),tipl::dyndim(n,n));
+        }
 
         float sum_bin = std::accumulate(pagerank_centrality_bin.begin(),pagerank_centrality_bin.end(),0.0);
         float sum_wei = std::accumulate(pagerank_centrality_wei.begin(),pagerank_centrality_wei.end(),0.0);
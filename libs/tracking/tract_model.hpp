@@ -1,11 +1,91 @@
 #ifndef TRACT_MODEL_HPP
 #define TRACT_MODEL_HPP
 #include <vector>
+#include <algorithm>
 #include <iosfwd>
+#include <mutex>
+#include <unordered_map>
 #include "tipl/tipl.hpp"
 #include "fib_data.hpp"
+#include "tract_arena.hpp"
 
 class RoiMgr;
+// receives tracts as they are generated so that they do not have to be kept in memory
+class tract_sink{
+public:
+    std::string file_name;// the file actually written, e.g. with .gz added to .trk
+public:
+    virtual ~tract_sink(void){}
+    // tracts are in voxel coordinates and may be moved out by the sink
+    virtual void add(std::vector<std::vector<float> >& tracts) = 0;
+    virtual bool close(void){return true;}
+    virtual size_t get_count(void) const = 0;
+};
+// .trk.gz or .tck writes tracts to file, .nii or .nii.gz accumulates a track density image
+std::shared_ptr<tract_sink> create_tract_sink(const std::string& file_name,
+                                              tipl::geometry<3> geo,tipl::vector<3> vs,
+                                              const std::vector<float>& trans);
+// region labels of each voxel. A voxel in one region stores the region in the label volume,
+// and only voxels shared by several regions refer to a list in the overflow table.
+class region_label_map{
+public:
+    struct span{
+        const short* from;
+        const short* to;
+        const short* begin(void) const{return from;}
+        const short* end(void) const{return to;}
+        size_t size(void) const{return to-from;}
+        bool empty(void) const{return from == to;}
+        short operator[](size_t index) const{return from[index];}
+    };
+private:
+    static const unsigned int overflow_flag = 0x80000000;
+    // 0: no region, region+1, or overflow_flag|list index
+    std::vector<unsigned int> label;
+    std::vector<short> region_id;
+    std::vector<short> overflow;
+    std::vector<unsigned int> overflow_offset = std::vector<unsigned int>(1);
+public:
+    void clear(size_t voxel_count,unsigned int region_count)
+    {
+        label.clear();
+        label.resize(voxel_count);
+        region_id.resize(region_count);
+        for(unsigned int i = 0;i < region_count;++i)
+            region_id[i] = short(i);
+        overflow.clear();
+        overflow_offset.resize(1);
+    }
+    size_t size(void) const{return label.size();}
+    // regions should be sorted and without duplicates
+    void set(size_t index,const std::vector<short>& regions)
+    {
+        if(regions.empty())
+            label[index] = 0;
+        else
+        if(regions.size() == 1)
+            label[index] = (unsigned int)(regions[0])+1;
+        else
+        {
+            label[index] = overflow_flag | (unsigned int)(overflow_offset.size()-1);
+            overflow.insert(overflow.end(),regions.begin(),regions.end());
+            overflow_offset.push_back((unsigned int)overflow.size());
+        }
+    }
+    span operator[](size_t index) const
+    {
+        unsigned int l = label[index];
+        if(!l)
+            return span{nullptr,nullptr};
+        if(!(l & overflow_flag))
+            return span{&region_id[l-1],&region_id[l-1]+1};
+        l &= ~overflow_flag;
+        return span{&overflow[0]+overflow_offset[l],&overflow[0]+overflow_offset[l+1]};
+    }
+    size_t labeled_count(void) const{return label.size()-std::count(label.begin(),label.end(),0);}
+    size_t overlap_count(void) const{return overflow_offset.size()-1;}
+};
+
 class TractModel{
 public:
         std::string report;
@@ -15,8 +95,9 @@ private:
         tipl::vector<3> vs;
         std::shared_ptr<tracking_data> fib;
 private:
-        std::vector<std::vector<float> > tract_data;
-        std::vector<std::vector<float> > deleted_tract_data;
+        // visible tracts, and the slots of the deleted tracts kept for undo
+        tract_arena tract_data;
+        std::vector<unsigned int> deleted_tract_slot;
         std::vector<unsigned int> tract_color;
         std::vector<unsigned int> tract_tag;
         std::vector<unsigned int> deleted_tract_color;
@@ -30,6 +111,20 @@ private:
 private:
         // for loading multiple clusters
         std::vector<unsigned int> tract_cluster;
+private:
+        // voxel-hash buckets of the tract starting points used by find_nearest,
+        // built on the first query and dropped whenever tract_data changes.
+        // The mutex guards both the reset and the queries.
+        std::unordered_map<uint64_t,std::vector<unsigned int> > start_point_bucket;
+        bool start_point_bucket_built = false;
+        std::unique_ptr<std::mutex> start_point_bucket_mutex = std::unique_ptr<std::mutex>(new std::mutex);
+        void get_start_point_candidates(const float* trk,float width,std::vector<unsigned int>& candidates);
+        void clear_start_point_bucket(void)
+        {
+            std::lock_guard<std::mutex> lock(*start_point_bucket_mutex);
+            start_point_bucket.clear();
+            start_point_bucket_built = false;
+        }
 public:
         static bool save_all(const char* file_name,const std::vector<std::shared_ptr<TractModel> >& all);
         const std::vector<unsigned int>& get_cluster_info(void) const{return tract_cluster;}
@@ -48,10 +143,23 @@ public:
         TractModel(std::shared_ptr<fib_data> handle_);
         const TractModel& operator=(const TractModel& rhs)
         {
+            if(this == &rhs)
+                return *this;
             geometry = rhs.geometry;
             vs = rhs.vs;
             handle = rhs.handle;
-            tract_data = rhs.tract_data;
+            // only the visible tracts are copied
+            tract_data.clear();
+            tract_data.reserve(rhs.tract_data.size(),rhs.tract_data.coordinate_count());
+            for(size_t index = 0;index < rhs.tract_data.size();++index)
+                tract_data.push_back(rhs.tract_data[index]);
+            deleted_tract_slot.clear();
+            deleted_tract_color.clear();
+            deleted_tract_tag.clear();
+            deleted_count.clear();
+            is_cut.clear();
+            redo_size.clear();
+            clear_start_point_bucket();
             tract_color = rhs.tract_color;
             tract_tag = rhs.tract_tag;
             report = rhs.report;
@@ -62,9 +170,12 @@ public:
         tracking_data& get_fib(void){return *fib.get();}
         void add(const TractModel& rhs);
         bool load_from_file(const char* file_name,bool append = false);
+        // loads tracts [from,from+count) of a .tkc file without decoding the other chunks
+        bool load_range_from_file(const char* file_name,size_t from,size_t count);
 
         bool save_tracts_in_native_space(const char* file_name,tipl::image<tipl::vector<3,float>,3 > native_position);
         bool save_tracts_to_file(const char* file_name);
+        bool save_chunk_file(const char* file_name,const std::vector<std::vector<float> >* scalar);
         void save_vrml(const char* file_name,
                        unsigned char tract_style,
                        unsigned char tract_color_style,
@@ -107,20 +218,20 @@ public:
         void get_end_points(std::vector<tipl::vector<3,float> >& points);
         void get_tract_points(std::vector<tipl::vector<3,float> >& points);
 
-        size_t get_deleted_track_count(void) const{return deleted_tract_data.size();}
+        size_t get_deleted_track_count(void) const{return deleted_tract_slot.size();}
         size_t get_visible_track_count(void) const{return tract_data.size();}
         
-        const std::vector<float>& get_tract(unsigned int index) const{return tract_data[index];}
-        const std::vector<std::vector<float> >& get_tracts(void) const{return tract_data;}
-        const std::vector<std::vector<float> >& get_deleted_tracts(void) const{return deleted_tract_data;}
-        std::vector<std::vector<float> >& get_tracts(void) {return tract_data;}
+        tract_arena::const_span get_tract(unsigned int index) const{return tract_data[index];}
+        const tract_arena& get_tracts(void) const{return tract_data;}
+        void get_deleted_tracts(std::vector<std::vector<float> >& tracts) const;
         unsigned int get_tract_color(unsigned int index) const{return tract_color[index];}
         size_t get_tract_length(unsigned int index) const{return tract_data[index].size();}
         void get_density_map(tipl::image<unsigned int,3>& mapping,
              const tipl::matrix<4,4,float>& transformation,bool endpoint);
         void get_density_map(tipl::image<tipl::rgb,3>& mapping,
              const tipl::matrix<4,4,float>& transformation,bool endpoint);
-        void save_tdi(const char* file_name,bool sub_voxel,bool endpoint,const std::vector<float>& tran);
+        // ratio is the super-sampling factor of the output resolution
+        void save_tdi(const char* file_name,float ratio,bool endpoint,const std::vector<float>& tran);
 
         void get_quantitative_data(std::vector<float>& data);
         void get_quantitative_info(std::string& result);
@@ -143,11 +254,11 @@ public:
         void get_tracts_data(unsigned int index_num,float& mean, float& sd) const;
 public:
 
-        void get_passing_list(const std::vector<std::vector<short> >& region_map,
+        void get_passing_list(const region_label_map& region_map,
                               unsigned int region_count,
                                      std::vector<std::vector<short> >& passing_list1,
                                      std::vector<std::vector<short> >& passing_list2) const;
-        void get_end_list(const std::vector<std::vector<short> >& region_map,
+        void get_end_list(const region_label_map& region_map,
                                      std::vector<std::vector<short> >& end_list1,
                                      std::vector<std::vector<short> >& end_list2) const;
         void run_clustering(unsigned char method_id,unsigned int cluster_count,float param);
@@ -163,7 +274,7 @@ public:
 
     tipl::image<float,2> matrix_value;
 public:
-    std::vector<std::vector<short> > region_map;
+    region_label_map region_map;
     unsigned int region_count;
     std::vector<std::string> region_name;
     std::string error_msg,atlas_name;
@@ -177,7 +288,11 @@ public:
     void save_to_connectogram(const char* file_name);
     void save_to_text(std::string& text);
     bool calculate(TractModel& tract_model,std::string matrix_value_type,bool use_end_only,float threshold);
-    void network_property(std::string& report);
+    // computes the matrices of several value types in one pass over the tracts
+    bool calculate(TractModel& tract_model,const std::vector<std::string>& matrix_value_types,
+                   bool use_end_only,float threshold,std::vector<tipl::image<float,2> >& matrix_values);
+    // sparse uses a CSR graph with parallel path searches for large parcellations
+    void network_property(std::string& report,bool sparse = false);
 };
 
 
@@ -263,6 +263,7 @@ void TractTableWidget::load_tracts(QStringList filenames)
         label.remove(".trk");
         label.remove(".gz");
         label.remove(".txt");
+        label.remove(".tkc");
         std::string sfilename = filename.toStdString();
         addNewTracts(label);
         if(!tract_models.back()->load_from_file(&*sfilename.begin(),false))
@@ -275,9 +276,17 @@ void TractTableWidget::load_tracts(QStringList filenames)
         if(tract_models.back()->get_cluster_info().empty()) // not multiple cluster file
         {
             item(tract_models.size()-1,1)->setText(QString::number(tract_models.back()->get_visible_track_count()));
-            tipl::rgb c;
-            c.from_hsl(((color_gen++)*1.1-std::floor((color_gen++)*1.1/6)*6)*3.14159265358979323846/3.0,0.85,0.7);
-            tract_models.back()->set_color(c.color);
+            // .tkc files keep the tract colors, if any were saved
+            bool has_color = false;
+            if(filename.endsWith(".tkc"))
+                for(unsigned int i = 0;i < tract_models.back()->get_visible_track_count() && !has_color;++i)
+                    has_color = tract_models.back()->get_tract_color(i) != 0;
+            if(!has_color)
+            {
+                tipl::rgb c;
+                c.from_hsl(((color_gen++)*1.1-std::floor((color_gen++)*1.1/6)*6)*3.14159265358979323846/3.0,0.85,0.7);
+                tract_models.back()->set_color(c.color);
+            }
         }
         else
         {
@@ -293,7 +302,7 @@ void TractTableWidget::load_tracts(void)
 {
     load_tracts(QFileDialog::getOpenFileNames(
             this,"Load tracts as",QFileInfo(cur_tracking_window.windowTitle()).absolutePath(),
-            "Tract files (*.txt *.trk *trk.gz *.tck);;All files (*)"));
+            "Tract files (*.txt *.trk *trk.gz *.tck *.tkc);;All files (*)"));
 
 }
 void TractTableWidget::load_tract_label(void)
@@ -338,6 +347,8 @@ QString TractTableWidget::output_format(void)
         return ".trk";
     case 2:
         return ".txt";
+    case 3:
+        return ".tkc";
     }
     return "";
 }
@@ -367,7 +378,7 @@ void TractTableWidget::save_all_tracts_as(void)
     QString filename;
     filename = QFileDialog::getSaveFileName(
                 this,"Save tracts as",item(currentRow(),0)->text().replace(':','_') + output_format(),
-                "Tract files (*.trk *trk.gz);;Text File (*.txt);;MAT files (*.mat);;All files (*)");
+                "Tract files (*.trk *trk.gz *.tkc);;Text File (*.txt);;MAT files (*.mat);;All files (*)");
     if(filename.isEmpty())
         return;
     std::string sfilename = filename.toLocal8Bit().begin();
@@ -470,7 +481,7 @@ void TractTableWidget::clustering(int method_id)
     if(!ok)
         return;
     ok = true;
-    double detail = method_id ? 0.0 : QInputDialog::getDouble(this,
+    double detail = (method_id == 1 || method_id == 2) ? 0.0 : QInputDialog::getDouble(this,
             "DSI Studio","Clustering detail (mm):",cur_tracking_window.handle->vs[0],0.2,50.0,2,&ok);
     if(!ok)
         return;
@@ -487,7 +498,7 @@ void TractTableWidget::save_tracts_as(void)
     QString filename;
     filename = QFileDialog::getSaveFileName(
                 this,"Save tracts as",item(currentRow(),0)->text().replace(':','_') + output_format(),
-                 "Tract files (*.trk *trk.gz);;Text File (*.txt);;MAT files (*.mat);;TCK file (*.tck);;ROI files (*.nii *nii.gz);;All files (*)");
+                 "Tract files (*.trk *trk.gz *.tkc);;Text File (*.txt);;MAT files (*.mat);;TCK file (*.tck);;ROI files (*.nii *nii.gz);;All files (*)");
     if(filename.isEmpty())
         return;
     std::string sfilename = filename.toLocal8Bit().begin();
@@ -512,7 +523,7 @@ void TractTableWidget::save_tracts_in_native(void)
     QString filename;
     filename = QFileDialog::getSaveFileName(
                 this,"Save tracts as",item(currentRow(),0)->text().replace(':','_') + output_format(),
-                 "Tract files (*.trk *trk.gz);;Text File (*.txt);;MAT files (*.mat);;All files (*)");
+                 "Tract files (*.trk *trk.gz *.tkc);;Text File (*.txt);;MAT files (*.mat);;All files (*)");
     if(filename.isEmpty())
         return;
     std::string sfilename = filename.toLocal8Bit().begin();
@@ -645,7 +656,8 @@ void TractTableWidget::save_profile(void)
     begin_prog("converting coordinates");
     for(unsigned int i = 0;check_prog(i,tract_models[currentRow()]->get_tracts().size());++i)
     {
-        if(!cur_tracking_window.handle->get_profile(tract_models[currentRow()]->get_tracts()[i],profile))
+        auto tract = tract_models[currentRow()]->get_tracts()[i];
+        if(!cur_tracking_window.handle->get_profile(std::vector<float>(tract.begin(),tract.end()),profile))
             continue;
         out.write(QString("image%1").arg(i).toLocal8Bit().begin(),&profile[0],1,profile.size());
     }
@@ -675,7 +687,7 @@ void TractTableWidget::deep_learning_train(void)
             tipl::image<unsigned char,3> track_map(cur_tracking_window.handle->dim);
             for(unsigned int i = 0;i < tract_models[index]->get_tracts().size();++i)
             {
-                const std::vector<float>& tracks = tract_models[index]->get_tracts()[i];
+                auto tracks = tract_models[index]->get_tracts()[i];
                 for(int j = 0;j < tracks.size();j += 3)
                 {
                     tipl::pixel_index<3> p(std::round(tracks[j]),std::round(tracks[j+1]),std::round(tracks[j+2]),track_map.geometry());
@@ -759,7 +771,8 @@ void TractTableWidget::saveTransformedTracts(const float* transform)
         tract_models[currentRow()]->save_transformed_tracts_to_file(&*sfilename.begin(),transform,false);
     else
     {
-        std::vector<std::vector<float> > tract_data(tract_models[currentRow()]->get_tracts());
+        std::vector<std::vector<float> > tract_data;
+        tract_models[currentRow()]->get_tracts().get_tracts(tract_data);
         begin_prog("converting coordinates");
         for(unsigned int i = 0;check_prog(i,tract_data.size());++i)
         {
@@ -780,9 +793,9 @@ void TractTableWidget::saveTransformedTracts(const float* transform)
         }
         if(!prog_aborted())
         {
-            tract_models[currentRow()]->get_tracts().swap(tract_data);
-            tract_models[currentRow()]->save_tracts_to_file(&*sfilename.begin());
-            tract_models[currentRow()]->get_tracts().swap(tract_data);
+            TractModel mni_tracts(cur_tracking_window.handle);
+            mni_tracts.add_tracts(tract_data);
+            mni_tracts.save_tracts_to_file(&*sfilename.begin());
         }
     }
 }
@@ -992,7 +1005,7 @@ void TractTableWidget::save_tracts_data_as(void)
         return;
     QString filename = QFileDialog::getSaveFileName(
                 this,"Save as",item(currentRow(),0)->text() + "_" + action->data().toString() + ".txt",
-                "Text files (*.txt);;MATLAB file (*.mat);;TRK file (*.trk *.trk.gz);;All files (*)");
+                "Text files (*.txt);;MATLAB file (*.mat);;TRK file (*.trk *.trk.gz);;Chunked tract file (*.tkc);;All files (*)");
     if(filename.isEmpty())
         return;
 
@@ -1046,7 +1059,8 @@ void TractTableWidget::separate_deleted_track(void)
 {
     unsigned int cur_row = currentRow();
     addNewTracts(item(cur_row,0)->text(),false);
-    std::vector<std::vector<float> > new_tracks = tract_models[cur_row]->get_deleted_tracts();
+    std::vector<std::vector<float> > new_tracks;
+    tract_models[cur_row]->get_deleted_tracts(new_tracks);
     if(new_tracks.empty())
         return;
     tract_models.back()->add_tracts(new_tracks);